@@ -3,13 +3,65 @@
  *
  * Created: 09/06/2022 12:08:28 p. m.
  * Author : Alan Samuel Aguirre Salazar
+ *
+ * Perfil de tarjeta (-DBOARD=...): BOARD_REAL, BOARD_PROTEUS (por defecto) o BOARD_HOST.
+ * Simulacin en PC: gcc -DBOARD=BOARD_HOST -o feeder_sim main.c -lm && ./feeder_sim -h
+ * Tolvas (-DCHANNELS=1..4): cada una con su Hx711 y su servo, ver el mapa de pines.
+ * Trace (-DTRACE=1): registro binario de lo que ve el firmware por la USART; el simulador
+ * lo graba (-O), lo resume (-Y) y lo reproduce contra el firmware (-R).
+ * Perfilado (-DPROFILE=1): llamadas y ciclos de las funciones calientes en pginas del
+ * diagnstico y al final de la simulacin.
+ * Prueba de resistencia: ./feeder_sim -M 400 simula 400 das con cortes de luz y cambios de
+ * horario y revisa que cada alarma se atienda exactamente una vez por da.
+ * Enlace (-DLINK=1): alarmas, tope de comida, calibracin y hora en una sola trama por la
+ * USART. El cliente es el mismo ejecutable: ./feeder_sim -U puerto leer|escribir ..., contra
+ * el equipo o contra un simulador con -Q (ver -h). Con ./feeder_sim -U puerto muestras se ven
+ * las muestras de peso con su hora, las mismas que usan la pantalla, el despacho y el historial.
+ * Plato (-DBOWL=1): una celda bajo el plato en el canal B del Hx711 de cada tolva; el despacho
+ * corta tambin cuando la comida llega al plato y avisa si lo que baj la tolva no lleg.
+ * Red (-DNET=1): esclavo I2C con un mapa de registros (peso, alarmas, ltima comida y un comando
+ * de dar comida) para que un coordinador atienda muchos equipos en un bus compartido. El
+ * simulador con -W n arranca n equipos y hace de coordinador.
+ * SRAM (1 KB): no todas las combinaciones caben; la compilacin para el micro lo revisa (ver
+ * Presupuesto de SRAM).
  */ 
 
 // ----------------------- Definiciones -----------------------
 // Frecuencia CPU.
-	#define F_CPU 4000000
+	#ifndef F_CPU
+		#define F_CPU 4000000
+	#endif
+
+// Perfiles de tarjeta. Cada uno fija pines, polaridad del busy flag y tiempos en compilacin.
+	#define BOARD_REAL    0					// HD44780 real.
+	#define BOARD_PROTEUS 1					// Simulacin en Proteus.
+	#define BOARD_HOST    2					// Simulacin en PC (ver seccin del final).
+	#ifndef BOARD
+		#define BOARD BOARD_PROTEUS
+	#endif
+	#ifndef TRACE
+		#define TRACE 0							// 1: registro binario por la USART (ver Definiciones del trace).
+	#endif
+	#ifndef PROFILE
+		#define PROFILE 0						// 1: contadores de ciclos por funcin (ver Definiciones del perfilado).
+	#endif
+	#ifndef LINK
+		#define LINK 0							// 1: configuracin por la USART (ver Definiciones del enlace).
+	#endif
+	#ifndef BOWL
+		#define BOWL 0							// 1: celda del plato en el canal B de cada Hx711 (ver Definiciones del plato).
+	#endif
+	#ifndef NET
+		#define NET 0							// 1: esclavo del bus I2C de la red (ver Definiciones de la red).
+	#endif
+	#if TRACE && LINK
+		#error "TRACE y LINK usan la misma USART: compile uno a la vez"
+	#endif
+	#define USART_USED (TRACE || LINK)
+	#define CFG_REMOTE (LINK || NET)			// La configuracin llega en un bloque (enlace o red).
 	
-// Definiciones del LCD.
+// Mapa de pines.
+	// LCD en PORTA: datos en PA0-PA3.
 	#define DDRLCD DDRA
 	#define PORTLCD PORTA
 	#define PINLCD PINA
@@ -17,6 +69,128 @@
 	#define RW 5
 	#define E 6
 	#define BF 3
+	
+	// Botones en PORTB, activos en bajo.
+	#define DDRBTN DDRB
+	#define PORTBTN PORTB
+	#define PINBTN PINB
+	#define BTN_LEFT   0
+	#define BTN_MIDDLE 1
+	#define BTN_RIGHT  2
+	
+	// Canales (tolvas): letra del puerto y bits DOUT/SCK del Hx711, letra y bit del servo.
+	// Son constantes de compilacin para que cada acceso sea una sola instruccin (sbi, cbi,
+	// sbic); el cdigo elige la rama del canal con CH_DISPATCH.
+	// El canal 0 conserva los pines originales salvo con TRACE o LINK, que necesitan PD0/PD1
+	// para la USART: su Hx711 pasa a PC6/PC7 (TOSC, libres sin el Timer2 asncrono). PC2-PC5
+	// son pines de JTAG: con ms de dos canales el arranque apaga JTAG.
+	#if USART_USED
+		#define CH0_HX_IO     C
+		#define CH0_HX_DOUT   6
+		#define CH0_HX_SCK    7
+	#else
+		#define CH0_HX_IO     D
+		#define CH0_HX_DOUT   0
+		#define CH0_HX_SCK    1
+	#endif
+	#define CH0_SERVO_IO  D
+	#define CH0_SERVO_BIT 5
+	#define CH1_HX_IO     D
+	#define CH1_HX_DOUT   2
+	#define CH1_HX_SCK    3
+	#define CH1_SERVO_IO  D
+	#define CH1_SERVO_BIT 4
+	#define CH2_HX_IO     C
+	#define CH2_HX_DOUT   2
+	#define CH2_HX_SCK    3
+	#define CH2_SERVO_IO  D
+	#define CH2_SERVO_BIT 6
+	#define CH3_HX_IO     C
+	#define CH3_HX_DOUT   4
+	#define CH3_HX_SCK    5
+	#define CH3_SERVO_IO  D
+	#define CH3_SERVO_BIT 7
+	
+	// Pin RATE compartido por los Hx711 de todas las tolvas (en bajo 10 muestras/s, en alto 80).
+	#define HX_RATE_DDR  DDRB
+	#define HX_RATE_PORT PORTB
+	#define HX_RATE_PIN  3
+	
+	// Con NET: EN del repetidor (PCA9517) que une el bus I2C de la tarjeta con el de la red.
+	#define NET_EN_DDR   DDRB
+	#define NET_EN_PORT  PORTB
+	#define NET_EN_PIN   4
+	
+// Acceso a pines y tiempos segn el perfil (sin decisiones en tiempo de ejecucin).
+	#if BOARD == BOARD_REAL
+		#define LCD_READY()   (!(PINLCD & (1<<BF)))	// El HD44780 pone BF en 1 mientras est ocupado.
+		#define LCD_E_PULSE() _delay_us(1)
+		#define WATCHDOG      1
+		#define BOOT_BUDGET_MS 50						// Del reset a la primera pantalla vlida.
+	#elif BOARD == BOARD_PROTEUS
+		#define LCD_READY()   (PINLCD & (1<<BF))		// Proteus reporta la bandera invertida.
+		#define LCD_E_PULSE() _delay_ms(10)
+		#define WATCHDOG      0						// Con pulsos de 10 ms redibujar tarda ms que el watchdog.
+		#define BOOT_BUDGET_MS 2000
+	#elif BOARD == BOARD_HOST
+		#define LCD_E_PULSE() _delay_us(1)
+		#define WATCHDOG      1
+		#define BOOT_BUDGET_MS 50
+	#else
+		#error "BOARD desconocido"
+	#endif
+	
+	// Registros de un puerto por su letra: IO_PORT(C) es PORTC.
+	#define IO_CAT(a, b)  IO_CAT_(a, b)
+	#define IO_CAT_(a, b) a##b
+	#define IO_PORT(io)   IO_CAT(PORT, io)
+	#define IO_PIN(io)    IO_CAT(PIN, io)
+	#define IO_DDR(io)    IO_CAT(DDR, io)
+	
+	// Una rama del switch por canal con sus pines constantes: X(n) recibe el nmero literal.
+	#define CH_CASE0(X) case 0: X(0); break;
+	#if CHANNELS > 1
+		#define CH_CASE1(X) case 1: X(1); break;
+	#else
+		#define CH_CASE1(X)
+	#endif
+	#if CHANNELS > 2
+		#define CH_CASE2(X) case 2: X(2); break;
+	#else
+		#define CH_CASE2(X)
+	#endif
+	#if CHANNELS > 3
+		#define CH_CASE3(X) case 3: X(3); break;
+	#else
+		#define CH_CASE3(X)
+	#endif
+	#define CH_DISPATCH(ch, X) switch(ch){ CH_CASE0(X) CH_CASE1(X) CH_CASE2(X) CH_CASE3(X) }
+	
+	// Pines de la tolva n.
+	#define HX_PINS(n)     &IO_PORT(CH##n##_HX_IO), &IO_PIN(CH##n##_HX_IO), 1<<CH##n##_HX_DOUT, 1<<CH##n##_HX_SCK
+	#define SERVO_HIGH(n)  (IO_PORT(CH##n##_SERVO_IO) |= (1<<CH##n##_SERVO_BIT))
+	#define SERVO_LOW(n)   (IO_PORT(CH##n##_SERVO_IO) &= ~(1<<CH##n##_SERVO_BIT))
+	#define CH_PINS_INIT(n) (IO_DDR(CH##n##_HX_IO) |= (1<<CH##n##_HX_SCK), IO_PORT(CH##n##_HX_IO) &= ~(1<<CH##n##_HX_SCK), \
+	                         IO_DDR(CH##n##_SERVO_IO) |= (1<<CH##n##_SERVO_BIT))
+	
+	#if BOARD == BOARD_HOST
+		#define HX_SCK_HIGH(ch, port, mask) ((void)(port), (void)(mask), simHxClock(ch, 1))
+		#define HX_SCK_LOW(ch, port, mask)  ((void)(port), (void)(mask), simHxClock(ch, 0))
+		#define HX_DOUT_HIGH(ch, pin, mask) ((void)(pin), (void)(mask), simHxDout(ch))
+		#define BTN_READ(bit)  simButtonDown(bit)
+	#else
+		#define HX_SCK_HIGH(ch, port, mask) (*(port) |= (mask))
+		#define HX_SCK_LOW(ch, port, mask)  (*(port) &= ~(mask))
+		#define HX_DOUT_HIGH(ch, pin, mask) (*(pin) & (mask))
+		#define BTN_READ(bit)  (!(PINBTN & (1<<(bit))))
+	#endif
+	#if TRACE
+		#define BTN_DOWN(bit)  Trace_Button(bit, BTN_READ(bit))	// Registra los cambios.
+	#else
+		#define BTN_DOWN(bit)  BTN_READ(bit)
+	#endif
+	
+// Definiciones del LCD.
 	#define LCD_Cmd_Clear      0b00000001
 	#define LCD_Cmd_Home       0b00000010
 	#define LCD_Cmd_ModeDnS	   0b00000110			// Sin shift cursor a la derecha.
@@ -30,31 +204,571 @@
 	#define LCD_Cmd_Func2Lin   0b00101000
 	#define LCD_Cmd_Func1LinCh 0b00100000
 	#define LCD_Cmd_Func1LinG  0b00100100
+	#define LCD_LINE1          0b10000000			// Direccin DDRAM del inicio de cada rengln.
+	#define LCD_LINE2          0b11000000
+	
+// Formatos de los elementos de una pantalla.
+	#define FMT_TEXT   0						// Texto fijo en flash.
+	#define FMT_DATE   1						// dd/mm/aa del DS3231.
+	#define FMT_TIME   2						// hh:mm del DS3231.
+	#define FMT_WEIGHT 3						// shownAmount en gramos, borra el resto del rengln.
+	#define FMT_ALARM  4						// shownHours:shownMinutes.
+	#define FMT_GRAMS  5						// shownAmount alineado a 3 dgitos.
+	#define FMT_BOOT   6						// Nombre y tiempo de la fase de arranque shownPhase.
+	#define FMT_TARGET 7						// Tolva de shownTarget: T* (todas) o T1..T4.
+	#define FMT_CHANNEL 8						// Nmero de la tolva shownChannel.
+	#define FMT_REFILL 9						// "!d" si quedan menos de HIST_WARN_DAYS das de comida.
+	#define FMT_ALL    254
+	#define FMT_END    255
 	
 // Definiciones I2C.
-	#define SCL_CLOCK  100000L
+	#define I2C_STANDARD_MODE 100000L
+	#define I2C_FAST_MODE     400000L
+	#ifndef SCL_CLOCK
+		#define SCL_CLOCK  I2C_STANDARD_MODE
+	#endif
+	
+	// SCL = F_CPU/(16 + 2*TWBR*4^TWPS). Se redondea hacia arriba para nunca pasar de SCL_CLOCK.
+	#define I2C_DIVIDER (((F_CPU + SCL_CLOCK - 1)/SCL_CLOCK - 16 + 1)/2)
+	#if I2C_DIVIDER < 10
+		#error "SCL_CLOCK inalcanzable con este F_CPU: TWBR debe ser >= 10 en modo maestro (400 kHz requiere F_CPU >= 14.4 MHz)"
+	#elif I2C_DIVIDER <= 255
+		#define I2C_TWPS 0
+		#define I2C_TWBR I2C_DIVIDER
+	#elif (I2C_DIVIDER + 3)/4 <= 255
+		#define I2C_TWPS 1
+		#define I2C_TWBR ((I2C_DIVIDER + 3)/4)
+	#elif (I2C_DIVIDER + 15)/16 <= 255
+		#define I2C_TWPS 2
+		#define I2C_TWBR ((I2C_DIVIDER + 15)/16)
+	#elif (I2C_DIVIDER + 63)/64 <= 255
+		#define I2C_TWPS 3
+		#define I2C_TWBR ((I2C_DIVIDER + 63)/64)
+	#else
+		#error "SCL_CLOCK demasiado bajo para este F_CPU"
+	#endif
+	#define I2C_ACTUAL_CLOCK (F_CPU/(16 + 2*I2C_TWBR*(1L<<(2*I2C_TWPS))))
+	
+	// Estados de TWSR (sin los bits del prescaler) que significan que el esclavo reconoci.
+	#define I2C_STATUS_MASK   0xF8
+	#define I2C_SLA_W_ACK     0x18
+	#define I2C_DATA_ACK      0x28
+	#define I2C_SLA_R_ACK     0x40
+
+// Definiciones de la EEPROM externa (AT24C32 de la tarjeta del DS3231, mismo bus). Se escribe
+// por pginas: lo que se agrega se junta en SRAM y sale en una sola escritura de hasta 32 bytes.
+	#define AT24_ADDRESS      0xAE				// 0x57: A0-A2 en alto en el mdulo ZS-042.
+	#define AT24_SIZE         4096
+	#define AT24_PAGE         32
+	#define AT24_POLL_MAX     200				// Sondeos sin respuesta (~20 ms a 100 kHz): no est.
+	#define AT24_UNKNOWN      0					// Se busca en el primer uso.
+	#define AT24_PRESENT      1
+	#define AT24_ABSENT       2
+	
+	// Registro de comidas en la EEPROM externa: uno por tolva y comida, en un anillo.
+	#define MEAL_RECORD       8					// poca (4), tolva<<4 | resultado (1), gramos (2), ciclos (1).
+	#define MEAL_EMPTY        0xFFFFFFFFUL		// poca de un registro nunca escrito.
+	#if AT24_PAGE % MEAL_RECORD != 0
+		#error "Un registro de comida no debe cruzar pginas"
+	#endif
+
+// Definiciones del reloj: segundos desde 2000-01-01 00:00 (el siglo del DS3231) en 32 bits.
+	#define SECONDS_PER_DAY   86400UL
+	#define CLOCK_SYNC_S      60					// Entre lecturas del DS3231 el reloj avanza con el Timer1.
+	#define ALARM_GRACE_S     (15*60)			// Una alarma perdida (reinicio, comida larga) an se atiende.
+	#define ALARM_NOT_FIRED   0xFFFF
 
 // Definiciones de la EEPROM.
     #define ALARM_BITS 8
+	#define EE_ALARM_CHANNELS 8					// 1 byte por alarma: mscara de tolvas (0xFF = todas).
+	#define EE_CKPT_RESUMES   12				// Reanudaciones de la comida en curso.
+	#define EE_CKPT_STATE     16				// Checkpoint de la comida en curso.
+	#define EE_CKPT_AMOUNT    17				// 2 bytes: gramos pedidos a cada tolva.
+	#define EE_CKPT_CHANNELS  19				// Mscara de tolvas de la comida.
+	#define EE_AT24_HEAD      20				// 2 bytes: siguiente posicin del registro de comidas.
+	#define EE_NET_ADDRESS    22				// Direccin en la red (borrada: NET_ADDRESS).
+	#define EE_CKPT_START     24				// 2 bytes por tolva: peso al empezar en dcimas (negativo: sin pesar).
+	#define EE_HIST_BASE      32				// 2 bytes por tolva: ltimo peso del historial en gramos.
+	#define EE_HIST_SLOT      42				// 2 bytes: ranura (desde la poca) de la ltima muestra.
+	#define EE_HIST_ENTRIES   44				// 2 bytes: muestras escritas, en cdigo Gray negado (confirma).
+	#define EE_ALARM_FIRED    48				// 2 bytes por alarma: da (desde la poca) en que se atendi.
+	#define EE_HX_TEMP_SLOPE  56				// 2 bytes por tolva: deriva del cero en cuentas por C.
+	#define EE_HIST_RING      64				// HIST_ENTRIES bytes por tolva: deltas en gramos (int8_t).
+	#define EE_CAL            256				// 8 bytes por tolva: offset y escala (float); borrada: de fbrica.
+	#define EE_MAX_FOOD       288				// 2 bytes: tope de la pantalla de dar comida.
+	#define EE_LINK_STATE     319				// LINK_STAGED: el bloque de paso es vlido y falta copiarlo.
+	#define EE_LINK_STAGE     320				// LINK_STAGE_SIZE bytes: ltimo bloque que lleg por el enlace.
+	#define CKPT_IDLE         0xFF
+	#define CKPT_DISPENSING   0xA7				// 0xA5 era de una sola tolva y 0xA6 guardaba lo entregado.
+	#define CKPT_MAX_RESUMES  3					// Reanudaciones antes de abandonar la comida (falla que se repite).
+	#define CKPT_RESUME_MIN_G 1					// Con menos por dar la comida ya est completa.
+
+// Definiciones de los canales.
+	#ifndef CHANNELS
+		#define CHANNELS 1
+	#endif
+	#if CHANNELS < 1 || CHANNELS > 4
+		#error "CHANNELS debe estar entre 1 y 4"
+	#endif
+	#define ALL_CHANNELS      ((1<<CHANNELS) - 1)
+	#define TARGET_ALL        0					// shownTarget: 0 todas las tolvas, n la tolva n.
+	#define TARGET_MASK(target) ((target) == TARGET_ALL ? ALL_CHANNELS : 1<<((target) - 1))
+	#define HX_DEFAULT_OFFSET 8615000				// Calibracin a ganancia 128 (canal A).
+	#define HX_DEFAULT_SCALE  1900
+	#define HX_SCALE_MIN      1.0f					// Cuentas por gramo aceptables en una calibracin.
+	#define HX_SCALE_MAX      100000.0f
+	#define HX_COUNT_ZERO     0x800000L				// Cuenta con entrada diferencial cero (despus del XOR).
+	
+// Compensacin de temperatura del cero. El offset vale a HX_DEFAULT_TEMP y se corre con la
+// pendiente aprendida de cada tolva; la temperatura sale del DS3231 en cuartos de grado.
+	#define HX_DEFAULT_TEMP   25					// C a los que vale HX_DEFAULT_OFFSET.
+	#define HX_TEMP_MIN_STEP  2						// Cuartos de grado entre muestras para aprender.
+	#define HX_TEMP_MAX_STEP_G 2					// Un cambio mayor (gramos) es comida que se movi.
+	#define HX_TEMP_FORGET    0.95f					// Peso de lo aprendido antes en cada muestra nueva.
+	#define HX_TEMP_PRIOR     4.0f					// C con los que pesa la pendiente guardada al arrancar.
+	#define HX_TEMP_SLOPE_MAX 5000					// Cuentas por C (ganancia 128) como mximo.
+	#define HX_TEMP_SAVE_STEP 8						// Cuentas por C de cambio para reescribir la EEPROM.
+	#define HX_TEMP_NONE      INT16_MIN				// Sin lectura del DS3231 todava: no se compensa.
+	#define HX_TEMP_DELTA(channel) (rtcTemperature == HX_TEMP_NONE ? 0 : channels[channel].temp.slope * (rtcTemperature/4.0f - HX_DEFAULT_TEMP))
+
+// Definiciones del Hx711: tasa, ganancia y ventanas de los filtros.
+	#define HX_RATE_10SPS     0					// En reposo: menos ruido y menos consumo.
+	#define HX_RATE_80SPS     1					// Dando comida: respuesta rpida para cortar a tiempo.
+	#define HX_SPS(rate)      ((rate) == HX_RATE_80SPS ? 80 : 10)
+	#define HX_SETTLE_CONVERSIONS 4					// Tras cambiar RATE las primeras 4 conversiones no sirven.
+	
+	// Pulsos de SCK por lectura: eligen canal y ganancia de la siguiente conversin.
+	#define HX_GAIN_A128      25
+	#define HX_GAIN_B32       26
+	#define HX_GAIN_A64       27
+	#define HX_GAIN_FACTOR(pulses) ((pulses) == HX_GAIN_A64 ? 0.5f : (pulses) == HX_GAIN_B32 ? 0.25f : 1.0f)
+	#define HX_GAIN_SHIFT(pulses)  ((pulses) == HX_GAIN_A64 ? 1 : (pulses) == HX_GAIN_B32 ? 2 : 0)
+	
+	// Validacin de muestras. Los rieles de saturacin (0x7FFFFF y 0x800000 en complemento a
+	// dos) quedan en 0xFFFFFF y 0x000000 despus del XOR.
+	#define HX_COUNT_MIN      0x000000L
+	#define HX_COUNT_MAX      0xFFFFFFL
+	#define HX_MEDIAN_SIZE    3					// Mediana de las ltimas 3 muestras buenas.
+	#define HX_SPIKE_COUNTS   38000L				// ~20 g a ganancia 128: ms lejos de la mediana es un pico.
+	#define HX_SPIKE_RUN      3					// Tantos picos seguidos son un cambio real de peso.
+	#define HX_BENCH_SAMPLES  256					// Muestras sintticas de la prueba de ciclos por muestra.
+	
+	// Ventanas de los filtros en ms; el nmero de muestras sale de la tasa actual.
+	#define HX_WEIGH_WINDOW_MS    5000				// Pesada antes de dar comida (en reposo).
+	#define HX_START_WINDOW_MS    1250				// Peso inicial y reanudacin (ya a la tasa de despacho).
+	#define HX_DISPENSE_WINDOW_MS 25				// Cada lectura del ciclo de despacho.
+	#define HX_SCREEN_WINDOW_MS   1000				// Pantalla de peso: primera lectura.
+	#define HX_REFRESH_WINDOW_MS  500				// Pantalla de peso: cada actualizacin.
+
+// Definiciones de la adquisicin. Cada conversin de los Hx711 sale validada y con su hora
+// en ms por un solo anillo; la pantalla de peso, el despacho, el historial y el enlace lo
+// leen cada uno con su cursor. La hora cuenta cuadros del Timer1 con una tasa que se ajusta
+// contra el DS3231 en cada readTimeDate, sin retroceder nunca.
+	#define ACQ_RING          8					// Muestras en el anillo (potencia de 2).
+	#define ACQ_CHANNEL       0x03				// Tolva en los bits bajos de la etiqueta.
+	#define ACQ_SERVO         0x04				// Bandera: el servo de la tolva se estaba moviendo.
+	#define ACQ_BOWL          0x08				// Bandera: muestra del plato (canal B), no de la tolva.
+	#define ACQ_FRAME_MS      (SERVO_FRAME_US/1000.0f)	// Tasa nominal en ms por cuadro.
+	#define ACQ_STEP_MS       2000				// Desfase contra el DS3231 que ya es hora puesta, no deriva.
+	#define ACQ_BASELINE_S    300				// Segundos del DS3231 antes de medir la tasa de largo plazo.
+	#define ACQ_SLEW_MAX      0.05f				// Correccin mxima de la tasa para alcanzar al DS3231 (5 %).
+
+// Definiciones del plato (BOWL). La celda del plato es del mismo modelo que la de la tolva y va
+// al canal B de su Hx711, que solo convierte a ganancia 32. El Hx711 convierte una entrada a la
+// vez: mientras se da comida la adquisicin alterna turnos de tolva y de plato, y tras cada
+// cambio tira las conversiones que tarda en asentarse (lo mismo que tras cambiar RATE).
+	#define BOWL_TURN         4					// Muestras buenas por turno de cada entrada.
+	#define BOWL_SETTLE       HX_SETTLE_CONVERSIONS	// Conversiones que se tiran al cambiar de entrada.
+	#define BOWL_WEIGH_SAMPLES 8				// Pesada del plato antes de abrir y despus de cerrar.
+	#define BOWL_WINDOW       BOWL_TURN			// Una revisin del plato por turno durante el despacho.
+	#define BOWL_APPROACH_G   5					// Tan cerca de la meta la tolva se lee sin turnos del plato.
+	#define BOWL_LAND_MS      500				// Tras cerrar, lo que iba cayendo termina de llegar al plato.
+	#define BOWL_MISSING_G    5					// Gramos que bajaron de la tolva sin llegar al plato para avisar.
+
+// Definiciones del historial de peso: una muestra por ranura del da, guardada como delta.
+	#ifndef HIST_PERIOD_MIN
+		#define HIST_PERIOD_MIN 60					// Minutos por ranura.
+	#endif
+	#if 1440 % HIST_PERIOD_MIN != 0 || HIST_PERIOD_MIN < 6
+		#error "HIST_PERIOD_MIN debe dividir el da y ser de al menos 6 minutos"
+	#endif
+	#define HIST_SLOTS_PER_DAY (1440/HIST_PERIOD_MIN)
+	#define HIST_ENTRIES      (192/CHANNELS)		// Deltas por tolva: 8 das con una, 2 con cuatro.
+	#define HIST_SAMPLES      8					// Conversiones promediadas por muestra.
+	#define HIST_DEADBAND     2					// Gramos: cambios menores son ruido (delta 0).
+	#define HIST_WARN_DAYS    2					// Avisar en la pantalla principal con menos das.
+	#define HIST_WARN_GRAMS   60				// Sin pronstico, avisar con menos de dos comidas.
+	#define HIST_UNKNOWN      255				// Das: sin consumo suficiente para pronosticar.
+	#define HIST_NO_SLOT      0xFFFF
+	// Muestras escritas: la cabeza y la cuenta del anillo salen de este contador. En cdigo Gray
+	// cada muestra cambia un solo bit, as que confirmarla es escribir un solo byte. Antes de
+	// llegar a 0xFFFF salta de HIST_WRAP_FROM a su reflejo HIST_WRAP_TO (solo cambia el bit 15),
+	// que deja el mismo residuo que HIST_WRAP_FROM + 1: la cabeza sigue y el anillo sigue lleno.
+	#if HIST_ENTRIES % 2
+		#error "HIST_ENTRIES debe ser par para el salto del contador del historial"
+	#endif
+	#define HIST_WRAP_FROM    (0xFFFFU - HIST_ENTRIES - (0xFFFFU - HIST_ENTRIES - (0xFFFEU % HIST_ENTRIES)/2) % (HIST_ENTRIES/2))
+	#define HIST_WRAP_TO      (0xFFFFU - HIST_WRAP_FROM)
+	#define HIST_IDLE         0
+	#define HIST_SAMPLING     1
+	#define HIST_WRITING      2
+
+// Definiciones del servo (Timer1 genera un pulso por canal en cada cuadro).
+	#define SERVO_FRAME_US     16000				// Periodo de la seal (~61 Hz, igual que el Timer0 original).
+	#if SERVO_FRAME_US*(F_CPU/1000000UL) <= 65536UL
+		#define TIMER1_PRESCALER 1					// Sin prescaler: resolucin de 1/4 us a 4 MHz.
+	#else
+		#define TIMER1_PRESCALER 8
+	#endif
+	#define SERVO_TICKS_PER_US (F_CPU/TIMER1_PRESCALER/1000000UL)
+	#define SERVO_CLOSED_US    704					// Antes OCR0 = 10.
+	#define SERVO_OPEN_US      960					// Antes OCR0 = 14.
+	#define SERVO_REVERSE_US   576					// Giro inverso para destrabar.
+	#define SERVO_MS_TO_FRAMES(ms) ((uint8_t)(((ms)*1000UL + SERVO_FRAME_US - 1)/SERVO_FRAME_US))
+	#define SERVO_PULSE_OFF    0xFFFF				// OCR1A fuera del cuadro: sin ms cortes hasta el siguiente.
+	#define MOTION_CLOSE    0
+	#define MOTION_OPEN     1
+	#define MOTION_DISPENSE 2
+	#define MOTION_AGITATE  3
+	#define MOTION_REVERSE  4
+
+// Definiciones del despachador.
+	#define DISPENSE_MIN_PROGRESS 2				// Gramos que debe bajar la tolva por ciclo para no contar como atasco.
+	#define DISPENSE_MAX_STALLS   3				// Ciclos seguidos sin avance antes de abortar.
+	#define DISPENSE_MAX_CYCLES   60			// Tope de ciclos: ~60*(1.4 s + 0.6 s de recuperacin) en el peor caso.
+	#define DISPENSE_EMPTY_AMOUNT 5				// Debajo de esto un ciclo sin avance es tolva vaca, no atasco.
+	#define DISPENSE_OK        0
+	#define DISPENSE_LOW_FOOD  1
+	#define DISPENSE_EMPTY     2
+	#define DISPENSE_JAM       3
+	#define DISPENSE_TIMEOUT   4
+	#define DISPENSE_MISSING   5				// Con BOWL: la tolva baj ms de lo que lleg al plato.
+
+// Definiciones de pantallas.
+	#define SCREEN_MAIN   0
+	#define SCREEN_WEIGHT 1
+	#define SCREEN_AGEND  2
+	#define SCREEN_DELETE 3
+	#define SCREEN_ADD    4
+	#define SCREEN_GIVE   5
+	#define SCREEN_BOOT   6						// Diagnstico oculto: mantener el botn de en medio.
+	#define SCREEN_NONE   255
+
+	#define DIAG_HOLD_MS  2000
+
+// Definiciones del arranque. Cada fase se marca con los ciclos del Timer1 al terminar.
+	#define BOOT_TIMER    0						// Timer1 corriendo: origen de las marcas.
+	#define BOOT_RESUME   1						// Comida pendiente terminada (arranque en caliente).
+	#define BOOT_RTC      2						// Hora leda del DS3231.
+	#define BOOT_ALARM    3						// Primera evaluacin de alarmas.
+	#define BOOT_LCD      4						// LCD inicializado.
+	#define BOOT_DISPLAY  5						// Primera pantalla vlida.
+	#define BOOT_DEFERRED 6						// Inicializacin no crtica terminada.
+	#define BOOT_PHASES   7
+	#define LCD_POWER_UP_MS 15						// Espera del HD44780 tras encender; se traslapa con el RTC.
+	#define BOOT_MARK(phase) (bootStamps[phase] = Timer1_Cycles())
+	#define DIAG_FILTER   BOOT_PHASES				// Pgina de diagnstico despus de las fases: el filtro.
+	#define DIAG_PROFILE  (BOOT_PHASES + 1)			// Con PROFILE siguen las funciones perfiladas.
+	#if PROFILE
+		#define DIAG_PAGES (DIAG_PROFILE + PROF_FUNCS)
+	#else
+		#define DIAG_PAGES DIAG_PROFILE
+	#endif
+
+// Definiciones del perfilado. Cada funcin marcada cuenta llamadas y ciclos del Timer1 (con
+// lo que llama y las interrupciones, menos lo que cuesta medir). Sin PROFILE no queda nada.
+	#define PROF_CHECK_ALARMS  0
+	#define PROF_SEARCH_ALARMS 1
+	#define PROF_READ_TIME     2
+	#define PROF_HX_READ       3
+	#define PROF_ACQ           4
+	#define PROF_LCD_CHAR      5
+	#define PROF_LCD_INST      6
+	#define PROF_EEPROM_READ   7
+	#define PROF_FUNCS         8
+	#if PROFILE
+		#define PROFILE_BEGIN(id)         uint32_t profileStart = Timer1_Cycles()
+		#define PROFILE_END(id)           Profile_Add(id, profileStart)
+		#define PROFILE_RETURN(id, value) do{ __typeof__(value) profileValue = (value); PROFILE_END(id); return profileValue; }while(0)
+	#else
+		#define PROFILE_BEGIN(id)
+		#define PROFILE_END(id)
+		#define PROFILE_RETURN(id, value) return (value)
+	#endif
+
+	#if SERVO_FRAME_US*SERVO_TICKS_PER_US > 65536UL
+		#error "El periodo del servo no cabe en ICR1 con este F_CPU"
+	#endif
+	#if CHANNELS*SERVO_OPEN_US >= SERVO_FRAME_US
+		#error "Los pulsos de todos los servos no caben en un cuadro"
+	#endif
+
+// Definiciones de la USART (trace o enlace): 8N1 con U2X.
+	#define USART_BAUD        38400UL
+	#define USART_UBRR        ((F_CPU + 4*USART_BAUD)/(8*USART_BAUD) - 1)	// Con U2X.
+	#define USART_ACTUAL_BAUD (F_CPU/(8*(USART_UBRR + 1)))
+	#if USART_USED && (USART_ACTUAL_BAUD*50 > USART_BAUD*51 || USART_ACTUAL_BAUD*50 < USART_BAUD*49)
+		#error "USART_BAUD no se alcanza con este F_CPU (error mayor a 2 %)"
+	#endif
+	#define USART_TX_BUFFER   64					// Cola de salida en SRAM (potencia de 2).
+
+// Definiciones del trace. Cada registro es {tipo | arg<<4, dt, datos}: dt son 2 bytes en
+// ticks de TRACE_TICK_US desde el registro anterior y los datos van en little endian. Si
+// dt no cabe, antes sale un TR_SYNC con el tiempo absoluto. Lo que no cabe en la cola se cuenta.
+	#define TRACE_TICK_US     16
+	#if SERVO_FRAME_US % TRACE_TICK_US != 0
+		#error "SERVO_FRAME_US debe ser mltiplo de TRACE_TICK_US"
+	#endif
+	#define TR_BOOT           0					// arg = CHANNELS. MCUCSR (1).
+	#define TR_SYNC           1					// Tiempo absoluto en ticks (4).
+	#define TR_HX             2					// arg = tolva. Cuenta de 24 bits (3).
+	#define TR_RTC            3					// Segundos de poca ledos del DS3231 (4).
+	#define TR_BUTTONS        4					// Botones presionados, un bit por botn (1).
+	#define TR_SERVO          5					// arg = tolva. Perfil de movimiento (1).
+	#define TR_FEED           6					// Mscara de tolvas (1) y gramos por tolva (2).
+	#define TR_RESULT         7					// arg = tolva. Resultado (1), gramos entregados (2), ciclos (1).
+	#define TR_LOST           8					// Registros descartados por falta de espacio (2).
+	#define TR_TYPES          9
+	
+	#if TRACE
+		#define TRACE_EVENT(type, arg, value, len) Trace_Record((type) | (arg)<<4, value, len)
+		#define TRACE_FEED(mask)                   Trace_Feed(mask)
+		#define TRACE_RESULT(channel)              Trace_Result(channel)
+	#else
+		#define TRACE_EVENT(type, arg, value, len)
+		#define TRACE_FEED(mask)
+		#define TRACE_RESULT(channel)
+	#endif
+
+// Definiciones del enlace. Una trama es {LINK_START, comando, largo, datos, CRC} con el
+// CRC-16 (XMODEM, byte alto primero) de comando, largo y datos. La respuesta lleva el
+// comando con LINK_REPLY y los datos empiezan con el estado.
+	#define LINK_START        0x7E
+	#define LINK_REPLY        0x80
+	#define LINK_MAX_DATA     64
+	#define LINK_GAP_FRAMES   8					// Cuadros del Timer1 (~128 ms) sin bytes: trama abandonada.
+	#define LINK_CMD_READ     0x01				// Sin datos. Responde el bloque de configuracin.
+	#define LINK_CMD_WRITE    0x02				// Bloque de configuracin. Responde solo el estado.
+	#define LINK_CMD_LOG      0x03				// {posicin (2), largo}. Responde la cabeza (2) y los bytes.
+	#define LINK_LOG_CHUNK    48				// Bytes como mximo por lectura del registro.
+	#define LINK_CMD_SAMPLES  0x04				// Sin datos. Responde las perdidas (1) y las muestras nuevas.
+	#define LINK_SAMPLE       7					// Hora en ms (4), etiqueta de la adquisicin (1), dcimas de gramo (2).
+	#define LINK_SAMPLES_MAX  7					// Muestras como mximo por respuesta.
+	#define LINK_SAMPLES_HOLD 125				// Cuadros (~2 s) que se sigue adquiriendo tras cada pedido.
+	#define LINK_OK           0
+	#define LINK_BAD_CRC      1
+	#define LINK_BAD_COMMAND  2
+	#define LINK_BAD_LENGTH   3
+	#define LINK_BAD_VALUE    4
+	#define LINK_NO_DEVICE    5					// Sin EEPROM externa.
+	#define LINK_IDLE         0xFF				// EE_LINK_STATE.
+	#define LINK_STAGED       0x5C
+	
+	// Bloque de configuracin (little endian). Al escribir se aplican solo las secciones de
+	// CFG_SECTIONS; al leer vienen todas.
+	#define CFG_SECTIONS      0
+	#define CFG_ALARMS        1					// {hora, minuto, mscara} por alarma; hora 255: vaca.
+	#define CFG_MAX_FOOD      (CFG_ALARMS + 3*ALARM_BITS/2)	// 2 bytes: tope de la pantalla de dar comida.
+	#define CFG_CLOCK         (CFG_MAX_FOOD + 2)	// 4 bytes: segundos de poca para el DS3231.
+	#define CFG_CALIBRATION   (CFG_CLOCK + 4)		// Por tolva: offset y escala (float, ganancia 128).
+	#define CFG_SIZE          (CFG_CALIBRATION + 8*CHANNELS)
+	#define CFG_SEC_ALARMS    0x01
+	#define CFG_SEC_LIMITS    0x02
+	#define CFG_SEC_CLOCK     0x04
+	#define CFG_SEC_CALIBRATION 0x08
+	#define CFG_SEC_ALL       0x0F
+	#define CFG_FOOD_MIN      20
+	#define CFG_FOOD_MAX      990
+	#define CFG_CLOCK_MAX     (36525*SECONDS_PER_DAY)	// El DS3231 llega a 2099.
+	#define LINK_STAGE_SIZE   (CFG_SIZE + ALARM_BITS)	// Ms el da atendido de cada alarma.
+	#if LINK_STAGE_SIZE > LINK_MAX_DATA || CFG_SIZE + 6 >= USART_TX_BUFFER
+		#error "El bloque de configuracin no cabe en la trama"
+	#endif
+	#if 1 + LINK_SAMPLES_MAX*LINK_SAMPLE > LINK_MAX_DATA || 1 + LINK_SAMPLES_MAX*LINK_SAMPLE + 6 >= USART_TX_BUFFER
+		#error "Las muestras no caben en la trama"
+	#endif
+
+// Definiciones de la red (NET). El equipo es esclavo del bus de la red en su direccin con un
+// mapa de registros: el coordinador escribe el apuntador y luego escribe o lee desde ah (el
+// apuntador avanza solo). Solo el comando y el bloque de configuracin se escriben; lo dems lo
+// publica el programa. El DS3231 y el AT24C32 tienen la misma direccin en todos los equipos:
+// mientras el equipo es maestro de su bus, el repetidor lo deja fuera de la red.
+	#define NET_ADDRESS       0x20				// Direccin de fbrica (7 bits).
+	#define NET_ADDRESS_MIN   0x08
+	#define NET_ADDRESS_MAX   0x77
+	#define NET_ADDRESS_KEY   0xA55A			// Cambiar la direccin pide esta clave.
+	#define NET_ID            'D'
+	#define NET_VERSION       1
+	#define NET_REG_ID        0x00
+	#define NET_REG_VERSION   0x01
+	#define NET_REG_STATUS    0x02				// Bits NET_ST_*.
+	#define NET_REG_CHANNELS  0x03
+	#define NET_REG_WEIGHT    0x04				// 2 bytes por tolva: dcimas de gramo (NET_NO_WEIGHT: sin lectura).
+	#define NET_REG_MEALS     0x0C				// Comidas desde el arranque (da la vuelta).
+	#define NET_REG_MEAL_TIME 0x0D				// 4 bytes: segundos de poca de la ltima comida.
+	#define NET_REG_MEAL_MASK 0x11				// Tolvas de la ltima comida.
+	#define NET_REG_MEAL      0x12				// Por tolva: resultado (NET_NO_RESULT: no estaba) y gramos (2).
+	#define NET_REG_COMMAND   0x20				// {comando, tolvas o direccin, gramos o clave (2)}.
+	#define NET_REG_CONFIG    0x24				// Bloque de configuracin del enlace (CFG_*).
+	#define NET_MAP_SIZE      (NET_REG_CONFIG + CFG_SIZE)
+	#define NET_MEAL_SIZE     3
+	#define NET_COMMAND_SIZE  4
+	#define NET_NO_WEIGHT     INT16_MIN
+	#define NET_NO_RESULT     0xFF
+	#define NET_ST_FEEDING    0x01				// Dando comida: lo dems del mapa no cambia hasta terminar.
+	#define NET_ST_PENDING    0x02				// Un comando o un bloque escrito todava sin atender.
+	#define NET_ST_BAD_COMMAND 0x04				// El ltimo comando se rechaz.
+	#define NET_ST_BAD_CONFIG 0x08				// El ltimo bloque de configuracin se rechaz.
+	#define NET_CMD_DISPENSE  0x01				// Tolvas (0xFF: todas) y gramos por tolva.
+	#define NET_CMD_ADDRESS   0x02				// Direccin nueva y NET_ADDRESS_KEY.
+	#define NET_READY_COMMAND 0x01				// netReady: lo escrito que espera al programa.
+	#define NET_READY_CONFIG  0x02
+	#define NET_PUBLISH_FRAMES 4				// Cuadros (~64 ms) entre publicaciones del mapa.
+	#define NET_WEIGHT_HOLD   125				// Cuadros (~2 s) que se sigue pesando tras cada lectura.
+	#define NET_IDLE_WAIT_US  5000				// Lo ms que se espera a que termine una transaccin de la red.
+	
+	// Estados de TWSR del esclavo (sin los bits del prescaler).
+	#define NET_SLA_W         0x60
+	#define NET_SLA_W_LOST    0x68				// Se perdi el arbitraje como maestro y nos llamaron.
+	#define NET_DATA          0x80
+	#define NET_DATA_NACK     0x88
+	#define NET_STOP          0xA0				// STOP o inicio repetido.
+	#define NET_SLA_R         0xA8
+	#define NET_SLA_R_LOST    0xB0
+	#define NET_SENT          0xB8
+	#define NET_SENT_NACK     0xC0
+	#define NET_SENT_LAST     0xC8
+	#define NET_BUS_ERROR     0x00
+	
+	#if NET_REG_WEIGHT + 2*4 > NET_REG_MEALS || NET_REG_MEAL + NET_MEAL_SIZE*4 > NET_REG_COMMAND
+		#error "El mapa de registros de la red se encima"
+	#endif
+	#if NET
+		#define NET_DETACH()       Net_Detach()
+		#define NET_ATTACH()       Net_Attach()
+		#define NET_FEEDING()      Net_Feeding()
+		#define NET_MEAL(mask)     Net_Meal(mask)
+	#else
+		#define NET_DETACH()
+		#define NET_ATTACH()
+		#define NET_FEEDING()
+		#define NET_MEAL(mask)
+	#endif
+	
+	// Al arrancar, el bloque de paso que dej un corte se vuelve a aplicar desde la trama del
+	// enlace o desde la ventana de la red.
+	#if LINK
+		#define CFG_STAGE_BUFFER (linkFrame + 2)
+	#else
+		#define CFG_STAGE_BUFFER (netRegs + NET_REG_CONFIG)
+	#endif
+
+// Presupuesto de SRAM del ATmega16. avr-gcc da el tamao exacto de los bloques grandes (ver el
+// final de Variables a utilizar); las variables sueltas y la pila son estimaciones. La pila del
+// simulador llega a 512-896 bytes con registros y apuntadores de 64 bits; con una medida en el
+// equipo se ajusta con -DSRAM_STACK=...
+	#define SRAM_SIZE         1024
+	#ifndef SRAM_STACK
+		#define SRAM_STACK    256					// Pila con una interrupcin encima (estimacin).
+	#endif
+	#define SRAM_OTHER        160					// Variables sueltas de todos los mdulos (estimacin).
 
 
 
 // ----------------------- Libreras -----------------------
 // Libreras.
-	#include <avr/io.h>
-	#include <util/delay.h>
+	#if BOARD != BOARD_HOST
+		#include <avr/io.h>
+		#include <util/delay.h>
+		#include <avr/interrupt.h>
+		#include <avr/pgmspace.h>
+		#include <avr/wdt.h>
+		#include <util/crc16.h>
+	#else
+		#define _GNU_SOURCE							// posix_openpt y cfmakeraw del enlace.
+		#include <stdio.h>
+		#include <string.h>
+		#include <unistd.h>
+		#include <sys/mman.h>
+		#include <sys/wait.h>
+		#include <math.h>
+		#include <fcntl.h>
+		#include <termios.h>
+		#include <signal.h>
+	#endif
 	#include <stdint.h>
 	#include <stdlib.h>
-	#include <avr/interrupt.h>
 	#include <time.h>
+
+// Registros simulados del ATmega16 (solo BOARD_HOST).
+	#if BOARD == BOARD_HOST
+		volatile uint8_t DDRA, PORTA, PINA, DDRB, PORTB, PINB, DDRC, PORTC, PINC, DDRD, PORTD, PIND;
+		volatile uint8_t TCCR1A, TCCR1B, TIMSK, TIFR, MCUCSR;
+		volatile uint16_t TCNT1, OCR1A, ICR1;
+		volatile uint8_t UCSRA, UCSRB, UCSRC, UBRRH, UBRRL;
+		volatile uint16_t UDR;						// Ms de 8 bits: el simulador sabe si se escribi.
+		volatile uint8_t TWCR, TWSR, TWDR, TWAR;
+		#define WGM13 4
+		#define WGM12 3
+		#define CS10 0
+		#define CS11 1
+		#define ICF1 5
+		#define PORF 0
+		#define EXTRF 1
+		#define BORF 2
+		#define WDRF 3
+		#define JTD 7
+		#define WDTO_2S 7
+		#define TICIE1 5
+		#define OCIE1A 4
+		#define U2X 1
+		#define TXEN 3
+		#define RXEN 4
+		#define UDRIE 5
+		#define RXCIE 7
+		#define URSEL 7
+		#define UCSZ1 2
+		#define UCSZ0 1
+		#define TWINT 7
+		#define TWEA 6
+		#define TWSTO 4
+		#define TWEN 2
+		#define TWIE 0
+		
+		#define ISR(vector) void vector(void)
+		#define TIMER1_CAPT_vect simTimer1Capture
+		#define TIMER1_COMPA_vect simTimer1CompareA
+		#define USART_UDRE_vect simUsartUdre
+		#define USART_RXC_vect simUsartRxc
+		#define TWI_vect simTwi
+		#define cli()
+		#define sei()
+		
+		#define PROGMEM
+		#define PSTR(s) (s)
+		#define pgm_read_byte(address) (*(const uint8_t *)(address))
+		#define pgm_read_word(address) (*(const uint16_t *)(address))
+		#define pgm_read_ptr(address) (*(const void *const *)(address))
+		
+		void simTimer1Capture(void);
+		void simTimer1CompareA(void);
+		void simUsartUdre(void);
+		void simUsartRxc(void);
+		void simTwi(void);
+		uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data);
+		void wdt_enable(uint8_t timeout);
+		void wdt_reset(void);
+		void _delay_ms(double ms);
+		void _delay_us(double us);
+		void simHxClock(uint8_t channel, uint8_t level);
+		uint8_t simHxDout(uint8_t channel);
+		uint8_t simButtonDown(uint8_t bit);
+	#endif
 	
 	
 	
 // ----------------------- Variables a utilizar -----------------------
 // Hx711.
-	float OFFSET = 8615000;
-	float SCALE = 1900;
-	float currentFoodAmount = 0;
 	int maxFoodAmountToGive = 220;
 
 // DS3231.
@@ -64,10 +778,403 @@
 	uint8_t date = 0;
 	uint8_t month = 0;
 	uint8_t year = 0;
-	unsigned long int dateCombination = 0;
-	int hourCombination = 0;
 	char alreadyGiveFood = 0;
-	uint8_t pastAlarmMinutes = 100, pastAlarmHours = 100;
+	uint32_t clockEpoch = 0;				// Segundos de poca de la ltima lectura del DS3231...
+	uint32_t clockSyncFrames = 0;			// ... y cuadros del Timer1 en ese momento.
+	uint32_t clockSkipFrom = 0, clockSkipTo = 0;	// ltimo adelanto de SetTimeDate (cambio de horario).
+	uint32_t alarmCheckedAt = 0;			// Hora con la que alarmDue encontr alarmsDue.
+	uint8_t alarmsDue = 0;					// Alarmas (bit i/2) que tocan y no se han atendido.
+	uint8_t lastDispenseResult = DISPENSE_OK;
+	int checkpointAmount = 0;
+	
+// Tasa del Hx711: la de despacho es variable para poder compararlas en el simulador.
+	uint8_t hxRate = HX_RATE_10SPS;
+	uint8_t hxDispenseRate = HX_RATE_80SPS;
+
+// USART: cola circular de salida que vaca su interrupcin.
+	#if USART_USED
+		uint8_t usartBuffer[USART_TX_BUFFER];
+		volatile uint8_t usartTail = 0;		// Lo avanza la interrupcin.
+		uint8_t usartHead = 0;
+	#endif
+
+// Trace.
+	#if TRACE
+		uint8_t traceButtons = 0;
+		uint16_t traceLost = 0;				// Registros descartados desde el ltimo TR_LOST.
+		uint32_t traceLast = 0;				// Tiempo del ltimo registro encolado.
+	#endif
+
+// Enlace: la interrupcin de recepcin arma la trama y el programa la atiende completa.
+	#if LINK
+		uint8_t linkFrame[2 + LINK_MAX_DATA + 2];	// Comando, largo, datos y CRC.
+		volatile uint8_t linkFill = 0;			// 0: esperando LINK_START; si no, bytes guardados + 1.
+		volatile uint8_t linkReady = 0, linkLastFrame = 0;
+	#endif
+
+// Red: la interrupcin del TWI atiende al coordinador sobre netRegs; el programa publica el
+// mapa y atiende lo que se escribi.
+	#if NET
+		uint8_t netRegs[NET_REG_CONFIG + LINK_STAGE_SIZE];	// El bloque lleva adems el da atendido de cada alarma.
+		uint8_t netAddress = 0;				// 0: todava fuera de la red.
+		volatile uint8_t netPointer = 0, netFirst = 0, netWriteAt = 0, netWritten = 0;
+		volatile uint8_t netBusy = 0, netReady = 0, netPolled = 0;
+		volatile uint8_t netDeferred = 0;		// Publicacin esperando: el fin de la transaccin deja de reconocer la direccin.
+		uint8_t netStatus = 0, netPublished = 0;
+		uint8_t netDone = 0;					// Bits de netReady atendidos: se borran al publicar su resultado.
+		uint8_t netMeal[NET_REG_COMMAND - NET_REG_MEALS];	// ltima comida, como va en el mapa.
+		int16_t netWeight[CHANNELS];
+		uint32_t netConfigAt = 0;			// Segundo de la ltima copia del bloque de configuracin.
+	#endif
+
+// EEPROM externa: pgina que se est juntando y dnde empieza.
+	uint8_t at24Page[AT24_PAGE];
+	uint8_t at24Fill = 0, at24State = AT24_UNKNOWN;
+	uint16_t at24Head = 0;
+	uint32_t at24Pages = 0;					// Pginas escritas desde el arranque.
+
+// Historial de peso (copia en SRAM del encabezado en la EEPROM).
+	uint16_t histSlot = HIST_NO_SLOT, histPendingSlot;
+	uint16_t histEntries = 0;				// Muestras escritas; de aqu salen cabeza y cuenta.
+	uint8_t histHead = 0, histCount = 0;
+	uint8_t histPhase = HIST_IDLE, histWriteStep, histWriteHead;
+	uint8_t histDaysLeft = HIST_UNKNOWN;	// Mnimo de das de comida entre las tolvas.
+
+// Pantallas.
+	// Valores que muestran los campos de las pantallas.
+	uint8_t shownHours = 0, shownMinutes = 0, shownPhase = 0;
+	uint8_t shownTarget = TARGET_ALL, shownChannel = 0;
+	int shownAmount = 0;
+	int shownWeights[CHANNELS];
+	uint8_t mainScreenDrawn = 0;			// El arranque ya pint la pantalla principal.
+	uint8_t shownDaysLeft = HIST_UNKNOWN;
+	uint32_t shownMinute = 0;				// Minuto de poca que muestran la fecha y la hora.
+	
+	// Un elemento de una pantalla: posicin en DDRAM, formato y, si es FMT_TEXT, el texto.
+	// Las tablas y los textos viven en flash; LCD_draw las recorre sin copiarlas a SRAM.
+	typedef struct {
+		uint8_t pos;
+		uint8_t format;
+		const char *text;
+	} screenItem;
+	
+	#define SCREEN_TEXT(pos, text) {pos, FMT_TEXT, text}
+	#define SCREEN_FIELD(pos, format) {pos, format, 0}
+	#define SCREEN_END {0, FMT_END, 0}
+	#if CHANNELS > 1
+		#define SCREEN_MULTI(pos, format) SCREEN_FIELD(pos, format),	// Solo con varias tolvas.
+	#else
+		#define SCREEN_MULTI(pos, format)
+	#endif
+	
+	const char textMainHelp[] PROGMEM = "Agen  Peso  Dar";
+	const char textWeight[] PROGMEM = "   Peso:";
+	const char textWeightHelp[] PROGMEM = "Agen  Hora  Dar";
+	const char textOptions[] PROGMEM = "  --Opciones--  ";
+	const char textOptionsHelp[] PROGMEM = "Ret   Del   Add";
+	const char textAlarm[] PROGMEM = "Alarma: ";
+	const char textDeleteHelp[] PROGMEM = "Ret  Del  Next";
+	const char textAddHelp[] PROGMEM = "Ret  Add  Next";
+	const char textShortError[] PROGMEM = "  ==Error==  ";
+	const char textShortSuccess[] PROGMEM = "   ==Exito==   ";
+	const char textNoAlarms[] PROGMEM = "No hay alarmas";
+	const char textAlarmDeleted[] PROGMEM = "   Bye alarma  ";
+	const char textAlarmsFull[] PROGMEM = " Ya hay alarmas ";
+	const char textDeleteSome[] PROGMEM = " Borre algunas  ";
+	const char textAlarmAdded[] PROGMEM = "Nueva alarma :)";
+	const char textGiveHelp[] PROGMEM = "Ret    Dar    +";
+	const char textGrams[] PROGMEM = "g";
+	const char textWait[] PROGMEM = "=====Espere=====";
+	const char textError[] PROGMEM = "=====Error=====";
+	const char textSuccess[] PROGMEM = "=====Exito=====";
+	const char textLowFood[] PROGMEM = "Hay poca comida ";
+	const char textAddFood[] PROGMEM = "Agregue + comida";
+	const char textDispensing[] PROGMEM = "Dando comida...";
+	const char textEmpty[] PROGMEM = "Tolva vacia     ";
+	const char textJam[] PROGMEM = "Atasco en tolva ";
+	const char textTimeout[] PROGMEM = "Tiempo agotado  ";
+	const char textCheckChute[] PROGMEM = "Revise la salida";
+	#if BOWL
+		const char textMissing[] PROGMEM = "Plato incompleto";
+	#endif
+	const char textHappyTurtle[] PROGMEM = "Tortuguita feli";
+	#if PROFILE
+		const char textBootHelp[] PROGMEM = "Ret   Cero  Next";	// Cero: reinicia los contadores.
+	#else
+		const char textBootHelp[] PROGMEM = "Ret        Next";
+	#endif
+	
+	const screenItem layoutMain[] PROGMEM = {
+		SCREEN_FIELD(LCD_LINE1, FMT_DATE),
+		SCREEN_FIELD(LCD_LINE1+9, FMT_TIME),
+		SCREEN_FIELD(LCD_LINE1+14, FMT_REFILL),
+		SCREEN_TEXT(LCD_LINE2, textMainHelp),
+		SCREEN_END
+	};
+	const screenItem layoutWeight[] PROGMEM = {
+	#if CHANNELS > 1
+		SCREEN_FIELD(LCD_LINE1, FMT_WEIGHT),
+	#else
+		SCREEN_TEXT(LCD_LINE1, textWeight),
+		SCREEN_FIELD(LCD_LINE1+9, FMT_WEIGHT),
+	#endif
+		SCREEN_TEXT(LCD_LINE2, textWeightHelp),
+		SCREEN_END
+	};
+	const screenItem layoutOptions[] PROGMEM = {
+		SCREEN_TEXT(LCD_LINE1, textOptions),
+		SCREEN_TEXT(LCD_LINE2, textOptionsHelp),
+		SCREEN_END
+	};
+	const screenItem layoutDeleteAlarm[] PROGMEM = {
+		SCREEN_TEXT(LCD_LINE1, textAlarm),
+		SCREEN_FIELD(LCD_LINE1+8, FMT_ALARM),
+		SCREEN_MULTI(LCD_LINE1+14, FMT_TARGET)
+		SCREEN_TEXT(LCD_LINE2, textDeleteHelp),
+		SCREEN_END
+	};
+	const screenItem layoutAddAlarm[] PROGMEM = {
+		SCREEN_TEXT(LCD_LINE1, textAlarm),
+		SCREEN_FIELD(LCD_LINE1+8, FMT_ALARM),
+		SCREEN_MULTI(LCD_LINE1+14, FMT_TARGET)
+		SCREEN_TEXT(LCD_LINE2, textAddHelp),
+		SCREEN_END
+	};
+	const screenItem layoutGiveFood[] PROGMEM = {
+		SCREEN_FIELD(LCD_LINE1+6, FMT_GRAMS),
+		SCREEN_TEXT(LCD_LINE1+9, textGrams),
+		SCREEN_MULTI(LCD_LINE1+13, FMT_TARGET)
+		SCREEN_TEXT(LCD_LINE2, textGiveHelp),
+		SCREEN_END
+	};
+	const screenItem layoutNoAlarms[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textShortError), SCREEN_TEXT(LCD_LINE2, textNoAlarms), SCREEN_END};
+	const screenItem layoutAlarmDeleted[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textShortSuccess), SCREEN_TEXT(LCD_LINE2, textAlarmDeleted), SCREEN_END};
+	const screenItem layoutAlarmsFull[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textShortError), SCREEN_TEXT(LCD_LINE2, textAlarmsFull), SCREEN_END};
+	const screenItem layoutDeleteSome[] PROGMEM = {SCREEN_TEXT(LCD_LINE2, textDeleteSome), SCREEN_END};
+	const screenItem layoutAlarmAdded[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textShortSuccess), SCREEN_TEXT(LCD_LINE2, textAlarmAdded), SCREEN_END};
+	const screenItem layoutWait[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textWait), SCREEN_END};
+	const screenItem layoutLowFood[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textError), SCREEN_MULTI(LCD_LINE1+15, FMT_CHANNEL) SCREEN_TEXT(LCD_LINE2, textLowFood), SCREEN_END};
+	const screenItem layoutAddFood[] PROGMEM = {SCREEN_TEXT(LCD_LINE2, textAddFood), SCREEN_END};
+	const screenItem layoutDispensing[] PROGMEM = {SCREEN_TEXT(LCD_LINE2, textDispensing), SCREEN_END};
+	const screenItem layoutEmpty[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textError), SCREEN_MULTI(LCD_LINE1+15, FMT_CHANNEL) SCREEN_TEXT(LCD_LINE2, textEmpty), SCREEN_END};
+	const screenItem layoutJam[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textError), SCREEN_MULTI(LCD_LINE1+15, FMT_CHANNEL) SCREEN_TEXT(LCD_LINE2, textJam), SCREEN_END};
+	const screenItem layoutTimeout[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textError), SCREEN_MULTI(LCD_LINE1+15, FMT_CHANNEL) SCREEN_TEXT(LCD_LINE2, textTimeout), SCREEN_END};
+	#if BOWL
+		const screenItem layoutMissing[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textError), SCREEN_MULTI(LCD_LINE1+15, FMT_CHANNEL) SCREEN_TEXT(LCD_LINE2, textMissing), SCREEN_END};
+	#endif
+	const screenItem layoutCheckChute[] PROGMEM = {SCREEN_TEXT(LCD_LINE2, textCheckChute), SCREEN_END};
+	const screenItem layoutSuccess[] PROGMEM = {SCREEN_TEXT(LCD_LINE1, textSuccess), SCREEN_TEXT(LCD_LINE2, textHappyTurtle), SCREEN_END};
+	const screenItem layoutBoot[] PROGMEM = {SCREEN_FIELD(LCD_LINE1, FMT_BOOT), SCREEN_TEXT(LCD_LINE2, textBootHelp), SCREEN_END};
+
+// Arranque.
+	const char bootNameTimer[] PROGMEM = "Timer1  ";
+	const char bootNameResume[] PROGMEM = "Reanudar";
+	const char bootNameRtc[] PROGMEM = "RTC     ";
+	const char bootNameAlarm[] PROGMEM = "Alarma  ";
+	const char bootNameLcd[] PROGMEM = "LCD     ";
+	const char bootNameDisplay[] PROGMEM = "Pantalla";
+	const char bootNameDeferred[] PROGMEM = "Diferido";
+	const char *const bootPhaseNames[] PROGMEM = {
+		bootNameTimer, bootNameResume, bootNameRtc, bootNameAlarm, bootNameLcd, bootNameDisplay, bootNameDeferred
+	};
+	uint32_t bootStamps[BOOT_PHASES];		// Ciclos de CPU al terminar cada fase.
+
+// Perfilado.
+	#if PROFILE
+		typedef struct {
+			uint32_t calls, total, max;			// Total en ciclos, se queda en el mximo si se llena.
+		} profileCounter;
+		
+		profileCounter profileCounters[PROF_FUNCS];
+		uint16_t profileOverhead = 0;		// Ciclos de un par PROFILE_BEGIN/PROFILE_END vaco.
+		
+		const char profNameCheck[] PROGMEM = "Al ";
+		const char profNameSearch[] PROGMEM = "Bu ";
+		const char profNameTime[] PROGMEM = "RT ";
+		const char profNameHx[] PROGMEM = "Hx ";
+		const char profNameAcq[] PROGMEM = "Aq ";
+		const char profNameChar[] PROGMEM = "Ch ";
+		const char profNameInst[] PROGMEM = "In ";
+		const char profNameEeprom[] PROGMEM = "EE ";
+		const char *const profileNames[] PROGMEM = {
+			profNameCheck, profNameSearch, profNameTime, profNameHx, profNameAcq, profNameChar, profNameInst, profNameEeprom
+		};
+	#endif
+
+// Servo.
+	// Un paso de un perfil de movimiento: posicin y cuntos cuadros se sostiene.
+	// Un paso con frames = 0 sostiene la posicin hasta el siguiente Servo_Play.
+	// Los perfiles viven en flash y se leen con pgm_read_*.
+	typedef struct {
+		uint16_t pulseUs;
+		uint8_t frames;
+	} servoStep;
+
+	const servoStep motionClose[] PROGMEM = {{SERVO_CLOSED_US, 0}};
+	const servoStep motionOpen[] PROGMEM = {{SERVO_OPEN_US, 0}};
+	const servoStep motionDispense[] PROGMEM = {
+		{SERVO_OPEN_US, SERVO_MS_TO_FRAMES(400)},
+		{SERVO_CLOSED_US, SERVO_MS_TO_FRAMES(1000)},
+		{0, 0}
+	};
+	const servoStep motionAgitate[] PROGMEM = {
+		{SERVO_OPEN_US, SERVO_MS_TO_FRAMES(100)},
+		{SERVO_CLOSED_US, SERVO_MS_TO_FRAMES(100)},
+		{SERVO_OPEN_US, SERVO_MS_TO_FRAMES(100)},
+		{SERVO_CLOSED_US, SERVO_MS_TO_FRAMES(100)},
+		{SERVO_OPEN_US, SERVO_MS_TO_FRAMES(100)},
+		{SERVO_CLOSED_US, SERVO_MS_TO_FRAMES(300)},
+		{0, 0}
+	};
+	const servoStep motionReverse[] PROGMEM = {
+		{SERVO_REVERSE_US, SERVO_MS_TO_FRAMES(300)},
+		{SERVO_CLOSED_US, SERVO_MS_TO_FRAMES(300)},
+		{0, 0}
+	};
+	const servoStep *const motionProfiles[] PROGMEM = {motionClose, motionOpen, motionDispense, motionAgitate, motionReverse};
+
+	volatile uint8_t servoSlot = CHANNELS;		// Canal cuyo pulso est en alto (CHANNELS: ninguno).
+	volatile uint32_t timer1Frames = 0;
+	uint32_t i2cBusCycles = 0;			// Ciclos de CPU que tom el ltimo readTimeDate.
+	int16_t rtcTemperature = HX_TEMP_NONE;	// Cuartos de C del DS3231 en la ltima lectura.
+
+// Canales.
+	// Filtro de muestras del Hx711: ventana de la mediana y rechazos de la sesin (una comida).
+	// warm cuenta las lecturas que no se publicaron mientras la ventana se llenaba.
+	typedef struct {
+		long window[HX_MEDIAN_SIZE];
+		uint8_t fill, pos, spikeRun, warm;
+		uint16_t saturated, spikes;
+	} hxFilter;
+	
+	// Historial de la tolva: ltimo peso guardado, suma de consumo del anillo y la muestra en curso.
+	typedef struct {
+		int base;
+		uint16_t consumed;						// Gramos que bajaron en las ranuras del anillo.
+		int8_t delta;							// Delta de la ranura que se est escribiendo.
+		uint8_t taken;
+		float sum;
+	} hopperHistory;
+	
+	// Deriva del cero con la temperatura: mnimos cuadrados con olvido sobre pares de muestras
+	// del historial con la tolva quieta (cambio de cuenta contra cambio de temperatura).
+	typedef struct {
+		float slope;							// Cuentas por C a ganancia 128.
+		float sxy, sxx;
+		float lastCount;						// Cuenta a ganancia 128 de la muestra anterior...
+		int16_t lastTemp;						// ... y su temperatura (HX_TEMP_NONE: ninguna).
+		int16_t saved;							// Pendiente guardada en la EEPROM.
+	} hxTempModel;
+	
+	#if BOWL
+		// Plato en el canal B: entrada que eligen los pulsos de la siguiente lectura, conversiones
+		// que faltan tirar y muestras que le quedan al turno; tara de la comida y lo que lleg.
+		typedef struct {
+			hxFilter filter;
+			uint8_t next;						// 1: la siguiente conversin es del plato (26 pulsos).
+			uint8_t settle, turn;
+			float tare;							// Cuenta del plato antes de abrir la compuerta.
+			float grams;						// Comida que lleg al plato desde la tara...
+			float dropped;						// ... y lo que baj la tolva en el mismo tiempo.
+		} bowlScale;
+	#endif
+	
+	// Estado de cada tolva.
+	typedef struct {
+		// Calibracin (a ganancia 128), ltimo peso de la tolva en gramos, la hora de su ltima
+		// muestra y pulsos por lectura.
+		float offset, scale, amount;
+		uint32_t amountStamp;
+		uint8_t gain;
+		hxFilter filter;
+		hopperHistory history;
+		hxTempModel temp;
+		
+		// Servo: lo mueve la interrupcin del Timer1 siguiendo el perfil.
+		const servoStep *volatile step;
+		volatile uint8_t framesLeft;
+		volatile uint16_t pulseTicks;
+		
+		// Comida en curso: peso al empezar (antes de un reinicio, si lo hubo), meta y avance.
+		float startAmount, target, cycleStartAmount;
+		float rate;							// Gramos por segundo de la ltima comida, con la hora de las muestras.
+		uint8_t cycles, stalls, recovering, result;
+	#if BOWL
+		bowlScale bowl;
+	#endif
+	} dispenserChannel;
+	
+	dispenserChannel channels[CHANNELS];
+	uint16_t hxFilterCycles;				// Ciclos por muestra del filtro, medidos en la pgina de diagnstico.
+
+// Adquisicin.
+	// Una conversin validada (la mediana del filtro) y su hora.
+	typedef struct {
+		uint32_t stamp;						// ms desde el arranque en la escala del DS3231.
+		long count;
+		uint8_t tag;						// Tolva (ACQ_CHANNEL) y banderas ACQ_*.
+	} acqSample;
+	
+	// Cursor de un lector. Si se atrasa ms que el anillo salta a la ms vieja que queda y cuenta
+	// las que perdi; uno que se atrasa ms de 256 muestras solo cuenta de menos.
+	typedef struct {
+		uint8_t next;						// Mismo contador que acqHead.
+		uint8_t lost;						// Se queda en 255.
+	} acqReader;
+	
+	// Promedio de times muestras por tolva de mask sobre el anillo, sin esperar: cada
+	// Acq_WindowPoll toma lo que haya y avisa qu tolvas completaron su ventana.
+	typedef struct {
+		acqReader reader;
+		uint8_t mask, times;
+		uint8_t input;						// 0: tolva; ACQ_BOWL: plato.
+		uint8_t taken[CHANNELS];
+		float sum[CHANNELS];
+		float count[CHANNELS];				// Cuenta promedio de la ltima ventana completa...
+		uint32_t stamp[CHANNELS];			// ... y la hora de su ltima muestra.
+	} acqWindow;
+	
+	acqSample acqRing[ACQ_RING];
+	uint8_t acqHead = 0;					// Muestras publicadas (da la vuelta en 256).
+	
+	// Hora de las muestras: ms en acqAnchorFrames y ms por cuadro desde ah. El origen une una
+	// lectura del DS3231 con la hora de las muestras en que empez ese segundo.
+	uint32_t acqAnchorFrames = 0, acqAnchorMs = 0, acqLastStamp = 0;
+	float acqFrameMs = ACQ_FRAME_MS;
+	uint8_t acqSynced = 0;
+	uint32_t acqOriginEpoch, acqOriginMs, acqOriginFrames;
+	
+	#if LINK
+		acqReader linkReader;
+		uint32_t linkSamplesUntil = 0;		// Cuadro hasta el que el enlace pide muestras.
+	#endif
+	#if NET
+		acqReader netReader;
+		uint32_t netWeightUntil = 0;			// Cuadro hasta el que la red pide peso.
+	#endif
+	acqReader histReader;
+	#if BOWL
+		uint8_t acqBowl = 0;				// Tolvas cuyo Hx711 alterna con el plato.
+	#endif
+
+// Presupuesto de SRAM (solo en el micro: en el host los tipos miden otra cosa). Caben, segn la
+// estimacin: 4 tolvas sin extras, 3 con uno de BOWL, LINK o NET, 2 con dos de ellos y 1 con todo.
+	#if BOARD != BOARD_HOST
+		_Static_assert(sizeof(channels) + sizeof(acqRing) + sizeof(at24Page) + sizeof(bootStamps) + sizeof(shownWeights)
+		#if USART_USED
+			+ sizeof(usartBuffer)
+		#endif
+		#if LINK
+			+ sizeof(linkFrame)
+		#endif
+		#if NET
+			+ sizeof(netRegs) + sizeof(netMeal) + sizeof(netWeight)
+		#endif
+		#if PROFILE
+			+ sizeof(profileCounters)
+		#endif
+			+ SRAM_OTHER + SRAM_STACK <= SRAM_SIZE, "No cabe en la SRAM de 1 KB: quite tolvas o extras (BOWL, LINK, NET)");
+	#endif
 	
 	
 
@@ -82,53 +1189,192 @@
 	void printValues8Bits(uint8_t valor);
 	void printValues8BitsTimeFormat(uint8_t valor);
 	void printValues(long valor);
+	void printCompact(uint32_t valor, uint8_t width);
 	void printValuesWithDecimal(float valor);
 	
 // Esqueletos de funciones del LCD.
+	void LCD_wr_nibble(uint8_t nibble, uint8_t rs);
 	void LCD_wr_inst_ini(uint8_t instruccion);
 	void LCD_wr_char(uint8_t data);
 	void LCD_wr_instruction(uint8_t instruccion);
 	void LCD_wait_flag(void);
 	void LCD_init(void);
 	void LCD_wr_string(volatile uint8_t *s);
+	void LCD_wr_string_P(const char *s);
+	void LCD_wr_field(uint8_t format, uint8_t pos);
+	void LCD_draw(const screenItem *layout, uint8_t format);
+	void LCD_draw_screen(const screenItem *layout);
 
 // Esqueletos del EEPROM
 	void EEPROM_write(volatile uint16_t dir, volatile uint8_t data);
 	uint8_t EEPROM_read(uint16_t dir);
+	uint8_t EEPROM_busy();
+	void EEPROM_update(uint16_t dir, uint8_t data);
+	void EEPROM_readBlock(uint16_t dir, void *data, uint8_t len);
+	void EEPROM_updateBlock(uint16_t dir, const void *data, uint8_t len);
 	
 // Esqueletos de Hx711.
-	void Hx711_Calibration();
-	unsigned long Hx711_ReadCount();
-	float read_average(uint8_t times);
-	float get_value(uint8_t times);
-	float get_units(uint8_t times);
-	void tare(uint8_t times);
+	void Channels_Init();
+	void Hx711_Calibration(uint8_t channel);
+	unsigned long Hx711_ReadCount(uint8_t channel);
+	float read_average(uint8_t channel, uint8_t times);
+	float get_value(uint8_t channel, uint8_t times);
+	float get_units(uint8_t channel, uint8_t times);
+	void tare(uint8_t channel, uint8_t times);
+	void Hx711_Update(uint8_t mask, uint8_t times);
+	void Hx711_SetRate(uint8_t rate);
+	void Hx711_SetGain(uint8_t channel, uint8_t pulses);
+	uint8_t Hx711_Samples(uint16_t ms);
+	uint8_t Hx711_Ready(uint8_t channel);
+	long Hx711_Filter(hxFilter *f, long count, long spike);
+	long Hx711_Median(const hxFilter *f);
+	void Hx711_StartSession();
+	uint16_t Hx711_FilterBenchmark();
+	float Hx711_Offset(uint8_t channel);
+	void Hx711_LearnTemperature(uint8_t channel, float count);
+	float Hx711_Scale(uint8_t channel);
+	float Hx711_Grams(uint8_t channel, float count);
+
+// Esqueletos de la adquisicin.
+	uint32_t Acq_Stamp();
+	uint32_t Acq_StampAt(uint32_t frames, uint16_t ticks);
+	void Acq_Discipline(uint32_t epoch, uint32_t frames, uint16_t ticks);
+	void Acq_Service(uint8_t mask);
+	void Acq_Open(acqReader *reader);
+	uint8_t Acq_Next(acqReader *reader, acqSample *sample);
+	void Acq_WindowStart(acqWindow *window, uint8_t mask, uint8_t times);
+	uint8_t Acq_WindowPoll(acqWindow *window);
+
+// Esqueletos del plato.
+	#if BOWL
+		void Bowl_Start(uint8_t mask);
+		void Bowl_Weigh(uint8_t mask, acqWindow *window);
+		void Bowl_Stop();
+		float Bowl_Grams(uint8_t channel, float count);
+	#endif
+
+// Esqueletos del servo.
+	void Servo_Init();
+	void Servo_Play(uint8_t channel, uint8_t profile);
+	uint8_t Servo_Busy(uint8_t channel);
+	uint32_t Timer1_Cycles();
+	uint32_t Timer1_Frames();
+	uint32_t Timer1_Read(uint16_t *ticks);
 	
 // Esqueletos de I2C.
 	void I2C_Init();
 	void I2C_Start();
 	uint8_t I2C_Read_Acknoledgement();
 	uint8_t I2C_Read_Not_Acknoledgement();
-	void I2C_Write(uint8_t data);
+	uint8_t I2C_Write(uint8_t data);
 	void I2C_Stop();
 	
+// Esqueletos de la EEPROM externa.
+	void AT24_Init();
+	uint8_t AT24_Select(uint16_t address);
+	void AT24_Append(const void *data, uint8_t len);
+	void AT24_Flush();
+	uint8_t AT24_Read(uint16_t address, uint8_t *data, uint8_t len);
+	void MealLog_Record(uint8_t channel);
+	
 // Esqueletos de DS3231.
 	uint8_t  BCD_To_DEC(uint8_t BCD_value);
 	uint8_t DEC_To_BCD (uint8_t decimal_value);
 	void SetTimeDate(uint8_t _minutes, uint8_t _hours, uint8_t _date, uint8_t _month, uint8_t _year);
+	void Clock_Set(uint32_t epoch);
 	void readTimeDate();
 	void updateTimeDate();
+	uint32_t Clock_Now();
+	uint32_t Clock_FromFields(uint8_t _year, uint8_t _month, uint8_t _date, uint8_t _hours, uint8_t _minutes, uint8_t _seconds);
+	void Clock_Split(uint32_t epoch);
+	void Clock_Show();
 	
 // Esqueletos de funciones de mostrar tipos de pantalla.
-	void showMainScreen();
-	void showWeightScreen();
-	void showAgendOptions();
-	void showDeleteAlarms();
-	void showAddAlarms();
+	uint8_t showMainScreen();
+	uint8_t showWeightScreen();
+	uint8_t showAgendOptions();
+	uint8_t showDeleteAlarms();
+	uint8_t showAddAlarms();
 	uint8_t searchAlarms();
-	void showGiveFoodScreen();
-	void showGivingFoodScreen(int foodAmount);
-	void checkAlarms();
+	uint8_t showGiveFoodScreen();
+	uint8_t showGivingFoodScreen(int foodAmount, uint8_t mask);
+	void showDispenseError(uint8_t result);
+	uint8_t dispenseFood(uint8_t mask);
+	uint8_t dispenseCycle(uint8_t channel);
+	uint8_t screenAfterDispense(uint8_t result);
+	uint8_t chooseTarget(const screenItem *layout, uint8_t back);
+	uint8_t alarmTarget(uint8_t dir);
+	uint8_t alarmDue();
+	uint32_t alarmOccurrence(uint8_t dir, uint32_t now);
+	uint32_t alarmOccurrenceAt(uint8_t hour, uint8_t minute, uint32_t now);
+	uint8_t checkAlarms();
+	uint8_t serviceMainLoop();
+	uint8_t showBootScreen();
+	void messageDelay();
+
+// Esqueletos del checkpoint de comidas.
+	void Checkpoint_Begin(int foodAmount, uint8_t mask);
+	void Checkpoint_Start(uint8_t mask);
+	void Checkpoint_Clear();
+	uint8_t Checkpoint_Pending();
+	uint8_t resumeDispense();
+
+// Esqueletos del historial de peso.
+	void History_Init();
+	void History_Locate();
+	void History_Service();
+	void History_Record();
+	void History_WriteStep();
+	void History_Forecast();
+	uint16_t History_Daily(uint8_t channel);
+	
+// Esqueletos del perfilado.
+	#if PROFILE
+		void Profile_Reset();
+		void Profile_Add(uint8_t id, uint32_t start);
+	#endif
+	
+// Esqueletos de la configuracin guardada.
+	void Config_Load();
+	uint8_t Config_CalibrationValid(float offset, float scale);
+	#if CFG_REMOTE
+		void Config_Copy(uint8_t *to, const void *from, uint8_t len);
+		void Config_Read(uint8_t *block);
+		uint8_t Config_Valid(const uint8_t *block);
+		void Config_Commit(const uint8_t *block);
+		uint8_t Config_Write(uint8_t *block);
+	#endif
+	
+// Esqueletos de la USART, del trace y del enlace.
+	#if USART_USED
+		void Usart_Init();
+		uint8_t Usart_Free();
+		void Usart_Put(uint8_t data);
+		void Usart_Send();
+	#endif
+	#if TRACE
+		uint32_t Trace_Now();
+		void Trace_Record(uint8_t header, const void *value, uint8_t len);
+		uint8_t Trace_Button(uint8_t bit, uint8_t down);
+		void Trace_Feed(uint8_t mask);
+		void Trace_Result(uint8_t channel);
+	#endif
+	#if LINK
+		void Link_Service();
+		void Link_Reply(uint8_t command, uint8_t status, const uint8_t *data, uint8_t len);
+		uint8_t Link_Samples(uint8_t *data);
+	#endif
+	
+// Esqueletos de la red.
+	#if NET
+		void Net_Init();
+		void Net_Attach();
+		void Net_Detach();
+		uint8_t Net_Service();
+		void Net_Publish();
+		void Net_Feeding();
+		void Net_Meal(uint8_t mask);
+	#endif
 	
 	
 	
@@ -158,9 +1404,9 @@ void saca_cero(volatile uint8_t *LUGAR, uint8_t BIT){
 
 
 // Funciones del LCD.
+// Los 15 ms de encendido del HD44780 los espera main antes de llamarla (ver LCD_POWER_UP_MS).
 void LCD_init(void){
 	DDRLCD=(15<<0)|(1<<RS)|(1<<RW)|(1<<E); //DDRLCD=DDRLCD|(0B01111111)
-	_delay_ms(15);
 	LCD_wr_inst_ini(0b00000011);
 	_delay_ms(5);
 	LCD_wr_inst_ini(0b00000011);
@@ -177,74 +1423,55 @@ void LCD_init(void){
 }
 
 void LCD_wr_char(uint8_t data){
-	//saco la parte ms significativa del dato
-	PORTLCD=data>>4; //Saco el dato y le digo que escribir un dato
-	saca_uno(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
-	saca_uno(&PORTLCD,E);
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
-	//saco la parte menos significativa del dato
-	PORTLCD=data&0b00001111; //Saco el dato y le digo que escribir un dato
-	saca_uno(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
-	saca_uno(&PORTLCD,E);
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
-	saca_cero(&PORTLCD,RS);
+	PROFILE_BEGIN(PROF_LCD_CHAR);
+	LCD_wr_nibble(data>>4, 1);				// Parte ms significativa del dato.
+	LCD_wr_nibble(data&0b00001111, 1);		// Parte menos significativa del dato.
 	LCD_wait_flag();
+	PROFILE_END(PROF_LCD_CHAR);
 }
 
 void LCD_wr_inst_ini(uint8_t instruccion){
-	PORTLCD=instruccion; //Saco el dato y le digo que escribir un dato
-	saca_cero(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
-	saca_uno(&PORTLCD,E);
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
+	LCD_wr_nibble(instruccion, 0);
 }
 
 void LCD_wr_instruction(uint8_t instruccion){
-	//saco la parte ms significativa de la instruccin
-	PORTLCD=instruccion>>4; //Saco el dato y le digo que escribir un dato
-	saca_cero(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
-	saca_uno(&PORTLCD,E);
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
-	//saco la parte menos significativa de la instruccin
-	PORTLCD=instruccion&0b00001111; //Saco el dato y le digo que escribir un dato
-	saca_cero(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
-	saca_uno(&PORTLCD,E);
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
+	PROFILE_BEGIN(PROF_LCD_INST);
+	LCD_wr_nibble(instruccion>>4, 0);			// Parte ms significativa de la instruccin.
+	LCD_wr_nibble(instruccion&0b00001111, 0);	// Parte menos significativa de la instruccin.
 	LCD_wait_flag();
+	PROFILE_END(PROF_LCD_INST);
+}
+
+#if BOARD != BOARD_HOST
+void LCD_wr_nibble(uint8_t nibble, uint8_t rs){
+	PORTLCD=nibble|(rs<<RS);				// Saco el nibble, RW en cero (escribir).
+	PORTLCD|=(1<<E);
+	LCD_E_PULSE();
+	PORTLCD&=~(1<<E);
 }
 
 void LCD_wait_flag(void){
-	//	_delay_ms(100);
 	DDRLCD&=0b11110000; //Para poner el pin BF como entrada para leer la bandera lo dems salida
-	saca_cero(&PORTLCD,RS);// Instruccin
-	saca_uno(&PORTLCD,RW); // Leer
+	PORTLCD&=~(1<<RS);	// Instruccin
+	PORTLCD|=(1<<RW);	// Leer
 	while(1){
-		saca_uno(&PORTLCD,E); //pregunto por el primer nibble
-		_delay_ms(10);
-		saca_cero(&PORTLCD,E);
-		if(uno_en_bit(&PINLCD,BF)) {break;} //uno_en_bit para protues, 0 para la vida real
+		PORTLCD|=(1<<E); //pregunto por el primer nibble
+		LCD_E_PULSE();
+		PORTLCD&=~(1<<E);
+		if(LCD_READY()) {break;}
 		_delay_us(10);
-		saca_uno(&PORTLCD,E); //pregunto por el segundo nibble
-		_delay_ms(10);
-		saca_cero(&PORTLCD,E);
+		PORTLCD|=(1<<E); //pregunto por el segundo nibble
+		LCD_E_PULSE();
+		PORTLCD&=~(1<<E);
 	}
-	saca_uno(&PORTLCD,E); //pregunto por el segundo nibble
-	_delay_ms(10);
-	saca_cero(&PORTLCD,E);
+	PORTLCD|=(1<<E); //pregunto por el segundo nibble
+	LCD_E_PULSE();
+	PORTLCD&=~(1<<E);
 	//entonces cuando tenga cero puede continuar con esto...
-	saca_cero(&PORTLCD,RS);
-	saca_cero(&PORTLCD,RW);
+	PORTLCD&=~((1<<RS)|(1<<RW));
 	DDRLCD|=(15<<0)|(1<<RS)|(1<<RW)|(1<<E);
 }
+#endif
 
 void LCD_wr_string(volatile uint8_t *s){
 	uint8_t c;
@@ -253,8 +1480,153 @@ void LCD_wr_string(volatile uint8_t *s){
 	}
 }
 
+void LCD_wr_string_P(const char *s){
+	uint8_t c;
+	while((c=pgm_read_byte(s++))){
+		LCD_wr_char(c);
+	}
+}
+
+// Formateadores de los campos de las pantallas. El cursor ya est en pos.
+void LCD_wr_field(uint8_t format, uint8_t pos){
+	switch(format){
+		case FMT_DATE:
+			printValues8BitsTimeFormat(date);
+			LCD_wr_char('/');
+			printValues8BitsTimeFormat(month);
+			LCD_wr_char('/');
+			printValues8BitsTimeFormat(year);
+			break;
+		case FMT_TIME:
+			printValues8BitsTimeFormat(hours);
+			LCD_wr_char(':');
+			printValues8BitsTimeFormat(minutes);
+			break;
+		case FMT_WEIGHT:
+		#if CHANNELS > 1
+			// Una columna de 4 por tolva: "500 480  12 300".
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				int grams = shownWeights[ch] < 0 ? 0 : shownWeights[ch] > 999 ? 999 : shownWeights[ch];
+				for(int digit=100;digit>1 && grams<digit;digit/=10){
+					LCD_wr_char(' ');
+				}
+				printValues(grams);
+				LCD_wr_char(' ');
+			}
+			(void)pos;
+		#else
+			for(uint8_t i=pos&0x0F;i<16;i++){
+				LCD_wr_char(' ');
+			}
+			LCD_wr_instruction(pos);
+			printValues(shownWeights[0]);
+		#endif
+			break;
+		case FMT_ALARM:
+			printValues8BitsTimeFormat(shownHours);
+			LCD_wr_char(':');
+			printValues8BitsTimeFormat(shownMinutes);
+			break;
+		case FMT_GRAMS:
+			if(shownAmount < 100){
+				LCD_wr_char(' ');
+			}
+			printValues(shownAmount);
+			break;
+		case FMT_BOOT:{
+			if(shownPhase == DIAG_FILTER){
+				// Rechazos de la ltima comida (tolva 1) y costo del filtro: "S  3 P 12 184c/m".
+				uint16_t values[3] = {channels[0].filter.saturated, channels[0].filter.spikes, hxFilterCycles};
+				for(uint8_t i=0;i<3;i++){
+					uint16_t value = values[i] > 999 ? 999 : values[i];
+					LCD_wr_char(i == 0 ? 'S' : i == 1 ? 'P' : ' ');
+					for(uint16_t digit=100;digit>1 && value<digit;digit/=10){
+						LCD_wr_char(' ');
+					}
+					printValues(value);
+					if(i == 0){
+						LCD_wr_char(' ');
+					}
+				}
+				LCD_wr_char('c');
+				LCD_wr_char('/');
+				LCD_wr_char('m');
+				break;
+			}
+		#if PROFILE
+			if(shownPhase >= DIAG_PROFILE){
+				// Llamadas, ciclos promedio y mximo: "RT  12 3760 3812".
+				profileCounter *p = &profileCounters[shownPhase - DIAG_PROFILE];
+				LCD_wr_string_P(pgm_read_ptr(&profileNames[shownPhase - DIAG_PROFILE]));
+				printCompact(p->calls, 3);
+				LCD_wr_char(' ');
+				printCompact(p->calls ? p->total/p->calls : 0, 4);
+				LCD_wr_char(' ');
+				printCompact(p->max, 4);
+				break;
+			}
+		#endif
+			// Dcimas de ms alineadas a la derecha: "Alarma    0.9ms".
+			uint32_t tenths = bootStamps[shownPhase]/(F_CPU/10000UL), ms = tenths/10;
+			LCD_wr_string_P(pgm_read_ptr(&bootPhaseNames[shownPhase]));
+			for(uint32_t digit=100;digit>1 && ms<digit;digit/=10){
+				LCD_wr_char(' ');
+			}
+			printValues(ms);
+			LCD_wr_char('.');
+			LCD_wr_char('0' + tenths%10);
+			LCD_wr_char('m');
+			LCD_wr_char('s');
+			LCD_wr_char(shownPhase == BOOT_DISPLAY && ms > BOOT_BUDGET_MS ? '!' : ' ');
+			break;
+		}
+		case FMT_TARGET:
+			LCD_wr_char('T');
+			LCD_wr_char(shownTarget == TARGET_ALL ? '*' : '0' + shownTarget);
+			break;
+		case FMT_CHANNEL:
+			LCD_wr_char('1' + shownChannel);
+			break;
+		case FMT_REFILL:
+			if(shownDaysLeft < HIST_WARN_DAYS){
+				LCD_wr_char('!');
+				LCD_wr_char('0' + shownDaysLeft);
+			}
+			else{
+				LCD_wr_char(' ');
+				LCD_wr_char(' ');
+			}
+			break;
+	}
+}
+
+// Dibuja los elementos de la tabla con el formato indicado (FMT_ALL: todos).
+void LCD_draw(const screenItem *layout, uint8_t format){
+	uint8_t itemFormat, pos;
+	
+	while((itemFormat = pgm_read_byte(&layout->format)) != FMT_END){
+		if(format == FMT_ALL || format == itemFormat){
+			pos = pgm_read_byte(&layout->pos);
+			LCD_wr_instruction(pos);
+			if(itemFormat == FMT_TEXT){
+				LCD_wr_string_P(pgm_read_ptr(&layout->text));
+			}
+			else{
+				LCD_wr_field(itemFormat, pos);
+			}
+		}
+		layout++;
+	}
+}
+
+void LCD_draw_screen(const screenItem *layout){
+	LCD_wr_instruction(LCD_Cmd_Clear);
+	LCD_draw(layout, FMT_ALL);
+}
+
 
 // Funciones del EEPROM
+#if BOARD != BOARD_HOST
 void EEPROM_write(volatile uint16_t dir, volatile uint8_t data){
 	while(uno_en_bit(&EECR, EEWE)){}
 	
@@ -267,502 +1639,1343 @@ void EEPROM_write(volatile uint16_t dir, volatile uint8_t data){
 	sei();
 }
 
+uint8_t EEPROM_busy(){
+	return uno_en_bit(&EECR, EEWE);
+}
+
 uint8_t EEPROM_read(uint16_t dir){
+	PROFILE_BEGIN(PROF_EEPROM_READ);
 	while(uno_en_bit(&EECR, EEWE)){}
 
 	EEAR = dir;
 	
 	EECR |= (1<<EERE);
 	
-	return EEDR;
+	PROFILE_RETURN(PROF_EEPROM_READ, EEDR);
+}
+#endif
+
+// Solo escribe si el byte cambia: cuida la EEPROM y el tiempo de las escrituras.
+void EEPROM_update(uint16_t dir, uint8_t data){
+	if(EEPROM_read(dir) != data){
+		EEPROM_write(dir, data);
+	}
+}
+
+// Bloques en el orden de la SRAM (little endian en el AVR y en el simulador).
+void EEPROM_readBlock(uint16_t dir, void *data, uint8_t len){
+	uint8_t *bytes = data;
+	
+	while(len--){
+		*bytes++ = EEPROM_read(dir++);
+	}
+}
+
+void EEPROM_updateBlock(uint16_t dir, const void *data, uint8_t len){
+	const uint8_t *bytes = data;
+	
+	while(len--){
+		EEPROM_update(dir++, *bytes++);
+	}
 }
 
 
 // Funciones del Hx711.
-unsigned long Hx711_ReadCount(){
+// Pines del Hx711, servo y calibracin de fbrica de cada tolva.
+void Channels_Init(){
+	HX_RATE_DDR |= (1<<HX_RATE_PIN);
+	HX_RATE_PORT &= ~(1<<HX_RATE_PIN);
+	hxRate = HX_RATE_10SPS;
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		CH_DISPATCH(ch, CH_PINS_INIT);
+		channels[ch].offset = HX_DEFAULT_OFFSET;
+		channels[ch].scale = HX_DEFAULT_SCALE;
+		channels[ch].gain = HX_GAIN_A128;
+	#if BOWL
+		channels[ch].bowl.settle = BOWL_SETTLE;	// Un reinicio pudo dejar al Hx711 en el canal B.
+	#endif
+		
+		// Lo aprendido antes del reinicio arranca con el peso de HX_TEMP_PRIOR.
+		hxTempModel *t = &channels[ch].temp;
+		t->saved = EEPROM_read(EE_HX_TEMP_SLOPE + 2*ch) | (EEPROM_read(EE_HX_TEMP_SLOPE + 2*ch + 1) << 8);
+		if(t->saved == -1 || t->saved > HX_TEMP_SLOPE_MAX || t->saved < -HX_TEMP_SLOPE_MAX){
+			t->saved = 0;						// EEPROM borrada.
+		}
+		t->slope = t->saved;
+		t->sxx = HX_TEMP_PRIOR;
+		t->sxy = t->slope*HX_TEMP_PRIOR;
+		t->lastTemp = HX_TEMP_NONE;
+	}
+}
+
+// SCK en alto no debe pasar de 60 us o el Hx711 se apaga, y los servos escriben el mismo
+// puerto desde la interrupcin: cada pulso de SCK va con las interrupciones apagadas. Se
+// expande en cada rama de Hx711_ReadCount con los pines constantes de la tolva.
+static inline __attribute__((always_inline))
+unsigned long Hx711_Shift(uint8_t channel, volatile uint8_t *port, volatile uint8_t *pin, uint8_t dout, uint8_t sck){
 	unsigned long count;
 	unsigned char i;
 	
-	saca_uno(&PORTD,0); 
-	saca_cero(&PORTD,1);       
+	cli();
+	*port |= dout; 
+	HX_SCK_LOW(channel, port, sck);
+	sei();
 	count=0;                              
-	while(uno_en_bit(&PIND,0));  
+	while(HX_DOUT_HIGH(channel, pin, dout));  
 
 	// Leer ADC de 24 bits.               
 	for (i=0;i<24;i++){                     
-		saca_uno(&PORTD,1);                     
+		cli();
+		HX_SCK_HIGH(channel, port, sck);                     
 		count = count<<1;           				
-		saca_cero(&PORTD,1);             
-		if(uno_en_bit(&PIND,0)) count++;       
+		HX_SCK_LOW(channel, port, sck);             
+		sei();
+		if(HX_DOUT_HIGH(channel, pin, dout)) count++;       
 	}
 
-	saca_uno(&PORTD,1);                     
+	cli();
+	HX_SCK_HIGH(channel, port, sck);                     
 	count = count^0x800000;         
-	saca_cero(&PORTD,1);              	
+	HX_SCK_LOW(channel, port, sck);              	
+	sei();
+	
+	// Pulsos extra: canal B a 32 o canal A a 64 para la siguiente conversin.
+	uint8_t pulses = channels[channel].gain;
+#if BOWL
+	if(channels[channel].bowl.next){
+		pulses = HX_GAIN_B32;
+	}
+#endif
+	for (i=HX_GAIN_A128;i<pulses;i++){
+		cli();
+		HX_SCK_HIGH(channel, port, sck);
+		HX_SCK_LOW(channel, port, sck);
+		sei();
+	}
+	
+	return count;
+}
+
+unsigned long Hx711_ReadCount(uint8_t channel){
+	unsigned long count = 0;
+	PROFILE_BEGIN(PROF_HX_READ);
+	
+	#define HX_SHIFT(n) count = Hx711_Shift(n, HX_PINS(n))
+	CH_DISPATCH(channel, HX_SHIFT);
+	#undef HX_SHIFT
+	TRACE_EVENT(TR_HX, channel, &count, 3);
+	PROFILE_END(PROF_HX_READ);
 	
 	return count;                            
 }
 
-float read_average(uint8_t times) {
-	float sum = 0;
-	for (uint8_t i = 0; i < times; i++) {
-		sum += Hx711_ReadCount();
-	}
-	return sum / times;
+float read_average(uint8_t channel, uint8_t times) {
+	acqWindow window;
+	
+	Acq_WindowStart(&window, 1<<channel, times);
+	while(!Acq_WindowPoll(&window));
+	return window.count[channel];
 }
 
-float get_value(uint8_t times) {
-	return read_average(times) - OFFSET;
+float get_value(uint8_t channel, uint8_t times) {
+	return read_average(channel, times) - Hx711_Offset(channel);
 }
 
-float get_units(uint8_t times) {
-	return get_value(times) / SCALE;
+float get_units(uint8_t channel, uint8_t times) {
+	return get_value(channel, times) / Hx711_Scale(channel);
 }
 
-void tare(uint8_t times) {
-	double sum = read_average(times);
-	OFFSET = sum;
+// El offset se guarda referido a HX_DEFAULT_TEMP: la tara a otra temperatura no pierde la compensacin.
+void tare(uint8_t channel, uint8_t times) {
+	double sum = read_average(channel, times);
+	channels[channel].offset = HX_COUNT_ZERO + (sum - HX_COUNT_ZERO) / HX_GAIN_FACTOR(channels[channel].gain)
+		- HX_TEMP_DELTA(channel);
 }
 
-void Hx711_Calibration(){
+void Hx711_Calibration(uint8_t channel){
 	float knowWeight = 295.0;
 	
-	float scale = get_value(100) / knowWeight;
+	float scale = get_value(channel, 100) / knowWeight / HX_GAIN_FACTOR(channels[channel].gain);
 	
 	printValuesWithDecimal(scale);
 }
 
-
-// Funciones I2C.
-void I2C_Init()
-{
-	// Inicializar reloj de I2C.
-	TWSR = 0;                         		// Sin prescaler.
-	TWBR = ((F_CPU/SCL_CLOCK)-16)/2;
+// Pesa las tolvas de mask y espera a que todas completen su ventana. Los Hx711 convierten a
+// la vez, as que promediar N tolvas tarda lo mismo que una. Deja los gramos en channels[].amount.
+void Hx711_Update(uint8_t mask, uint8_t times){
+	acqWindow window;
+	uint8_t done = 0;
+	
+	Acq_WindowStart(&window, mask, times);
+	while(done != mask){
+		uint8_t fresh = Acq_WindowPoll(&window);
+		window.mask &= ~fresh;
+		done |= fresh;
+	}
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			channels[ch].amount = Hx711_Grams(ch, window.count[ch]);
+			channels[ch].amountStamp = window.stamp[ch];
+		}
+	}
 }
 
-void I2C_Start()
-{
-	// Borrar el indicador de interrupcin TWI, poner la condicin de inicio en SDA, habilitar TWI.
-	TWCR = (1<<TWINT)|(1<<TWSTA)|(1<<TWEN);
+// Calibracin efectiva con la ganancia y la temperatura actuales: offset y scale se guardan a
+// ganancia 128 y el offset a HX_DEFAULT_TEMP, as que get_value ya sale compensado.
+float Hx711_Offset(uint8_t channel){
+	float offset = channels[channel].offset + HX_TEMP_DELTA(channel);
 	
-	while(!(TWCR & (1<<TWINT)));
+	return HX_COUNT_ZERO + (offset - HX_COUNT_ZERO) * HX_GAIN_FACTOR(channels[channel].gain);
 }
 
-uint8_t I2C_Read_Acknoledgement() {
-	TWCR = (1<<TWEN)|(1<<TWINT)|(1<<TWEA);
-	while (!(TWCR & (1<<TWINT)));
+// Una muestra del historial (cuenta promedio a ganancia 128). Con la tolva quieta entre dos
+// muestras el cambio de la cuenta es deriva: se ajusta la pendiente si la temperatura se
+// movi lo suficiente y lo que sobra cabe en HX_TEMP_MAX_STEP_G. Comidas y rellenos no cuentan.
+void Hx711_LearnTemperature(uint8_t channel, float count){
+	hxTempModel *t = &channels[channel].temp;
 	
-	return TWDR;
+	if(t->lastTemp != HX_TEMP_NONE && rtcTemperature != HX_TEMP_NONE){
+		float dt = (rtcTemperature - t->lastTemp)/4.0f, dc = count - t->lastCount;
+		float residual = dc - t->slope*dt;
+		if((rtcTemperature - t->lastTemp >= HX_TEMP_MIN_STEP || t->lastTemp - rtcTemperature >= HX_TEMP_MIN_STEP)
+				&& residual < HX_TEMP_MAX_STEP_G*channels[channel].scale && residual > -HX_TEMP_MAX_STEP_G*channels[channel].scale){
+			t->sxy = t->sxy*HX_TEMP_FORGET + dt*dc;
+			t->sxx = t->sxx*HX_TEMP_FORGET + dt*dt;
+			t->slope = t->sxy/t->sxx;
+			if(t->slope > HX_TEMP_SLOPE_MAX) t->slope = HX_TEMP_SLOPE_MAX;
+			if(t->slope < -HX_TEMP_SLOPE_MAX) t->slope = -HX_TEMP_SLOPE_MAX;
+			if(t->slope - t->saved >= HX_TEMP_SAVE_STEP || t->saved - t->slope >= HX_TEMP_SAVE_STEP){
+				t->saved = t->slope;			// Sale con las escrituras del historial.
+			}
+		}
+	}
+	t->lastCount = count;
+	t->lastTemp = rtcTemperature;
 }
 
-uint8_t I2C_Read_Not_Acknoledgement() {
-	TWCR = (1<<TWINT)|(1<<TWEN);
-	while (!(TWCR & (1<<TWINT)));
-	
-	return TWDR;
+float Hx711_Scale(uint8_t channel){
+	return channels[channel].scale * HX_GAIN_FACTOR(channels[channel].gain);
 }
 
-void I2C_Write(uint8_t data)
-{
-	TWDR = data;    						// Aadir los datos a TWDR.
-	TWCR = (1<<TWINT)|(1<<TWEN);    		// Borrar indicador de interrupcin TWI, habilitar TWI.
-	while (!(TWCR & (1<<TWINT)));			// Esperar hasta que se transmita el byte TWDR completo
+float Hx711_Grams(uint8_t channel, float count){
+	return (count - Hx711_Offset(channel)) / Hx711_Scale(channel);
 }
 
-void I2C_Stop() {
-	// Borrar el indicador de interrupcin TWI, poner la condicin de parada en SDA, habilitar TWI.
-	TWCR= (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
-	while(!(TWCR & (1<<TWSTO)));  			// Esperar hasta que se transmita la condicin de parada
+// Cambia la tasa de todos los Hx711 y descarta las conversiones mientras se asientan
+// (400 ms a 10 muestras/s, 50 ms a 80).
+void Hx711_SetRate(uint8_t rate){
+	if(rate == hxRate){
+		return;
+	}
+	hxRate = rate;
+	if(rate == HX_RATE_80SPS){
+		HX_RATE_PORT |= (1<<HX_RATE_PIN);
+	}
+	else{
+		HX_RATE_PORT &= ~(1<<HX_RATE_PIN);
+	}
+	
+	for(uint8_t i=0;i<HX_SETTLE_CONVERSIONS;i++){
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			Hx711_ReadCount(ch);
+		}
+		wdt_reset();
+	}
 }
 
+// Los pulsos de una lectura programan la siguiente conversin: la que ya estaba en curso
+// sale con la ganancia vieja y se descarta.
+void Hx711_SetGain(uint8_t channel, uint8_t pulses){
+	channels[channel].gain = pulses;
+	channels[channel].filter.fill = channels[channel].filter.warm = 0;	// La mediana vieja est en otra escala.
+	Hx711_ReadCount(channel);
+}
 
-// Funciones DS3231.
-uint8_t  BCD_To_DEC(uint8_t BCD_value)
-{
-	return (BCD_value >> 4) * 10 + (BCD_value & 0x0F);
+// Valida una muestra y regresa la mediana de las ltimas buenas. Las saturadas y los picos
+// (vibracin del servo, un reloj perdido) no entran a la ventana y se cuentan; si los picos
+// se repiten HX_SPIKE_RUN veces es un cambio real de peso y la ventana vuelve a empezar.
+long Hx711_Filter(hxFilter *f, long count, long spike){
+	if(count == HX_COUNT_MIN || count == HX_COUNT_MAX){
+		f->saturated++;
+		if(f->fill == 0){
+			return count;						// An no hay nada mejor que regresar.
+		}
+	}
+	else{
+		if(f->fill == HX_MEDIAN_SIZE){
+			long median = Hx711_Median(f);
+			long diff = count > median ? count - median : median - count;
+			
+			if(diff > spike){
+				f->spikes++;
+				if(++f->spikeRun < HX_SPIKE_RUN){
+					return median;
+				}
+				f->fill = 0;
+			}
+		}
+		f->spikeRun = 0;
+		
+		f->window[f->pos] = count;
+		f->pos = (f->pos + 1) % HX_MEDIAN_SIZE;
+		if(f->fill < HX_MEDIAN_SIZE){
+			f->fill++;
+		}
+	}
+	
+	if(f->fill < HX_MEDIAN_SIZE){
+		return f->window[(f->pos + HX_MEDIAN_SIZE - 1) % HX_MEDIAN_SIZE];
+	}
+	return Hx711_Median(f);
 }
 
-uint8_t DEC_To_BCD (uint8_t decimal_value)
-{
-	return ((decimal_value / 10) << 4) + (decimal_value % 10);
+// Mediana de 3 con comparaciones, sin ordenar.
+long Hx711_Median(const hxFilter *f){
+	long a = f->window[0], b = f->window[1], c = f->window[2];
+	
+	if(a > b){
+		return b > c ? b : (a > c ? c : a);
+	}
+	return a > c ? a : (b > c ? c : b);
 }
 
-void SetTimeDate(uint8_t _minutes, uint8_t _hours, uint8_t _date, uint8_t _month, uint8_t _year){
-	I2C_Start();
-	I2C_Write(0xD0);
-	I2C_Write(0);
-	I2C_Write(DEC_To_BCD(0)); 					// Segundos.
-	I2C_Write(DEC_To_BCD(_minutes)); 			// Minutos.
-	I2C_Write(DEC_To_BCD(_hours)); 				// Hora.
-	I2C_Write(1); 								// Ignorar da de la semana.
-	I2C_Write(DEC_To_BCD(_date)); 				// Da.
-	I2C_Write(DEC_To_BCD(_month));				// Mes.
-	I2C_Write(DEC_To_BCD(_year)); 				// Ao.
-	I2C_Stop();
+// Empieza una sesin: limpia los contadores de rechazos y la ventana de todas las tolvas
+// (entre comidas pudieron rellenar la tolva y la mediana vieja rechazara el peso nuevo).
+void Hx711_StartSession(){
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		channels[ch].filter.saturated = channels[ch].filter.spikes = 0;
+		channels[ch].filter.fill = channels[ch].filter.warm = 0;
+	}
 }
 
-void readTimeDate(){
-	// Comenzar a leer.
-	I2C_Start();
-	I2C_Write(0xD0);
-	I2C_Write(0);
-	I2C_Stop();
+// Ciclos de CPU por muestra del filtro sobre muestras sintticas con ruido, picos y
+// saturacin. Se descuenta el mismo ciclo sin filtro; la interrupcin del servo (un cuadro
+// de cada ~13 ms que dura la prueba) queda incluida.
+uint16_t Hx711_FilterBenchmark(){
+	hxFilter f = {{0}, 0, 0, 0, 0, 0, 0};
+	volatile long sink;
+	uint32_t start, base, filtered;
 	
-	// Leer informacin.
-	I2C_Start();
-	I2C_Write(0xD1);
-	seconds = BCD_To_DEC(I2C_Read_Acknoledgement());
-	minutes = BCD_To_DEC(I2C_Read_Acknoledgement());
-	hours = BCD_To_DEC(I2C_Read_Acknoledgement());
-	I2C_Read_Acknoledgement();
-	date = BCD_To_DEC(I2C_Read_Acknoledgement());
-	month = BCD_To_DEC(I2C_Read_Acknoledgement());
-	year = BCD_To_DEC(I2C_Read_Not_Acknoledgement());
-	I2C_Stop();
+	start = Timer1_Cycles();
+	for(uint16_t i=0;i<HX_BENCH_SAMPLES;i++){
+		long count = HX_DEFAULT_OFFSET + (long)(i*37 % 1001) - 500;
+		sink = (i & 15) == 15 ? count + 100000 : (i & 63) == 62 ? HX_COUNT_MAX : count;
+	}
+	base = Timer1_Cycles() - start;
+	
+	start = Timer1_Cycles();
+	for(uint16_t i=0;i<HX_BENCH_SAMPLES;i++){
+		long count = HX_DEFAULT_OFFSET + (long)(i*37 % 1001) - 500;
+		sink = Hx711_Filter(&f, (i & 15) == 15 ? count + 100000 : (i & 63) == 62 ? HX_COUNT_MAX : count, HX_SPIKE_COUNTS);
+	}
+	filtered = Timer1_Cycles() - start;
+	(void)sink;
 	
-	// Guardar valores en variables de comprobacin de cambio.
-	dateCombination = (year << 12) | (month << 4) | (date << 0);
-	hourCombination = (hours << 8) | (minutes << 0);
+	return filtered > base ? (filtered - base) / HX_BENCH_SAMPLES : 0;
 }
 
-void updateTimeDate(){
-	unsigned long int dateCombinationCopy = dateCombination;
-	unsigned long int hourCombinationCopy = hourCombination;
+// DOUT en bajo: hay una conversin lista y leerla no espera.
+uint8_t Hx711_Ready(uint8_t channel){
+	uint8_t busy = 1;
 	
-	readTimeDate();
+	#define HX_BUSY(n) busy = HX_DOUT_HIGH(n, &IO_PIN(CH##n##_HX_IO), 1<<CH##n##_HX_DOUT)
+	CH_DISPATCH(channel, HX_BUSY);
+	#undef HX_BUSY
+	return !busy;
+}
+
+// Muestras que caben en una ventana de ms a la tasa actual (al menos una).
+uint8_t Hx711_Samples(uint16_t ms){
+	uint16_t samples = (uint32_t)ms * HX_SPS(hxRate) / 1000;
 	
-	if(dateCombination != dateCombinationCopy){
-		pastAlarmHours = 100;
-		pastAlarmMinutes = 100;
-		
-		LCD_wr_instruction(0b10000000);	
-		printValues8BitsTimeFormat(date);
-		LCD_wr_string("/");
-		printValues8BitsTimeFormat(month);
-		LCD_wr_string("/");
-		printValues8BitsTimeFormat(year);
+	if(samples < 1){
+		return 1;
 	}
+	return samples > 255 ? 255 : samples;
+}
+
+
+// Funciones de la adquisicin.
+uint32_t Acq_Stamp(){
+	uint16_t ticks;
+	uint32_t frames = Timer1_Read(&ticks);
+	uint32_t stamp = Acq_StampAt(frames, ticks);
 	
-	if(hourCombination != hourCombinationCopy){
-		pastAlarmHours = 100;
-		pastAlarmMinutes = 100;
-		
-		LCD_wr_instruction(0b10001001);	
-		printValues8BitsTimeFormat(hours);
-		LCD_wr_string(":");
-		printValues8BitsTimeFormat(minutes);
+	if((int32_t)(stamp - acqLastStamp) < 0){
+		stamp = acqLastStamp;					// Justo despus de bajar la tasa.
 	}
+	acqLastStamp = stamp;
+	return stamp;
 }
 
-
-// Pantallas.
-void showMainScreen(){
-	checkAlarms();
+uint32_t Acq_StampAt(uint32_t frames, uint16_t ticks){
+	float elapsed = (float)(frames - acqAnchorFrames) + ticks/(float)(SERVO_FRAME_US*SERVO_TICKS_PER_US);
 	
-	// Actualizar datos de fechas.
-	readTimeDate();
+	return acqAnchorMs + (uint32_t)(elapsed*acqFrameMs);
+}
+
+// Ajusta la tasa con una lectura del DS3231 hecha en frames y ticks. El segundo epoch empez
+// en el ltimo segundo antes de la lectura: si la hora de las muestras cae fuera de l se
+// corrige la tasa para alcanzarlo en el siguiente CLOCK_SYNC_S. La tasa de fondo sale de los
+// cuadros contra los segundos desde el origen. Un desfase mayor es una hora puesta: nuevo origen.
+void Acq_Discipline(uint32_t epoch, uint32_t frames, uint16_t ticks){
+	uint32_t stamp = Acq_StampAt(frames, ticks);
+	int32_t early = stamp - (acqOriginMs + (epoch - acqOriginEpoch)*1000);
 	
-	// Fecha.
-	LCD_wr_instruction(LCD_Cmd_Clear);			
-	LCD_wr_instruction(0b10000000);			
-	printValues8BitsTimeFormat(date);
-	LCD_wr_string("/");
-	printValues8BitsTimeFormat(month);
-	LCD_wr_string("/");
-	printValues8BitsTimeFormat(year);
-		
-	// Hora.
-	LCD_wr_instruction(0b10001001);			
-	printValues8BitsTimeFormat(hours);
-	LCD_wr_string(":");
-	printValues8BitsTimeFormat(minutes);
-		
-	// Instrucciones.
-	LCD_wr_instruction(0b11000000);			
-	LCD_wr_string("Agen  Peso  Dar");
+	if(!acqSynced || early < -ACQ_STEP_MS || early >= 1000 + ACQ_STEP_MS){
+		acqOriginEpoch = epoch;
+		acqOriginMs = stamp - 500;				// A mitad del segundo que no se ve.
+		acqOriginFrames = frames;
+		acqSynced = 1;
+		return;
+	}
 	
+	float rate = acqFrameMs;
+	if(epoch - acqOriginEpoch >= ACQ_BASELINE_S){
+		rate = (epoch - acqOriginEpoch)*1000.0f / (frames - acqOriginFrames);
+	}
+	int32_t error = early < 0 ? early : early >= 1000 ? early - 999 : 0;
+	float slew = 1 - error/(CLOCK_SYNC_S*1000.0f);
+	if(slew > 1 + ACQ_SLEW_MAX) slew = 1 + ACQ_SLEW_MAX;
+	if(slew < 1 - ACQ_SLEW_MAX) slew = 1 - ACQ_SLEW_MAX;
+	
+	acqAnchorMs = Acq_StampAt(frames, 0);
+	acqAnchorFrames = frames;
+	acqFrameMs = rate*slew;
+}
 
-    // Checar botones.
-    while(1){
-		// Actualizar datos de la pantalla main.
-		updateTimeDate();
-		checkAlarms();
+// Lee las conversiones listas de las tolvas de mask (nunca espera al Hx711), las pasa por el
+// filtro y publica las vlidas con su hora. Con la ventana del filtro vaca no se publica
+// hasta llenarla, para que una muestra mala al inicio de la sesin ya quede fuera de la mediana.
+// Con BOWL las tolvas de acqBowl alternan turnos con el plato, cada entrada con su filtro.
+void Acq_Service(uint8_t mask){
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(!(mask & (1<<ch)) || !Hx711_Ready(ch)){
+			continue;
+		}
+		PROFILE_BEGIN(PROF_ACQ);
+		dispenserChannel *c = &channels[ch];
+		hxFilter *f = &c->filter;
+		long spike = HX_SPIKE_COUNTS >> HX_GAIN_SHIFT(c->gain);
+		uint8_t tag = ch | (Servo_Busy(ch) ? ACQ_SERVO : 0);
+		uint32_t stamp = Acq_Stamp();
+	#if BOWL
+		// Los pulsos de esta lectura eligen la entrada de la siguiente: se cambia al acabar el
+		// turno o, sin plato pedido, para volver a la tolva.
+		bowlScale *b = &c->bowl;
+		uint8_t input = b->next, discard = b->settle != 0;
+		if(discard){
+			b->settle--;
+		}
+		else if(b->turn){
+			b->turn--;
+		}
+		if(acqBowl & (1<<ch) ? !discard && b->turn == 0 : input){
+			b->next = !input;
+			b->settle = BOWL_SETTLE;
+			b->turn = BOWL_TURN;
+		}
+		unsigned long raw = Hx711_ReadCount(ch);
+		wdt_reset();
+		if(discard){
+			PROFILE_END(PROF_ACQ);
+			continue;
+		}
+		if(input){
+			f = &b->filter;
+			spike = HX_SPIKE_COUNTS >> HX_GAIN_SHIFT(HX_GAIN_B32);
+			tag = ch | ACQ_BOWL;
+		}
+		long count = Hx711_Filter(f, raw, spike);
+	#else
+		long count = Hx711_Filter(f, Hx711_ReadCount(ch), spike);
+		wdt_reset();							// Cada conversin completa demuestra que el Hx711 responde.
+	#endif
+		
+		if(f->fill < HX_MEDIAN_SIZE && ++f->warm <= 2*HX_MEDIAN_SIZE){
+			PROFILE_END(PROF_ACQ);
+			continue;
+		}
+		f->warm = 0;
+		acqSample *sample = &acqRing[acqHead & (ACQ_RING-1)];
+		sample->stamp = stamp;
+		sample->count = count;
+		sample->tag = tag;
+		acqHead++;
+		PROFILE_END(PROF_ACQ);
+	}
+}
+
+// Un lector nuevo empieza con la siguiente muestra que se publique.
+void Acq_Open(acqReader *reader){
+	reader->next = acqHead;
+	reader->lost = 0;
+}
+
+uint8_t Acq_Next(acqReader *reader, acqSample *sample){
+	uint8_t behind = acqHead - reader->next;
 	
-        // Botones.
-        if(cero_en_bit(&PINB, 0)){
-            // Traba.
-            _delay_ms(50);
-            while(cero_en_bit(&PINB, 0));
-            _delay_ms(50);
+	if(behind == 0){
+		return 0;
+	}
+	if(behind > ACQ_RING){
+		behind -= ACQ_RING;
+		reader->lost = reader->lost > 255 - behind ? 255 : reader->lost + behind;
+		reader->next = acqHead - ACQ_RING;
+	}
+	*sample = acqRing[reader->next++ & (ACQ_RING-1)];
+	return 1;
+}
 
-            showAgendOptions();
-        }
-		else if(cero_en_bit(&PINB, 1)){
-			// Traba.
-			_delay_ms(50);
-			while(cero_en_bit(&PINB, 1));
-			_delay_ms(50);
+void Acq_WindowStart(acqWindow *window, uint8_t mask, uint8_t times){
+	Acq_Open(&window->reader);
+	window->mask = mask;
+	window->times = times;
+	window->input = 0;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		window->taken[ch] = 0;
+		window->sum[ch] = 0;
+	}
+}
 
-			showWeightScreen();
+// Regresa las tolvas que completaron su ventana; la siguiente empieza sola.
+uint8_t Acq_WindowPoll(acqWindow *window){
+	acqSample sample;
+	uint8_t done = 0;
+	
+	Acq_Service(window->mask);
+	while(Acq_Next(&window->reader, &sample)){
+		uint8_t ch = sample.tag & ACQ_CHANNEL;
+		if(!(window->mask & (1<<ch)) || (sample.tag & ACQ_BOWL) != window->input){
+			continue;
 		}
-        else if(cero_en_bit(&PINB, 2)){
-            // Traba.
-            _delay_ms(50);
-            while(cero_en_bit(&PINB, 2));
-            _delay_ms(50);
-
-            showGiveFoodScreen();
-        }
-    }
+		window->sum[ch] += sample.count;
+		if(++window->taken[ch] == window->times){
+			window->count[ch] = window->sum[ch]/window->times;
+			window->stamp[ch] = sample.stamp;
+			window->sum[ch] = 0;
+			window->taken[ch] = 0;
+			done |= 1<<ch;
+		}
+	}
+	return done;
 }
 
-void showWeightScreen(){
-	checkAlarms();
+
+#if BOWL
+// Funciones del plato.
+// Empieza a alternar los Hx711 de mask con el plato y lo pesa con la compuerta cerrada: lo que
+// ya haba en el plato queda en la tara.
+void Bowl_Start(uint8_t mask){
+	acqWindow window;
 	
-	LCD_wr_instruction(LCD_Cmd_Clear);		
-	LCD_wr_instruction(0b10000000);		
-	LCD_wr_string("   Peso:");
-	float pastFoodAmount  = get_units(10);
-	LCD_wr_instruction(0b10001001);
-	printValues(pastFoodAmount);
+	acqBowl = mask;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		hxFilter *f = &channels[ch].bowl.filter;
+		f->fill = f->warm = 0;
+		f->saturated = f->spikes = 0;
+		channels[ch].bowl.grams = 0;
+	}
 	
-	// Instrucciones.
-	LCD_wr_instruction(0b11000000);
-	LCD_wr_string("Agen  Hora  Dar");
+	Bowl_Weigh(mask, &window);
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			channels[ch].bowl.tare = window.count[ch];
+		}
+	}
+}
+
+// Promedio de BOWL_WEIGH_SAMPLES muestras del plato de cada tolva de mask, en window->count.
+void Bowl_Weigh(uint8_t mask, acqWindow *window){
+	uint8_t done = 0;
 	
+	Acq_WindowStart(window, mask, BOWL_WEIGH_SAMPLES);
+	window->input = ACQ_BOWL;
+	while(done != mask){
+		uint8_t fresh = Acq_WindowPoll(window);
+		window->mask &= ~fresh;
+		done |= fresh;
+	}
+}
 
-	// Checar botones.
-	while(1){
-		// Actualizar datos del peso.
-		currentFoodAmount = get_units(5);
-		checkAlarms();
-		
-		if((int)currentFoodAmount != (int)pastFoodAmount){
-			pastFoodAmount = currentFoodAmount;
-			LCD_wr_instruction(0b10001001);
-			LCD_wr_string("            ");
-			LCD_wr_instruction(0b10001001);
-			printValues(pastFoodAmount);
+// Regresa los Hx711 a la tolva y espera a que se asienten en el canal A: las lecturas
+// directas que siguen (Hx711_SetRate) ya no mandan los 26 pulsos.
+void Bowl_Stop(){
+	uint8_t pending;
+	
+	acqBowl = 0;
+	do{
+		pending = 0;
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(channels[ch].bowl.next || channels[ch].bowl.settle){
+				pending |= 1<<ch;
+			}
 		}
-		
-		// Botones.
-		if(cero_en_bit(&PINB, 0)){
-			// Traba.
-			_delay_ms(50);
-			while(cero_en_bit(&PINB, 0));
-			_delay_ms(50);
+		Acq_Service(pending);
+	}while(pending);
+}
 
-			showAgendOptions();
-		}
-		else if(cero_en_bit(&PINB, 1)){
-			// Traba.
-			_delay_ms(50);
-			while(cero_en_bit(&PINB, 1));
-			_delay_ms(50);
+float Bowl_Grams(uint8_t channel, float count){
+	return (count - channels[channel].bowl.tare) / (channels[channel].scale * HX_GAIN_FACTOR(HX_GAIN_B32));
+}
+#endif
 
-			showMainScreen();
-		}
-		else if(cero_en_bit(&PINB, 2)){
-			// Traba.
-			_delay_ms(50);
-			while(cero_en_bit(&PINB, 2));
-			_delay_ms(50);
 
-			showGiveFoodScreen();
-		}
+// Funciones del servo.
+void Servo_Init(){
+	// CTC con TOP en ICR1 (modo 12). La captura marca cada cuadro y sube el pulso del
+	// primer servo; cada comparacin A baja un pulso y sube el del siguiente canal, as
+	// los servos comparten el Timer1 en cualquier pin.
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		CH_DISPATCH(ch, SERVO_LOW);
+		channels[ch].step = motionClose;
+		channels[ch].framesLeft = 0;
+		channels[ch].pulseTicks = SERVO_CLOSED_US*SERVO_TICKS_PER_US;
 	}
+	ICR1 = SERVO_FRAME_US*SERVO_TICKS_PER_US - 1;
+	OCR1A = SERVO_PULSE_OFF;
+	TCNT1 = 0;
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM13)|(1<<WGM12)|(TIMER1_PRESCALER == 1 ? (1<<CS10) : (1<<CS11));
+	TIMSK |= (1<<TICIE1)|(1<<OCIE1A);
 }
 
-void showAgendOptions(){
-	checkAlarms();
+void Servo_Play(uint8_t channel, uint8_t profile){
+	const servoStep *step = pgm_read_ptr(&motionProfiles[profile]);
+	dispenserChannel *c = &channels[channel];
 	
-	// Fecha.
-	LCD_wr_instruction(LCD_Cmd_Clear);		
-	LCD_wr_instruction(0b10000000);		
-	LCD_wr_string("  --Opciones--  ");
+	TRACE_EVENT(TR_SERVO, channel, &profile, 1);
+	cli();
+	c->step = step;
+	c->framesLeft = pgm_read_byte(&step->frames);
+	c->pulseTicks = pgm_read_word(&step->pulseUs)*SERVO_TICKS_PER_US;
+	sei();
+}
 
-    LCD_wr_instruction(0b11000000);		
-	LCD_wr_string("Ret   Del   Add");
+uint8_t Servo_Busy(uint8_t channel){
+	return channels[channel].framesLeft != 0;
+}
 
-    // Checar botones.
-    while(1){
-		checkAlarms();
-		
-        if(cero_en_bit(&PINB, 0)){
-            // Traba.
-            _delay_ms(50);
-            while(cero_en_bit(&PINB, 0));
-            _delay_ms(50);
+// Cuadros completos del Timer1 desde que arranc (SERVO_FRAME_US cada uno).
+uint32_t Timer1_Frames(){
+	uint32_t frames;
+	
+	cli();
+	frames = timer1Frames;
+	sei();
+	
+	return frames;
+}
 
-            showMainScreen();
-        }
-        else if(cero_en_bit(&PINB, 1)){
-            // Traba.
-            _delay_ms(50);
-            while(cero_en_bit(&PINB, 1));
-            _delay_ms(50);
+// Ciclos de CPU desde que arranc el Timer1 (da la vuelta cada ~17 minutos a 4 MHz).
+uint32_t Timer1_Cycles(){
+	uint16_t ticks;
+	uint32_t frames = Timer1_Read(&ticks);
+	
+	return (frames*(SERVO_FRAME_US*SERVO_TICKS_PER_US) + ticks)*TIMER1_PRESCALER;
+}
 
-            showDeleteAlarms();
-        }
-        else if(cero_en_bit(&PINB, 2)){
-            // Traba.
-            _delay_ms(50);
-            while(cero_en_bit(&PINB, 2));
-            _delay_ms(50);
+// Cuadros completos y ticks del cuadro en curso, ledos juntos.
+uint32_t Timer1_Read(uint16_t *ticks){
+	uint32_t frames;
+	
+	cli();
+	frames = timer1Frames;
+	*ticks = TCNT1;
+	if((TIFR & (1<<ICF1)) && *ticks < SERVO_FRAME_US*SERVO_TICKS_PER_US/2){
+		frames++;								// Lleg a TOP y la interrupcin an no se atiende.
+	}
+	sei();
+	
+	return frames;
+}
 
-            showAddAlarms();
-        }
-    }
+// Inicio de cada cuadro: sube el pulso del primer servo y avanza los perfiles de movimiento
+// sin bloquear al programa. Un cambio de posicin se ve a partir del pulso siguiente.
+ISR(TIMER1_CAPT_vect){
+	SERVO_HIGH(0);
+	OCR1A = TCNT1 + channels[0].pulseTicks;
+	servoSlot = 0;
+	timer1Frames++;
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		dispenserChannel *c = &channels[ch];
+		if(c->framesLeft == 0 || --c->framesLeft != 0){
+			continue;
+		}
+		
+		const servoStep *next = c->step + 1;
+		uint16_t pulseUs = pgm_read_word(&next->pulseUs);
+		if(pulseUs == 0){
+			continue;							// Fin del perfil, se queda en la ltima posicin.
+		}
+		c->step = next;
+		c->framesLeft = pgm_read_byte(&next->frames);
+		c->pulseTicks = pulseUs*SERVO_TICKS_PER_US;
+	}
 }
 
-void showDeleteAlarms(){
-	checkAlarms();
+// Fin del pulso de un servo: bajarlo y subir el del siguiente. El siguiente corte se cuenta
+// desde esta comparacin y no desde TCNT1, as la latencia no alarga los pulsos.
+ISR(TIMER1_COMPA_vect){
+	uint8_t slot = servoSlot;
+	if(slot >= CHANNELS){
+		return;
+	}
 	
-    if(searchAlarms() == 0){
-        // Error.
-        LCD_wr_instruction(LCD_Cmd_Clear);		
-        LCD_wr_instruction(0b10000000);			
-        LCD_wr_string("  ==Error==  ");
-        LCD_wr_instruction(0b11000000);				
-        LCD_wr_string("No hay alarmas");
+	CH_DISPATCH(slot, SERVO_LOW);
+	if(++slot < CHANNELS){
+		CH_DISPATCH(slot, SERVO_HIGH);
+		OCR1A += channels[slot].pulseTicks;
+	}
+	else{
+		OCR1A = SERVO_PULSE_OFF;
+	}
+	servoSlot = slot;
+}
 
-        _delay_ms(1000);
 
-        showAgendOptions();
-    }
+// Funciones I2C.
+#if BOARD != BOARD_HOST
+void I2C_Init()
+{
+	// Inicializar reloj de I2C (valores calculados y validados en compilacin).
+	TWSR = I2C_TWPS;
+	TWBR = I2C_TWBR;
+}
 
-    // Mostrar mensajes estticos.
-    LCD_wr_instruction(LCD_Cmd_Clear);			
-    LCD_wr_instruction(0b10000000);				
-    LCD_wr_string("Alarma: ");
-    LCD_wr_instruction(0b11000000);
-    LCD_wr_string("Ret  Del  Next");
+void I2C_Start()
+{
+	NET_DETACH();
+	
+	// Borrar el indicador de interrupcin TWI, poner la condicin de inicio en SDA, habilitar TWI.
+	TWCR = (1<<TWINT)|(1<<TWSTA)|(1<<TWEN);
+	
+	while(!(TWCR & (1<<TWINT)));
+}
 
-    // Variables.
-    uint8_t hoursRegister = 0, minutesRegister = 0;
+uint8_t I2C_Read_Acknoledgement() {
+	TWCR = (1<<TWEN)|(1<<TWINT)|(1<<TWEA);
+	while (!(TWCR & (1<<TWINT)));
+	
+	return TWDR;
+}
 
-    // Para cada alarma.
-    for(int i=0;i<ALARM_BITS;i+=2){
-        hoursRegister = EEPROM_read(i);
-        if(hoursRegister != 255){
-            minutesRegister = EEPROM_read(i+1);
+uint8_t I2C_Read_Not_Acknoledgement() {
+	TWCR = (1<<TWINT)|(1<<TWEN);
+	while (!(TWCR & (1<<TWINT)));
+	
+	return TWDR;
+}
 
-            LCD_wr_instruction(0b10001000);				
-            printValues8BitsTimeFormat(hoursRegister);
-            LCD_wr_string(":");
-            printValues8BitsTimeFormat(minutesRegister);
-            
+// Regresa 1 si el esclavo reconoci el byte (direccin o dato).
+uint8_t I2C_Write(uint8_t data)
+{
+	TWDR = data;    						// Aadir los datos a TWDR.
+	TWCR = (1<<TWINT)|(1<<TWEN);    		// Borrar indicador de interrupcin TWI, habilitar TWI.
+	while (!(TWCR & (1<<TWINT)));			// Esperar hasta que se transmita el byte TWDR completo
+	
+	uint8_t status = TWSR & I2C_STATUS_MASK;
+	return status == I2C_SLA_W_ACK || status == I2C_DATA_ACK || status == I2C_SLA_R_ACK;
+}
 
-            // Checar botones.
-            while(1){
-				checkAlarms();
-				
-                // Return.
-                if(cero_en_bit(&PINB, 0)){
-                    // Traba.
-                    _delay_ms(50);
-                    while(cero_en_bit(&PINB, 0));
-                    _delay_ms(50);
+void I2C_Stop() {
+	// Borrar el indicador de interrupcin TWI, poner la condicin de parada en SDA, habilitar TWI.
+	TWCR= (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
+	while(TWCR & (1<<TWSTO));  				// El hardware baja TWSTO cuando la condicin de parada sale al bus.
+	NET_ATTACH();
+}
+#endif
 
-                    showAgendOptions();
-                }
-                // Delete.
-                else if(cero_en_bit(&PINB, 1)){
-                    // Traba.
-                    _delay_ms(50);
-                    while(cero_en_bit(&PINB, 1));
-                    _delay_ms(50);
 
-                    EEPROM_write(i, 255);
-                    EEPROM_write(i+1, 255);
+// Funciones de la EEPROM externa. Se busca en el primer uso, que puede ser la reanudacin en
+// caliente antes de que el arranque inicialice el bus.
+void AT24_Init(){
+	uint16_t head = EEPROM_read(EE_AT24_HEAD) | (EEPROM_read(EE_AT24_HEAD+1) << 8);
+	
+	I2C_Init();
+	at24Head = head < AT24_SIZE ? head - head % MEAL_RECORD : 0;
+	at24Fill = 0;
+	at24State = AT24_PRESENT;
+	if(AT24_Select(0)){
+		I2C_Stop();
+	}
+}
 
-                    // Error.
-                    LCD_wr_instruction(LCD_Cmd_Clear);		
-                    LCD_wr_instruction(0b10000000);			
-                    LCD_wr_string("   ==Exito==   ");
-                    LCD_wr_instruction(0b11000000);			
-                    LCD_wr_string("   Bye alarma  ");
+// Mientras graba una pgina (hasta 10 ms) no reconoce su direccin: en vez de esperar el peor
+// caso se sondea hasta que responde. Deja el bus tomado con la posicin ya enviada.
+uint8_t AT24_Select(uint16_t address){
+	for(uint8_t i=0;i<AT24_POLL_MAX;i++){
+		I2C_Start();
+		if(I2C_Write(AT24_ADDRESS)){
+			I2C_Write(address >> 8);
+			I2C_Write(address & 0xFF);
+			return 1;
+		}
+		I2C_Stop();
+	}
+	at24State = AT24_ABSENT;
+	
+	return 0;
+}
 
-                    showDeleteAlarms();
-                }
-                // Next.
-                else if(cero_en_bit(&PINB, 2)){
-                    // Traba.
-                    _delay_ms(50);
-                    while(cero_en_bit(&PINB, 2));
-                    _delay_ms(50);
+// Junta los bytes en la pgina en curso y la escribe al llenarse.
+void AT24_Append(const void *data, uint8_t len){
+	const uint8_t *bytes = data;
+	
+	while(len--){
+		at24Page[at24Fill++] = *bytes++;
+		if(((at24Head + at24Fill) & (AT24_PAGE - 1)) == 0){
+			AT24_Flush();
+		}
+	}
+}
 
-                    if(i+2 >= ALARM_BITS){
-                        i = -2;
-                    }
-					
-					break;
-                }
-            }
-        }
-    }
+// Una sola escritura para lo juntado (nunca cruza el fin de la pgina) y la cabeza nueva en
+// la EEPROM interna. La grabacin corre sola: el siguiente AT24_Select la espera.
+void AT24_Flush(){
+	if(!at24Fill || at24State != AT24_PRESENT){
+		return;
+	}
+	if(AT24_Select(at24Head)){
+		for(uint8_t i=0;i<at24Fill;i++){
+			I2C_Write(at24Page[i]);
+		}
+		I2C_Stop();
+		at24Pages++;
+	}
+	at24Head = (at24Head + at24Fill) & (AT24_SIZE - 1);
+	at24Fill = 0;
+	EEPROM_update(EE_AT24_HEAD, at24Head & 0xFF);
+	EEPROM_update(EE_AT24_HEAD+1, at24Head >> 8);
+}
+
+// Lectura secuencial: el AT24C32 avanza solo su posicin (y da la vuelta al final).
+uint8_t AT24_Read(uint16_t address, uint8_t *data, uint8_t len){
+	if(at24State == AT24_UNKNOWN){
+		AT24_Init();
+	}
+	if(!len || at24State != AT24_PRESENT || !AT24_Select(address)){
+		return 0;
+	}
+	I2C_Stop();
 	
-	showDeleteAlarms();
+	I2C_Start();
+	I2C_Write(AT24_ADDRESS | 1);
+	while(--len){
+		*data++ = I2C_Read_Acknoledgement();
+	}
+	*data = I2C_Read_Not_Acknoledgement();
+	I2C_Stop();
+	
+	return 1;
 }
 
-void showAddAlarms(){
-	checkAlarms();
+// Un registro por tolva al terminar una comida; dispenseFood escribe la pgina al final. En la
+// reanudacin en caliente el DS3231 todava no se ha ledo: se lee aqu.
+void MealLog_Record(uint8_t channel){
+	dispenserChannel *c = &channels[channel];
+	int delivered = c->startAmount - c->amount + 0.5f;
 	
-    if(searchAlarms() == ALARM_BITS/2){
-        // Error.
-        LCD_wr_instruction(LCD_Cmd_Clear);			
-        LCD_wr_instruction(0b10000000);		
-        LCD_wr_string("  ==Error==  ");
-        LCD_wr_instruction(0b11000000);			
-        LCD_wr_string(" Ya hay alarmas ");
-		_delay_ms(1000);
-
-        LCD_wr_instruction(0b11000000);			
-        LCD_wr_string(" Borre algunas ");
-		_delay_ms(1000);
-
-        showAgendOptions();
-    }
+	if(at24State == AT24_UNKNOWN){
+		AT24_Init();
+	}
+	if(at24State != AT24_PRESENT){
+		return;
+	}
+	if(!clockEpoch){
+		readTimeDate();
+	}
+	uint32_t now = Clock_Now();
+	uint8_t record[MEAL_RECORD] = {now & 0xFF, (now >> 8) & 0xFF, (now >> 16) & 0xFF, now >> 24,
+		channel << 4 | c->result, delivered & 0xFF, delivered >> 8, c->cycles};
+	AT24_Append(record, MEAL_RECORD);
+}
 
-    // Mostrar mensajes estticos.
-    LCD_wr_instruction(LCD_Cmd_Clear);			
-    LCD_wr_instruction(0b10000000);				
-    LCD_wr_string("Alarma: ");
-    LCD_wr_instruction(0b11000000);
-    LCD_wr_string("Ret  Add  Next");
 
-    // Variables.
-    volatile uint8_t hoursRegister = 0, hoursCont = 0, minutesCont = 0;
+// Funciones DS3231.
+uint8_t  BCD_To_DEC(uint8_t BCD_value)
+{
+	return (BCD_value >> 4) * 10 + (BCD_value & 0x0F);
+}
 
-    // Para cada alarma.
-    for(volatile int i=0, j=0;i<ALARM_BITS;i+=2){
-        hoursRegister = EEPROM_read(i);
-        if(hoursRegister == 255){
-            LCD_wr_instruction(0b10001000);				
-            printValues8BitsTimeFormat(hoursCont);
-            LCD_wr_string(":");
-            printValues8BitsTimeFormat(minutesCont);
-            
+uint8_t DEC_To_BCD (uint8_t decimal_value)
+{
+	return ((decimal_value / 10) << 4) + (decimal_value % 10);
+}
 
-            // Checar botones.
-            while(1){
-				checkAlarms();
-				
-                // Return.
-                if(cero_en_bit(&PINB, 0)){
-                    // Traba.
-                    _delay_ms(50);
-                    while(cero_en_bit(&PINB, 0));
-                    _delay_ms(50);
+// Ajusta el DS3231 en el segundo 0 del minuto.
+void SetTimeDate(uint8_t _minutes, uint8_t _hours, uint8_t _date, uint8_t _month, uint8_t _year){
+	Clock_Set(Clock_FromFields(_year, _month, _date, _hours, _minutes, 0));
+}
 
-                    showAgendOptions();
-                }
+// Ajusta el DS3231 a epoch (deja sus campos en los que se muestran). Un adelanto de menos de
+// un da (cambio de horario) no se salta las alarmas de en medio: alarmDue las toma como si
+// tocaran al terminar el salto.
+void Clock_Set(uint32_t epoch){
+	uint32_t before = Clock_Now();
+	
+	Clock_Split(epoch);
+	I2C_Start();
+	I2C_Write(0xD0);
+	I2C_Write(0);
+	I2C_Write(DEC_To_BCD(seconds)); 			// Segundos.
+	I2C_Write(DEC_To_BCD(minutes)); 			// Minutos.
+	I2C_Write(DEC_To_BCD(hours)); 				// Hora.
+	I2C_Write(1); 								// Ignorar da de la semana.
+	I2C_Write(DEC_To_BCD(date)); 				// Da.
+	I2C_Write(DEC_To_BCD(month));				// Mes.
+	I2C_Write(DEC_To_BCD(year)); 				// Ao.
+	I2C_Stop();
+	
+	readTimeDate();
+	if(clockEpoch > before && clockEpoch - before < SECONDS_PER_DAY){
+		clockSkipFrom = before;
+		clockSkipTo = clockEpoch;
+	}
+}
+
+// Lee el DS3231 de una rfaga (hora y temperatura) y sincroniza el reloj. Los campos son
+// locales: los que se muestran salen de Clock_Split.
+void readTimeDate(){
+	PROFILE_BEGIN(PROF_READ_TIME);
+	uint32_t busStart = Timer1_Cycles();
+	uint8_t seconds, minutes, hours, date, month, year;
+	uint16_t ticks;
+	uint32_t frames = Timer1_Read(&ticks);		// El DS3231 copia la hora al empezar la lectura.
+	
+	// Comenzar a leer.
+	I2C_Start();
+	I2C_Write(0xD0);
+	I2C_Write(0);
+	I2C_Stop();
+	
+	// Leer informacin.
+	I2C_Start();
+	I2C_Write(0xD1);
+	seconds = BCD_To_DEC(I2C_Read_Acknoledgement());
+	minutes = BCD_To_DEC(I2C_Read_Acknoledgement());
+	hours = BCD_To_DEC(I2C_Read_Acknoledgement());
+	I2C_Read_Acknoledgement();
+	date = BCD_To_DEC(I2C_Read_Acknoledgement());
+	month = BCD_To_DEC(I2C_Read_Acknoledgement());
+	year = BCD_To_DEC(I2C_Read_Acknoledgement());
+	
+	// Alarmas, control, estado y envejecimiento (0x07 a 0x10) pasan en la misma rfaga hasta
+	// la temperatura: 0x11 en grados con signo y 0x12 con los cuartos en los bits 7 y 6.
+	for(uint8_t reg=0x07;reg<0x11;reg++){
+		I2C_Read_Acknoledgement();
+	}
+	uint8_t tempHigh = I2C_Read_Acknoledgement();
+	uint8_t tempLow = I2C_Read_Not_Acknoledgement();
+	I2C_Stop();
+	i2cBusCycles = Timer1_Cycles() - busStart;
+	
+	rtcTemperature = (int16_t)(tempHigh << 8 | tempLow) >> 6;
+	clockEpoch = Clock_FromFields(year, month, date, hours, minutes, seconds);
+	clockSyncFrames = Timer1_Frames();
+	Acq_Discipline(clockEpoch, frames, ticks);
+	TRACE_EVENT(TR_RTC, 0, &clockEpoch, 4);
+	PROFILE_END(PROF_READ_TIME);
+}
+
+// Segundos de poca. Solo lee el DS3231 cada CLOCK_SYNC_S; entre lecturas suma los cuadros
+// del Timer1, as que comparar horas cuesta una resta de 32 bits.
+uint32_t Clock_Now(){
+	uint32_t elapsedMs = (Timer1_Frames() - clockSyncFrames) * (SERVO_FRAME_US/1000);
+	
+	if(elapsedMs >= CLOCK_SYNC_S*1000UL){
+		readTimeDate();
+		return clockEpoch;
+	}
+	return clockEpoch + elapsedMs/1000;
+}
+
+// Das acumulados antes de cada mes en un ao no bisiesto.
+const uint16_t monthStartDays[12] PROGMEM = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+uint32_t Clock_FromFields(uint8_t _year, uint8_t _month, uint8_t _date, uint8_t _hours, uint8_t _minutes, uint8_t _seconds){
+	if(_month < 1 || _month > 12){
+		_month = 1;								// DS3231 sin inicializar.
+	}
+	
+	// 2000 es bisiesto: antes del ao y hay (y+3)/4 bisiestos.
+	uint16_t days = (uint16_t)_year*365 + (_year + 3)/4 + pgm_read_word(&monthStartDays[_month-1]) + _date - 1;
+	if(_month > 2 && (_year & 3) == 0){
+		days++;
+	}
+	
+	return days*SECONDS_PER_DAY + _hours*3600UL + _minutes*60 + _seconds;
+}
+
+// Campos de fecha y hora de epoch, solo para mostrarlos.
+void Clock_Split(uint32_t epoch){
+	uint16_t days = epoch / SECONDS_PER_DAY;
+	uint32_t rest = epoch % SECONDS_PER_DAY;
+	
+	hours = rest / 3600;
+	minutes = rest / 60 % 60;
+	seconds = rest % 60;
+	
+	// Bloques de 4 aos que empiezan en bisiesto (366 + 3*365 das).
+	uint8_t leap = 0;
+	year = days / 1461 * 4;
+	days %= 1461;
+	if(days < 366){
+		leap = 1;
+	}
+	else{
+		days -= 366;
+		year += 1 + days/365;
+		days %= 365;
+	}
+	
+	for(month=12;month>1;month--){
+		if(days >= pgm_read_word(&monthStartDays[month-1]) + (leap && month > 2)){
+			break;
+		}
+	}
+	date = days - pgm_read_word(&monthStartDays[month-1]) - (leap && month > 2) + 1;
+}
+
+// Pasa el minuto actual a los campos de la pantalla principal.
+void Clock_Show(){
+	shownMinute = Clock_Now() / 60;
+	Clock_Split(shownMinute * 60);
+}
+
+void updateTimeDate(){
+	uint32_t minute = Clock_Now() / 60;
+	
+	if(minute == shownMinute){
+		return;
+	}
+	uint8_t newDay = minute/1440 != shownMinute/1440;
+	shownMinute = minute;
+	Clock_Split(minute * 60);
+	
+	if(newDay){
+		LCD_draw(layoutMain, FMT_DATE);
+	}
+	LCD_draw(layoutMain, FMT_TIME);
+}
+
+
+// Pantallas.
+uint8_t showMainScreen(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+	// Actualizar datos de fechas.
+	Clock_Show();
+	
+	// Fecha, hora e instrucciones (salvo que el arranque ya las haya pintado).
+	if(!mainScreenDrawn){
+		LCD_draw_screen(layoutMain);
+	}
+	mainScreenDrawn = 0;
+	
+
+    // Checar botones.
+    while(1){
+		// Actualizar datos de la pantalla main.
+		updateTimeDate();
+		next = serviceMainLoop();
+		if(next != SCREEN_NONE){
+			return next;
+		}
+		if(shownDaysLeft != histDaysLeft){
+			shownDaysLeft = histDaysLeft;
+			LCD_draw(layoutMain, FMT_REFILL);
+		}
+	
+        // Botones.
+        if(BTN_DOWN(BTN_LEFT)){
+            // Traba.
+            _delay_ms(50);
+            while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+            _delay_ms(50);
+
+            return SCREEN_AGEND;
+        }
+		else if(BTN_DOWN(BTN_MIDDLE)){
+			// Traba. Mantenerlo DIAG_HOLD_MS abre el diagnstico del arranque.
+			uint16_t heldMs = 50;
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_MIDDLE)){
+				wdt_reset();
+				_delay_ms(10);
+				heldMs += 10;
+			}
+			_delay_ms(50);
+
+			return heldMs >= DIAG_HOLD_MS ? SCREEN_BOOT : SCREEN_WEIGHT;
+		}
+        else if(BTN_DOWN(BTN_RIGHT)){
+            // Traba.
+            _delay_ms(50);
+            while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+            _delay_ms(50);
+
+            return SCREEN_GIVE;
+        }
+    }
+}
+
+uint8_t showWeightScreen(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+	Hx711_Update(ALL_CHANNELS, Hx711_Samples(HX_SCREEN_WINDOW_MS));
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		shownWeights[ch] = channels[ch].amount;
+	}
+	LCD_draw_screen(layoutWeight);
+	
+	acqWindow window;
+	Acq_WindowStart(&window, ALL_CHANNELS, Hx711_Samples(HX_REFRESH_WINDOW_MS));
+
+	// Checar botones.
+	while(1){
+		// Actualizar datos del peso con lo que ya lleg; los botones no esperan a la ventana.
+		uint8_t fresh = Acq_WindowPoll(&window);
+		next = serviceMainLoop();
+		if(next != SCREEN_NONE){
+			return next;
+		}
+		
+		uint8_t changed = 0;
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(!(fresh & (1<<ch))){
+				continue;
+			}
+			channels[ch].amount = Hx711_Grams(ch, window.count[ch]);
+			channels[ch].amountStamp = window.stamp[ch];
+			if((int)channels[ch].amount != shownWeights[ch]){
+				shownWeights[ch] = channels[ch].amount;
+				changed = 1;
+			}
+		}
+		if(changed){
+			LCD_draw(layoutWeight, FMT_WEIGHT);
+		}
+		
+		// Botones.
+		if(BTN_DOWN(BTN_LEFT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+			_delay_ms(50);
+
+			return SCREEN_AGEND;
+		}
+		else if(BTN_DOWN(BTN_MIDDLE)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
+			_delay_ms(50);
+
+			return SCREEN_MAIN;
+		}
+		else if(BTN_DOWN(BTN_RIGHT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+			_delay_ms(50);
+
+			return SCREEN_GIVE;
+		}
+	}
+}
+
+uint8_t showAgendOptions(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+	LCD_draw_screen(layoutOptions);
+
+    // Checar botones.
+    while(1){
+		next = serviceMainLoop();
+		if(next != SCREEN_NONE){
+			return next;
+		}
+		
+        if(BTN_DOWN(BTN_LEFT)){
+            // Traba.
+            _delay_ms(50);
+            while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+            _delay_ms(50);
+
+            return SCREEN_MAIN;
+        }
+        else if(BTN_DOWN(BTN_MIDDLE)){
+            // Traba.
+            _delay_ms(50);
+            while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
+            _delay_ms(50);
+
+            return SCREEN_DELETE;
+        }
+        else if(BTN_DOWN(BTN_RIGHT)){
+            // Traba.
+            _delay_ms(50);
+            while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+            _delay_ms(50);
+
+            return SCREEN_ADD;
+        }
+    }
+}
+
+uint8_t showDeleteAlarms(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+    if(searchAlarms() == 0){
+        // Error.
+        LCD_draw_screen(layoutNoAlarms);
+
+        messageDelay();
+
+        return SCREEN_AGEND;
+    }
+
+    // Mostrar mensajes estticos.
+    LCD_draw_screen(layoutDeleteAlarm);
+
+    // Variables.
+    uint8_t hoursRegister = 0, minutesRegister = 0;
+
+    // Para cada alarma.
+    for(int i=0;i<ALARM_BITS;i+=2){
+        hoursRegister = EEPROM_read(i);
+        if(hoursRegister != 255){
+            minutesRegister = EEPROM_read(i+1);
+
+            shownHours = hoursRegister;
+            shownMinutes = minutesRegister;
+            shownTarget = alarmTarget(i);
+            LCD_draw(layoutDeleteAlarm, FMT_ALARM);
+            LCD_draw(layoutDeleteAlarm, FMT_TARGET);
+            
+
+            // Checar botones.
+            while(1){
+				next = serviceMainLoop();
+				if(next != SCREEN_NONE){
+					return next;
+				}
+				
+                // Return.
+                if(BTN_DOWN(BTN_LEFT)){
+                    // Traba.
+                    _delay_ms(50);
+                    while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+                    _delay_ms(50);
+
+                    return SCREEN_AGEND;
+                }
+                // Delete.
+                else if(BTN_DOWN(BTN_MIDDLE)){
+                    // Traba.
+                    _delay_ms(50);
+                    while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
+                    _delay_ms(50);
+
+                    EEPROM_write(i, 255);
+                    EEPROM_write(i+1, 255);
+                    EEPROM_write(EE_ALARM_CHANNELS + i/2, 255);
+
+                    // xito.
+                    LCD_draw_screen(layoutAlarmDeleted);
+
+                    return SCREEN_DELETE;
+                }
+                // Next.
+                else if(BTN_DOWN(BTN_RIGHT)){
+                    // Traba.
+                    _delay_ms(50);
+                    while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+                    _delay_ms(50);
+
+                    if(i+2 >= ALARM_BITS){
+                        i = -2;
+                    }
+					
+					break;
+                }
+            }
+        }
+    }
+	
+	return SCREEN_DELETE;
+}
+
+uint8_t showAddAlarms(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+    if(searchAlarms() == ALARM_BITS/2){
+        // Error.
+        LCD_draw_screen(layoutAlarmsFull);
+		messageDelay();
+
+        LCD_draw(layoutDeleteSome, FMT_ALL);
+		messageDelay();
+
+        return SCREEN_AGEND;
+    }
+
+    // Mostrar mensajes estticos.
+    shownTarget = TARGET_ALL;
+    LCD_draw_screen(layoutAddAlarm);
+
+    // Variables.
+    volatile uint8_t hoursRegister = 0, hoursCont = 0, minutesCont = 0;
+
+    // Para cada alarma.
+    for(volatile int i=0, j=0;i<ALARM_BITS;i+=2){
+        hoursRegister = EEPROM_read(i);
+        if(hoursRegister == 255){
+            shownHours = hoursCont;
+            shownMinutes = minutesCont;
+            LCD_draw(layoutAddAlarm, FMT_ALARM);
+            
+
+            // Checar botones.
+            while(1){
+				next = serviceMainLoop();
+				if(next != SCREEN_NONE){
+					return next;
+				}
+				
+                // Return.
+                if(BTN_DOWN(BTN_LEFT)){
+                    // Traba.
+                    _delay_ms(50);
+                    while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+                    _delay_ms(50);
+
+                    return SCREEN_AGEND;
+                }
                 // Add.
-                else if(cero_en_bit(&PINB, 1)){
+                else if(BTN_DOWN(BTN_MIDDLE)){
                     // Traba.
                     _delay_ms(50);
-                    while(cero_en_bit(&PINB, 1));
+                    while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
                     _delay_ms(50);
 
 					if(j==0){
@@ -771,26 +2984,37 @@ void showAddAlarms(){
 						break;
 					}
 					else{
-						EEPROM_write(i, hoursCont);
+					#if CHANNELS > 1
+						// ltimo paso: a qu tolva.
+						next = chooseTarget(layoutAddAlarm, SCREEN_AGEND);
+						if(next != SCREEN_NONE){
+							return next;
+						}
+					#endif
+						// Una hora que ya pas hoy cuenta como atendida: toca hasta maana. El da
+						// atendido y la mscara van antes que la hora, que hace vlida la ranura
+						// (mismo orden que Config_Commit): un reinicio a la mitad no deja una alarma
+						// viva con el da atendido de la que estaba antes.
+						uint16_t day = alarmOccurrenceAt(hoursCont, minutesCont, Clock_Now()) / SECONDS_PER_DAY;
+						EEPROM_write(EE_ALARM_FIRED + i, day & 0xFF);
+						EEPROM_write(EE_ALARM_FIRED + i + 1, day >> 8);
+						EEPROM_write(EE_ALARM_CHANNELS + i/2, shownTarget == TARGET_ALL ? 255 : TARGET_MASK(shownTarget));
 						EEPROM_write(i+1, minutesCont);
+						EEPROM_write(i, hoursCont);
 
-						// Error.
-						LCD_wr_instruction(LCD_Cmd_Clear);	
-						LCD_wr_instruction(0b10000000);				
-						LCD_wr_string("   ==Exito==   ");
-						LCD_wr_instruction(0b11000000);			
-						LCD_wr_string("Nueva alarma :)");
+						// xito.
+						LCD_draw_screen(layoutAlarmAdded);
 						
-						_delay_ms(1000);
+						messageDelay();
 
-						showAddAlarms();
+						return SCREEN_ADD;
 					}
                 }
                 // Next.
-                else if(cero_en_bit(&PINB, 2)){
+                else if(BTN_DOWN(BTN_RIGHT)){
                     // Traba.
                     _delay_ms(50);
-                    while(cero_en_bit(&PINB, 2));
+                    while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
                     _delay_ms(50);
 
                     if(j==0){
@@ -816,9 +3040,12 @@ void showAddAlarms(){
             }
         }
     }
+	
+	return SCREEN_AGEND;
 }
 
 uint8_t searchAlarms(){
+    PROFILE_BEGIN(PROF_SEARCH_ALARMS);
     uint8_t validRegisterCounter = 0, hoursRegister = 0;
 
     for(uint8_t i=0;i<ALARM_BITS;i+=2){
@@ -828,58 +3055,163 @@ uint8_t searchAlarms(){
         }
     }
 
-    return validRegisterCounter;
+    PROFILE_RETURN(PROF_SEARCH_ALARMS, validRegisterCounter);
 }
 
-void showGiveFoodScreen(){
-	checkAlarms();
+// Tolva de la alarma guardada en dir: TARGET_ALL o el nmero de tolva. Una mscara que
+// esta versin no puede atender (ms tolvas de las que tiene) cuenta como todas.
+uint8_t alarmTarget(uint8_t dir){
+	uint8_t mask = EEPROM_read(EE_ALARM_CHANNELS + dir/2) & ALL_CHANNELS;
 	
-	// Mostrar mensajes estticos.
-	LCD_wr_instruction(LCD_Cmd_Clear);		
-	LCD_wr_instruction(0b11000000);			
-	LCD_wr_string("Ret    Dar    +");
-	LCD_wr_instruction(0b10001001);
-	LCD_wr_string("g");
+	if(mask != ALL_CHANNELS){
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(mask == (1<<ch)){
+				return ch+1;
+			}
+		}
+	}
 	
+	return TARGET_ALL;
+}
+
+// Elige con "+" la tolva (o todas) en el campo FMT_TARGET de layout y la deja en shownTarget.
+// Regresa SCREEN_NONE al confirmar, back con Ret o la pantalla de una alarma que se dispar.
+uint8_t chooseTarget(const screenItem *layout, uint8_t back){
+	LCD_draw(layout, FMT_TARGET);
 	
-	for(int i=10;i<maxFoodAmountToGive;i+=10){
-		if(i < 100){
-			LCD_wr_instruction(0b10000110);
-			LCD_wr_string(" ");
-		}
-		else if(i >= 100){
-			LCD_wr_instruction(0b10000110);
+	while(1){
+		uint8_t next = serviceMainLoop();
+		if(next != SCREEN_NONE){
+			return next;
 		}
-		printValues((long)i);
+		
+		if(BTN_DOWN(BTN_LEFT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+			_delay_ms(50);
+			
+			return back;
+		}
+		else if(BTN_DOWN(BTN_MIDDLE)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
+			_delay_ms(50);
+			
+			return SCREEN_NONE;
+		}
+		else if(BTN_DOWN(BTN_RIGHT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+			_delay_ms(50);
+			
+			shownTarget = (shownTarget + 1) % (CHANNELS + 1);
+			LCD_draw(layout, FMT_TARGET);
+		}
+	}
+}
+
+// Diagnstico del arranque: una fase por pgina, en ms desde que arranc el Timer1. Luego
+// el filtro del Hx711 y, con PROFILE, una pgina por funcin perfilada.
+uint8_t showBootScreen(){
+	shownPhase = 0;
+	LCD_draw_screen(layoutBoot);
+	
+	while(1){
+		uint8_t next = serviceMainLoop();
+		if(next != SCREEN_NONE){
+			return next;
+		}
+		
+		if(BTN_DOWN(BTN_LEFT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_LEFT)) wdt_reset();
+			_delay_ms(50);
+			
+			return SCREEN_MAIN;
+		}
+		else if(BTN_DOWN(BTN_RIGHT)){
+			// Traba.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
+			_delay_ms(50);
+			
+			shownPhase = (shownPhase + 1) % DIAG_PAGES;
+			if(shownPhase == DIAG_FILTER){
+				hxFilterCycles = Hx711_FilterBenchmark();
+			}
+			LCD_draw(layoutBoot, FMT_BOOT);
+		}
+	#if PROFILE
+		else if(BTN_DOWN(BTN_MIDDLE)){
+			// Traba. Los contadores vuelven a cero: al regresar muestran solo lo nuevo.
+			_delay_ms(50);
+			while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
+			_delay_ms(50);
+			
+			Profile_Reset();
+			LCD_draw(layoutBoot, FMT_BOOT);
+		}
+	#endif
+	}
+}
+
+uint8_t showGiveFoodScreen(){
+	uint8_t next = serviceMainLoop();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+	
+	// Mostrar mensajes estticos.
+	shownAmount = 10;
+	shownTarget = TARGET_ALL;
+	LCD_draw_screen(layoutGiveFood);
+	
+	
+	for(int i=10;i<maxFoodAmountToGive;i+=10){
+		shownAmount = i;
+		LCD_draw(layoutGiveFood, FMT_GRAMS);
 		
 			
 		// Checar botones.
 		while(1){
-			checkAlarms();
+			next = serviceMainLoop();
+			if(next != SCREEN_NONE){
+				return next;
+			}
 			
 			// Return.
-			if(cero_en_bit(&PINB, 0)){
+			if(BTN_DOWN(BTN_LEFT)){
 				// Traba.
 				_delay_ms(50);
-				while(cero_en_bit(&PINB, 0));
+				while(BTN_DOWN(BTN_LEFT)) wdt_reset();
 				_delay_ms(50);
 
-				showMainScreen();
+				return SCREEN_MAIN;
 			}
 			// Dar comida.
-			else if(cero_en_bit(&PINB, 1)){
+			else if(BTN_DOWN(BTN_MIDDLE)){
 				// Traba.
 				_delay_ms(50);
-				while(cero_en_bit(&PINB, 1));
+				while(BTN_DOWN(BTN_MIDDLE)) wdt_reset();
 				_delay_ms(50);
 					
-				showGivingFoodScreen(i);
+			#if CHANNELS > 1
+				next = chooseTarget(layoutGiveFood, SCREEN_MAIN);
+				if(next != SCREEN_NONE){
+					return next;
+				}
+			#endif
+				return screenAfterDispense(showGivingFoodScreen(i, TARGET_MASK(shownTarget)));
 			}
 			// Ms comida.
-			else if(cero_en_bit(&PINB, 2)){
+			else if(BTN_DOWN(BTN_RIGHT)){
 				// Traba.
 				_delay_ms(50);
-				while(cero_en_bit(&PINB, 2));
+				while(BTN_DOWN(BTN_RIGHT)) wdt_reset();
 				_delay_ms(50);
 					
 				break;
@@ -891,266 +3223,3541 @@ void showGiveFoodScreen(){
 		}
 	}
 	
-	showGiveFoodScreen();
+	return SCREEN_GIVE;
+}
+
+// Da foodAmount gramos de cada tolva de mask. Las que no tienen suficiente se quedan fuera
+// y las dems se despachan a la vez; al final se avisa de cada tolva con problema.
+uint8_t showGivingFoodScreen(int foodAmount, uint8_t mask){
+	NET_FEEDING();
+	LCD_draw_screen(layoutWait);
+	Hx711_StartSession();
+	
+	// El checkpoint se abre antes de pesar: un corte durante la pesada tampoco pierde la comida.
+	Checkpoint_Begin(foodAmount, mask);
+	
+	Hx711_Update(mask, Hx711_Samples(HX_WEIGH_WINDOW_MS));
+	
+	uint8_t dispensing = 0;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			dispenserChannel *c = &channels[ch];
+			if(c->amount < 10 || c->amount < foodAmount){
+				c->result = DISPENSE_LOW_FOOD;
+			}
+			else{
+				c->result = DISPENSE_OK;
+				c->target = c->amount - foodAmount;
+				dispensing |= (1<<ch);
+			}
+		}
+	}
+	
+	if(dispensing == 0){
+		Checkpoint_Clear();
+	}
+	else{
+		if(dispensing != mask){
+			Checkpoint_Begin(foodAmount, dispensing);
+		}
+		
+		// Desde aqu los Hx711 van a la tasa de despacho: el peso inicial ya usa esa tasa.
+		Hx711_SetRate(hxDispenseRate);
+		Hx711_Update(dispensing, Hx711_Samples(HX_START_WINDOW_MS));
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			channels[ch].startAmount = channels[ch].amount;
+		}
+		Checkpoint_Start(dispensing);
+
+		// Mostrar mensajes estticos.
+		LCD_draw(layoutDispensing, FMT_ALL);
+		
+		// Dar comida (cierra el checkpoint).
+		dispenseFood(dispensing);
+		Hx711_SetRate(HX_RATE_10SPS);
+	}
+	
+	// Avisar de cada tolva con problema; el resultado es el de la primera.
+	uint8_t result = DISPENSE_OK;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if((mask & (1<<ch)) && channels[ch].result != DISPENSE_OK){
+			if(result == DISPENSE_OK){
+				result = channels[ch].result;
+			}
+			shownChannel = ch;
+			showDispenseError(channels[ch].result);
+		}
+	}
+	lastDispenseResult = result;
+	NET_MEAL(mask);
+	
+	if(result != DISPENSE_OK){
+		return result;
+	}
+	
+	// Mostrar mensajes estticos.
+	LCD_draw_screen(layoutSuccess);
+	messageDelay();
+	
+	return DISPENSE_OK;
+}
+
+void showDispenseError(uint8_t result){
+	if(result == DISPENSE_LOW_FOOD){
+		LCD_draw_screen(layoutLowFood);
+	}
+	else if(result == DISPENSE_EMPTY){
+		LCD_draw_screen(layoutEmpty);
+	}
+	else if(result == DISPENSE_JAM){
+		LCD_draw_screen(layoutJam);
+	}
+#if BOWL
+	else if(result == DISPENSE_MISSING){
+		LCD_draw_screen(layoutMissing);
+	}
+#endif
+	else{
+		LCD_draw_screen(layoutTimeout);
+	}
+	messageDelay();
+	
+	LCD_draw(result == DISPENSE_LOW_FOOD || result == DISPENSE_EMPTY ? layoutAddFood : layoutCheckChute, FMT_ALL);
+	messageDelay();
+}
+
+// Mueve los servos de las tolvas de mask hasta que cada una baje a su target. Las tolvas
+// avanzan intercaladas: mientras un servo hace su ciclo se revisan las dems y los Hx711
+// convierten a la vez, as que N tolvas tardan casi lo mismo que una. Deja el resultado de
+// cada tolva en channels[].result y regresa el primero que no sea DISPENSE_OK.
+// Con BOWL tambin corta cuando al plato ya lleg lo que faltaba al empezar, y al final compara
+// lo que baj la tolva con lo que lleg: comida atorada en la salida o tirada es DISPENSE_MISSING.
+uint8_t dispenseFood(uint8_t mask){
+	uint8_t active = mask, fresh = mask, result = DISPENSE_OK;
+	float fromAmount[CHANNELS] = {0};
+	uint32_t from[CHANNELS] = {0};
+	acqWindow window;
+#if BOWL
+	acqWindow bowlWindow;
+	
+	Bowl_Start(mask);
+	Acq_WindowStart(&bowlWindow, mask, BOWL_WINDOW);
+	bowlWindow.input = ACQ_BOWL;
+#endif
+	
+	TRACE_FEED(mask);
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			dispenserChannel *c = &channels[ch];
+			c->cycleStartAmount = fromAmount[ch] = c->amount;
+			from[ch] = c->amountStamp;
+			c->cycles = c->stalls = c->recovering = 0;
+			c->result = DISPENSE_OK;
+		}
+	}
+	
+	// Cada tolva se revisa cuando completa una ventana nueva de su peso.
+	Acq_WindowStart(&window, mask, Hx711_Samples(HX_DISPENSE_WINDOW_MS));
+	while(active){
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(!(active & fresh & (1<<ch))){
+				continue;
+			}
+			
+			dispenserChannel *c = &channels[ch];
+			uint8_t arrived = 0;
+		#if BOWL
+			// El plato va atrasado lo que tarda en caer: el final lo corta la tolva a tasa completa.
+			if(c->amount - c->target < BOWL_APPROACH_G){
+				acqBowl &= ~(1<<ch);
+			}
+			arrived = c->bowl.grams >= fromAmount[ch] - c->target;
+		#endif
+			if(c->amount <= c->target || arrived || (!Servo_Busy(ch) && (c->result = dispenseCycle(ch)) != DISPENSE_OK)){
+				Servo_Play(ch, MOTION_CLOSE);
+				active &= ~(1<<ch);
+				window.mask = active;
+			}
+		}
+		
+		fresh = Acq_WindowPoll(&window);
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(fresh & (1<<ch)){
+				channels[ch].amount = Hx711_Grams(ch, window.count[ch]);
+				channels[ch].amountStamp = window.stamp[ch];
+			}
+		}
+	#if BOWL
+		uint8_t landed = Acq_WindowPoll(&bowlWindow);
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(landed & (1<<ch)){
+				channels[ch].bowl.grams = Bowl_Grams(ch, bowlWindow.count[ch]);
+			}
+		}
+		fresh |= landed;
+	#endif
+	}
+	// Las compuertas ya cerraron: un reinicio en el registro o en el bus I2C no debe repetir la comida.
+	Checkpoint_Clear();
+	
+#if BOWL
+	// Lo que ya haba salido de la tolva sigue en el aire: el plato se pesa cuando termina de caer.
+	uint32_t closed = Acq_Stamp();
+	acqBowl = mask;
+	while(Acq_Stamp() - closed < BOWL_LAND_MS){
+		Acq_Service(mask);
+	}
+	Bowl_Weigh(mask, &bowlWindow);
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			channels[ch].bowl.grams = Bowl_Grams(ch, bowlWindow.count[ch]);
+		}
+	}
+	Bowl_Stop();
+#endif
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			dispenserChannel *c = &channels[ch];
+			uint32_t ms = c->amountStamp - from[ch];
+			c->rate = ms ? (fromAmount[ch] - c->amount)*1000.0f/ms : 0;
+		#if BOWL
+			c->bowl.dropped = fromAmount[ch] - c->amount;
+			if(c->result == DISPENSE_OK && c->bowl.dropped - c->bowl.grams > BOWL_MISSING_G){
+				c->result = DISPENSE_MISSING;
+			}
+		#endif
+			TRACE_RESULT(ch);
+			MealLog_Record(ch);
+			if(result == DISPENSE_OK){
+				result = channels[ch].result;
+			}
+		}
+	}
+	AT24_Flush();							// Todas las tolvas de la comida en una pgina.
+	
+	return result;
+}
+
+// El servo de la tolva termin un movimiento. Cada ciclo de dar comida debe bajar al menos
+// DISPENSE_MIN_PROGRESS gramos; si no, se intenta destrabar (agitar, luego girar al revs)
+// y al tercer ciclo seguido sin avance se aborta. El total de ciclos est acotado.
+uint8_t dispenseCycle(uint8_t channel){
+	dispenserChannel *c = &channels[channel];
+	
+	// Un ciclo terminado (acotado por DISPENSE_MAX_CYCLES) tambin alimenta al watchdog.
+	wdt_reset();
+	
+	if(c->recovering){
+		c->recovering = 0;
+	}
+	else if(c->cycles > 0){
+		// Revisar el avance del ltimo ciclo.
+		if(c->cycleStartAmount - c->amount < DISPENSE_MIN_PROGRESS){
+			c->stalls++;
+			if(c->amount < DISPENSE_EMPTY_AMOUNT){
+				return DISPENSE_EMPTY;
+			}
+			if(c->stalls >= DISPENSE_MAX_STALLS){
+				return DISPENSE_JAM;
+			}
+			
+			Servo_Play(channel, c->stalls == 1 ? MOTION_AGITATE : MOTION_REVERSE);
+			c->recovering = 1;
+			return DISPENSE_OK;
+		}
+		c->stalls = 0;
+	}
+	
+	if(c->cycles >= DISPENSE_MAX_CYCLES){
+		return DISPENSE_TIMEOUT;
+	}
+	c->cycles++;
+	c->cycleStartAmount = c->amount;
+	Servo_Play(channel, MOTION_DISPENSE);
+	
+	return DISPENSE_OK;
+}
+
+uint8_t screenAfterDispense(uint8_t result){
+	if(result == DISPENSE_LOW_FOOD || result == DISPENSE_EMPTY){
+		return SCREEN_WEIGHT;
+	}
+	
+	return SCREEN_MAIN;
+}
+
+// Trabajo de cada vuelta de los ciclos de las pantallas. Es el nico lugar donde se
+// alimenta al watchdog en operacin normal: si algo se cuelga (bus I2C, busy flag del LCD)
+// el watchdog reinicia y el arranque retoma la comida pendiente.
+uint8_t serviceMainLoop(){
+	uint8_t demand = histPhase == HIST_SAMPLING ? ALL_CHANNELS : 0;
+	
+	wdt_reset();
+#if LINK
+	if((int32_t)(linkSamplesUntil - Timer1_Frames()) > 0){
+		demand = ALL_CHANNELS;
+	}
+#endif
+#if NET
+	if(netPolled){
+		netPolled = 0;
+		netWeightUntil = Timer1_Frames() + NET_WEIGHT_HOLD;
+	}
+	if((int32_t)(netWeightUntil - Timer1_Frames()) > 0){
+		demand = ALL_CHANNELS;
+	}
+#endif
+	Acq_Service(demand);
+	History_Service();
+#if LINK
+	Link_Service();
+#endif
+#if NET
+	uint8_t next = Net_Service();
+	if(next != SCREEN_NONE){
+		return next;
+	}
+#endif
+	
+	return checkAlarms();
+}
+
+// Pausa para que se lean los mensajes; es tiempo sano, no cuenta para el watchdog.
+void messageDelay(){
+	wdt_reset();
+	_delay_ms(1000);
+	wdt_reset();
+}
+
+// Funciones del checkpoint de comidas: el estado se escribe al final para que un corte
+// a la mitad nunca deje un checkpoint vlido con datos viejos. Lo que falta se calcula al
+// reanudar con el peso al empezar y el peso de ese momento, sin escrituras durante la comida.
+void Checkpoint_Begin(int foodAmount, uint8_t mask){
+	checkpointAmount = foodAmount;
+	EEPROM_write(EE_CKPT_AMOUNT, foodAmount & 0xFF);
+	EEPROM_write(EE_CKPT_AMOUNT+1, foodAmount >> 8);
+	EEPROM_write(EE_CKPT_CHANNELS, mask);
+	EEPROM_write(EE_CKPT_RESUMES, 0);
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			EEPROM_update(EE_CKPT_START + 2*ch, 0xFF);
+			EEPROM_update(EE_CKPT_START + 2*ch + 1, 0xFF);
+		}
+	}
+	EEPROM_write(EE_CKPT_STATE, CKPT_DISPENSING);
+}
+
+// Peso al empezar de las tolvas de mask, antes de abrir. El byte bajo va primero: a medias
+// el valor queda negativo y la reanudacin lo toma como sin pesar, igual que antes de escribirlo.
+void Checkpoint_Start(uint8_t mask){
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			float tenths = channels[ch].startAmount*10 + 0.5f;
+			int16_t start = tenths < 0 ? 0 : tenths > INT16_MAX ? INT16_MAX : tenths;
+			EEPROM_update(EE_CKPT_START + 2*ch, start & 0xFF);
+			EEPROM_update(EE_CKPT_START + 2*ch + 1, start >> 8);
+		}
+	}
+}
+
+void Checkpoint_Clear(){
+	EEPROM_write(EE_CKPT_STATE, CKPT_IDLE);
+}
+
+uint8_t Checkpoint_Pending(){
+	return EEPROM_read(EE_CKPT_STATE) == CKPT_DISPENSING;
+}
+
+// Termina la comida que qued a medias antes de un reinicio. No usa el LCD para poder
+// correr antes de inicializarlo en el arranque en caliente. Lo que falta sale del peso de
+// ahora contra el peso al empezar; una tolva sin pesar todava no haba abierto. Una falla
+// que reinicia cada vez (Hx711, bus I2C) no repite la comida ms de CKPT_MAX_RESUMES veces.
+// El peso al empezar se guard compensado por temperatura: en caliente el DS3231 todava no
+// se ha ledo y se lee aqu, o el peso de ahora saldra sin compensar.
+uint8_t resumeDispense(){
+	uint8_t mask = EEPROM_read(EE_CKPT_CHANNELS) & ALL_CHANNELS, dispensing = 0;
+	uint8_t resumes = EEPROM_read(EE_CKPT_RESUMES);
+	checkpointAmount = EEPROM_read(EE_CKPT_AMOUNT) | (EEPROM_read(EE_CKPT_AMOUNT+1) << 8);
+	
+	if(resumes >= CKPT_MAX_RESUMES){
+		Checkpoint_Clear();
+		lastDispenseResult = DISPENSE_TIMEOUT;
+		return DISPENSE_TIMEOUT;
+	}
+	EEPROM_write(EE_CKPT_RESUMES, resumes + 1);
+	
+	if(!clockEpoch){
+		I2C_Init();
+		readTimeDate();
+	}
+	NET_FEEDING();
+	Hx711_StartSession();
+	Hx711_SetRate(hxDispenseRate);
+	Hx711_Update(mask, Hx711_Samples(HX_START_WINDOW_MS));
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		if(mask & (1<<ch)){
+			dispenserChannel *c = &channels[ch];
+			int16_t start = EEPROM_read(EE_CKPT_START + 2*ch) | (EEPROM_read(EE_CKPT_START + 2*ch + 1) << 8);
+			
+			c->startAmount = start < 0 ? c->amount : start/10.0f;
+			c->target = c->startAmount - checkpointAmount;
+			if(c->amount - c->target >= CKPT_RESUME_MIN_G){
+				dispensing |= (1<<ch);
+			}
+		}
+	}
+	Checkpoint_Start(mask);
+	
+	uint8_t result = DISPENSE_OK;
+	if(dispensing){
+		result = dispenseFood(dispensing);
+	}else{
+		Checkpoint_Clear();
+	}
+	Hx711_SetRate(HX_RATE_10SPS);
+	lastDispenseResult = result;
+	NET_MEAL(dispensing);
+	return result;
+}
+
+// Funciones del historial de peso. Cada ranura del da (HIST_PERIOD_MIN) se guarda un delta
+// en gramos por tolva en un anillo de la EEPROM; el consumo es la suma de los deltas que
+// bajan (los que suben son rellenos). Cada muestra cuesta O(1): se suma el delta nuevo, se
+// resta el que sale del anillo y las escrituras salen de una en una sin esperar a la EEPROM.
+void History_Init(){
+	uint16_t gray = ~(EEPROM_read(EE_HIST_ENTRIES) | (EEPROM_read(EE_HIST_ENTRIES+1) << 8));
+	
+	for(histEntries=gray;gray;histEntries^=gray){
+		gray >>= 1;								// Del cdigo Gray al binario.
+	}
+	histSlot = EEPROM_read(EE_HIST_SLOT) | (EEPROM_read(EE_HIST_SLOT+1) << 8);
+	if(histEntries > HIST_WRAP_FROM){
+		histEntries = 0;
+		histSlot = HIST_NO_SLOT;
+	}
+	History_Locate();
+	
+	// nica pasada completa: reconstruir la suma de consumo del anillo.
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		hopperHistory *h = &channels[ch].history;
+		h->base = EEPROM_read(EE_HIST_BASE + 2*ch) | (EEPROM_read(EE_HIST_BASE + 2*ch + 1) << 8);
+		h->consumed = 0;
+		for(uint8_t k=0;k<histCount;k++){
+			int8_t delta = EEPROM_read(EE_HIST_RING + ch*HIST_ENTRIES + (histHead + HIST_ENTRIES - 1 - k) % HIST_ENTRIES);
+			if(delta < 0){
+				h->consumed -= delta;
+			}
+		}
+	}
+	History_Forecast();
+}
+
+// Cabeza (siguiente posicin) y deltas vlidos del anillo segn las muestras escritas.
+void History_Locate(){
+	histHead = histEntries % HIST_ENTRIES;
+	histCount = histEntries < HIST_ENTRIES ? histEntries : HIST_ENTRIES;
 }
 
-void showGivingFoodScreen(int foodAmount){
-	LCD_wr_instruction(LCD_Cmd_Clear);		
-	LCD_wr_instruction(0b10000000);				
-	LCD_wr_string("=====Espere=====");
+// Una vuelta del ciclo principal: al cambiar de ranura toma HIST_SAMPLES muestras del anillo
+// (serviceMainLoop pide la adquisicin mientras tanto) y luego escribe un byte por vuelta.
+// Nunca espera al Hx711 ni a la EEPROM. Las muestras con el servo en movimiento no cuentan.
+void History_Service(){
+	uint16_t slot = Clock_Now() / (HIST_PERIOD_MIN*60UL);
+	
+	if(histPhase == HIST_IDLE){
+		if(slot == histSlot){
+			return;
+		}
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			channels[ch].history.sum = 0;
+			channels[ch].history.taken = 0;
+		}
+		histPendingSlot = slot;
+		histPhase = HIST_SAMPLING;
+		Acq_Open(&histReader);
+	}
 	
-	float pastAmountFood = get_units(50);
+	if(histPhase == HIST_SAMPLING){
+		acqSample sample;
+		uint8_t done = 1;
+		while(Acq_Next(&histReader, &sample)){
+			hopperHistory *h = &channels[sample.tag & ACQ_CHANNEL].history;
+			if(h->taken < HIST_SAMPLES && !(sample.tag & (ACQ_SERVO | ACQ_BOWL))
+					&& sample.count != HX_COUNT_MIN && sample.count != HX_COUNT_MAX){
+				h->sum += sample.count;
+				h->taken++;
+			}
+		}
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			if(channels[ch].history.taken < HIST_SAMPLES){
+				done = 0;
+			}
+		}
+		if(done){
+			History_Record();
+		}
+		return;
+	}
 	
-	if(pastAmountFood < 10 || pastAmountFood < foodAmount){
-		LCD_wr_instruction(LCD_Cmd_Clear);		
-		LCD_wr_instruction(0b10000000);			
-		LCD_wr_string("=====Error=====");
+	if(!EEPROM_busy()){
+		History_WriteStep();
+	}
+}
+
+// Cierra la muestra: calcula los deltas y actualiza sumas y pronstico en SRAM.
+void History_Record(){
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		hopperHistory *h = &channels[ch].history;
+		Hx711_LearnTemperature(ch, HX_COUNT_ZERO + (h->sum/HIST_SAMPLES - HX_COUNT_ZERO) / HX_GAIN_FACTOR(channels[ch].gain));
+		int weight = (h->sum/HIST_SAMPLES - Hx711_Offset(ch)) / Hx711_Scale(ch) + 0.5f;
+		int delta = 0;
+		
+		if(weight < 0){
+			weight = 0;
+		}
+		if(histCount == 0){
+			h->base = weight;
+		}
+		else{
+			delta = weight - h->base;
+			if(delta > -HIST_DEADBAND && delta < HIST_DEADBAND){
+				delta = 0;
+			}
+			delta = delta > 127 ? 127 : delta < -127 ? -127 : delta;
+			h->base += delta;					// Lo que no cupo en el delta sale en la siguiente ranura.
+		}
 		
-		LCD_wr_instruction(0b11000000);				
-		LCD_wr_string("Hay poca comida");
-		_delay_ms(1000);
+		// El delta ms viejo sale del anillo cuando est lleno.
+		if(histCount == HIST_ENTRIES){
+			int8_t old = EEPROM_read(EE_HIST_RING + ch*HIST_ENTRIES + histHead);
+			if(old < 0){
+				h->consumed += old;
+			}
+		}
+		if(delta < 0){
+			h->consumed -= delta;
+		}
+		h->delta = delta;
+	}
+	
+	histWriteHead = histHead;
+	histEntries = histEntries == HIST_WRAP_FROM ? HIST_WRAP_TO : histEntries + 1U;
+	History_Locate();
+	histSlot = histPendingSlot;
+	History_Forecast();
+	
+	histWriteStep = 0;
+	histPhase = HIST_WRITING;
+}
+
+// Un byte por llamada: delta, base y deriva por temperatura de cada tolva, luego la ranura y
+// al final el contador de muestras, que la confirma: de sus dos bytes solo cambia uno. Los
+// bytes que no cambian no se reescriben.
+void History_WriteStep(){
+	uint16_t dir;
+	uint8_t data;
+	
+	if(histWriteStep < 5*CHANNELS){
+		uint8_t ch = histWriteStep/5;
+		hopperHistory *h = &channels[ch].history;
+		switch(histWriteStep%5){
+			case 0:  dir = EE_HIST_RING + ch*HIST_ENTRIES + histWriteHead; data = h->delta; break;
+			case 1:  dir = EE_HIST_BASE + 2*ch; data = h->base & 0xFF; break;
+			case 2:  dir = EE_HIST_BASE + 2*ch + 1; data = h->base >> 8; break;
+			case 3:  dir = EE_HX_TEMP_SLOPE + 2*ch; data = channels[ch].temp.saved & 0xFF; break;
+			default: dir = EE_HX_TEMP_SLOPE + 2*ch + 1; data = channels[ch].temp.saved >> 8; break;
+		}
+	}
+	else if(histWriteStep == 5*CHANNELS){
+		dir = EE_HIST_SLOT; data = histSlot & 0xFF;
+	}
+	else if(histWriteStep == 5*CHANNELS + 1){
+		dir = EE_HIST_SLOT+1; data = histSlot >> 8;
+	}
+	else{
+		uint16_t gray = ~(histEntries ^ (histEntries >> 1));
+		if(histWriteStep == 5*CHANNELS + 2){
+			dir = EE_HIST_ENTRIES; data = gray & 0xFF;
+		}
+		else{
+			dir = EE_HIST_ENTRIES+1; data = gray >> 8;
+			histPhase = HIST_IDLE;
+		}
+	}
+	
+	if(EEPROM_read(dir) != data){
+		EEPROM_write(dir, data);
+	}
+	histWriteStep++;
+}
+
+// Das de comida que quedan en la tolva que se acaba primero: peso entre consumo diario.
+// Se pronostica con al menos un da de historial; sin l solo se avisa con poco peso.
+void History_Forecast(){
+	histDaysLeft = HIST_UNKNOWN;
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		hopperHistory *h = &channels[ch].history;
+		uint8_t days = HIST_UNKNOWN;
 		
-		LCD_wr_instruction(0b11000000);				
-		LCD_wr_string("                ");
-		LCD_wr_instruction(0b11000000);				
-		LCD_wr_string("Agregue + comida");
-		_delay_ms(1000);
+		if(histCount > 0 && h->base < HIST_WARN_GRAMS){
+			days = 0;
+		}
+		else if(histCount >= HIST_SLOTS_PER_DAY && h->consumed > 0){
+			uint32_t left = (uint32_t)h->base * histCount / ((uint32_t)h->consumed * HIST_SLOTS_PER_DAY);
+			days = left >= HIST_UNKNOWN ? HIST_UNKNOWN - 1 : left;
+		}
+		if(days < histDaysLeft){
+			histDaysLeft = days;
+		}
+	}
+}
+
+// Gramos por da que baj la tolva en lo que cubre el anillo.
+uint16_t History_Daily(uint8_t channel){
+	if(histCount == 0){
+		return 0;
+	}
+	return (uint32_t)channels[channel].history.consumed * HIST_SLOTS_PER_DAY / histCount;
+}
+
+#if PROFILE
+// Funciones del perfilado.
+// Contadores en cero y costo de medir (necesita al Timer1 corriendo).
+void Profile_Reset(){
+	for(uint8_t id=0;id<PROF_FUNCS;id++){
+		profileCounters[id].calls = profileCounters[id].total = profileCounters[id].max = 0;
+	}
+	
+	PROFILE_BEGIN(0);
+	profileOverhead = 0;
+	profileOverhead = Timer1_Cycles() - profileStart;
+}
+
+void Profile_Add(uint8_t id, uint32_t start){
+	uint32_t cycles = Timer1_Cycles() - start;
+	profileCounter *p = &profileCounters[id];
+	
+	cycles = cycles > profileOverhead ? cycles - profileOverhead : 0;
+	p->calls++;
+	p->total = p->total + cycles < p->total ? UINT32_MAX : p->total + cycles;
+	if(cycles > p->max){
+		p->max = cycles;
+	}
+}
+#endif
+
+#if USART_USED
+// Funciones de la USART: el programa encola en SRAM y la interrupcin saca un byte a la vez,
+// as escribir no lo detiene. Usart_Put no revisa lugar: quien encola ya lo pidi a Usart_Free.
+void Usart_Init(){
+	UBRRH = USART_UBRR >> 8;
+	UBRRL = USART_UBRR & 0xFF;
+	UCSRA = (1<<U2X);
+	UCSRC = (1<<URSEL)|(1<<UCSZ1)|(1<<UCSZ0);	// 8N1.
+#if LINK
+	UCSRB = (1<<RXCIE)|(1<<RXEN)|(1<<TXEN);
+#else
+	UCSRB = (1<<TXEN);
+#endif
+}
+
+// Solo se llama fuera de las interrupciones: usartHead es del programa y usartTail de la USART.
+uint8_t Usart_Free(){
+	return (usartTail - usartHead - 1) & (USART_TX_BUFFER - 1);
+}
+
+void Usart_Put(uint8_t data){
+	usartBuffer[usartHead] = data;
+	usartHead = (usartHead + 1) & (USART_TX_BUFFER - 1);
+}
+
+void Usart_Send(){
+	cli();
+	UCSRB |= (1<<UDRIE);
+	sei();
+}
+
+// Un byte por interrupcin; con la cola vaca se apaga hasta el siguiente Usart_Send.
+ISR(USART_UDRE_vect){
+	if(usartTail == usartHead){
+		UCSRB &= ~(1<<UDRIE);
+		return;
+	}
+	UDR = usartBuffer[usartTail];
+	usartTail = (usartTail + 1) & (USART_TX_BUFFER - 1);
+}
+#endif
+
+#if TRACE
+// Funciones del trace: los registros salen por la cola de la USART. Si no tiene lugar se
+// descarta el registro completo y cuando vuelve a haber lugar sale un TR_LOST con la cuenta.
+
+// Ticks de TRACE_TICK_US desde que arranc el Timer1 (da la vuelta cada ~19 horas).
+uint32_t Trace_Now(){
+	uint16_t ticks;
+	uint32_t frames = Timer1_Read(&ticks);
+	
+	return frames*(SERVO_FRAME_US/TRACE_TICK_US) + ticks/(TRACE_TICK_US*SERVO_TICKS_PER_US);
+}
+
+// Encabezado y datos en el orden de la SRAM (little endian en el AVR y en el simulador).
+void Trace_Put(uint8_t header, uint16_t dt, const void *value, uint8_t len){
+	const uint8_t *data = value;
+	
+	Usart_Put(header);
+	Usart_Put(dt & 0xFF);
+	Usart_Put(dt >> 8);
+	while(len--){
+		Usart_Put(*data++);
+	}
+}
+
+void Trace_Record(uint8_t header, const void *value, uint8_t len){
+	uint32_t now = Trace_Now(), dt = now - traceLast;
+	uint8_t free = Usart_Free();
+	uint8_t need = 3 + len + (dt > 0xFFFF ? 7 : 0) + (traceLost ? 5 : 0);
+	
+	if(free < need){
+		if(traceLost < 0xFFFF){
+			traceLost++;
+		}
+		return;
+	}
+	if(dt > 0xFFFF){
+		Trace_Put(TR_SYNC, 0, &now, 4);
+		dt = 0;
+	}
+	if(traceLost){
+		Trace_Put(TR_LOST, dt, &traceLost, 2);
+		traceLost = 0;
+		dt = 0;
+	}
+	Trace_Put(header, dt, value, len);
+	traceLast = now;
+	Usart_Send();
+}
+
+// Lectura de un botn para BTN_DOWN: registra el estado de todos cuando cambia uno.
+uint8_t Trace_Button(uint8_t bit, uint8_t down){
+	uint8_t state = down ? traceButtons | (1<<bit) : traceButtons & ~(1<<bit);
+	
+	if(state != traceButtons){
+		traceButtons = state;
+		Trace_Record(TR_BUTTONS, &state, 1);
+	}
+	
+	return down;
+}
+
+void Trace_Feed(uint8_t mask){
+	uint8_t data[3] = {mask, checkpointAmount & 0xFF, checkpointAmount >> 8};
+	
+	Trace_Record(TR_FEED, data, 3);
+}
+
+void Trace_Result(uint8_t channel){
+	dispenserChannel *c = &channels[channel];
+	int delivered = c->startAmount - c->amount + 0.5f;
+	uint8_t data[4] = {c->result, delivered & 0xFF, delivered >> 8, c->cycles};
+	
+	Trace_Record(TR_RESULT | channel<<4, data, 4);
+}
+#endif
+
+// Funciones de la configuracin guardada. Lo borrado o fuera de rango se queda con los
+// valores de fbrica. Antes termina de copiar el bloque del enlace o de la red que un corte
+// dej a medias: con la marca puesta el bloque de paso est completo y se vuelve a aplicar
+// (con la hora, si el DS3231 no la alcanz a recibir; el arranque an no inicializa el bus).
+void Config_Load(){
+#if CFG_REMOTE
+	if(EEPROM_read(EE_LINK_STATE) == LINK_STAGED){
+		I2C_Init();
+		EEPROM_readBlock(EE_LINK_STAGE, CFG_STAGE_BUFFER, LINK_STAGE_SIZE);
+		Config_Commit(CFG_STAGE_BUFFER);
+	}
+#endif
+	int food = EEPROM_read(EE_MAX_FOOD) | (EEPROM_read(EE_MAX_FOOD+1) << 8);
+	if(food >= CFG_FOOD_MIN && food <= CFG_FOOD_MAX){
+		maxFoodAmountToGive = food;
+	}
+	
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		float calibration[2];
+		EEPROM_readBlock(EE_CAL + 8*ch, calibration, 8);
+		if(Config_CalibrationValid(calibration[0], calibration[1])){
+			channels[ch].offset = calibration[0];
+			channels[ch].scale = calibration[1];
+		}
+	}
+}
+
+// Las comparaciones son falsas con NaN: la EEPROM borrada (0xFFFFFFFF) no pasa.
+uint8_t Config_CalibrationValid(float offset, float scale){
+	return offset > 0 && offset < HX_COUNT_MAX
+		&& ((scale >= HX_SCALE_MIN && scale <= HX_SCALE_MAX) || (scale <= -HX_SCALE_MIN && scale >= -HX_SCALE_MAX));
+}
+
+#if CFG_REMOTE
+void Config_Copy(uint8_t *to, const void *from, uint8_t len){
+	const uint8_t *bytes = from;
+	
+	while(len--){
+		*to++ = *bytes++;
+	}
+}
+
+// Bloque con la configuracin en uso: alarmas de la EEPROM y lo dems de la SRAM.
+void Config_Read(uint8_t *block){
+	uint32_t now = Clock_Now();
+	
+	block[CFG_SECTIONS] = CFG_SEC_ALL;
+	for(uint8_t i=0;i<ALARM_BITS;i+=2){
+		block[CFG_ALARMS + 3*(i/2)] = EEPROM_read(i);
+		block[CFG_ALARMS + 3*(i/2) + 1] = EEPROM_read(i+1);
+		block[CFG_ALARMS + 3*(i/2) + 2] = EEPROM_read(EE_ALARM_CHANNELS + i/2);
+	}
+	block[CFG_MAX_FOOD] = maxFoodAmountToGive & 0xFF;
+	block[CFG_MAX_FOOD + 1] = maxFoodAmountToGive >> 8;
+	Config_Copy(block + CFG_CLOCK, &now, 4);
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		Config_Copy(block + CFG_CALIBRATION + 8*ch, &channels[ch].offset, 4);
+		Config_Copy(block + CFG_CALIBRATION + 8*ch + 4, &channels[ch].scale, 4);
+	}
+}
+
+// Revisa solo las secciones que se van a aplicar; una falla rechaza el bloque completo.
+uint8_t Config_Valid(const uint8_t *block){
+	uint8_t sections = block[CFG_SECTIONS];
+	
+	if(sections & ~CFG_SEC_ALL){
+		return 0;
+	}
+	if(sections & CFG_SEC_ALARMS){
+		for(uint8_t i=0;i<ALARM_BITS/2;i++){
+			const uint8_t *alarm = block + CFG_ALARMS + 3*i;
+			if(alarm[0] != 255 && (alarm[0] > 23 || alarm[1] > 59 || !alarm[2] || (alarm[2] != 255 && (alarm[2] & ~ALL_CHANNELS)))){
+				return 0;
+			}
+		}
+	}
+	if(sections & CFG_SEC_LIMITS){
+		int16_t food;
+		Config_Copy((uint8_t *)&food, block + CFG_MAX_FOOD, 2);
+		if(food < CFG_FOOD_MIN || food > CFG_FOOD_MAX){
+			return 0;
+		}
+	}
+	if(sections & CFG_SEC_CLOCK){
+		uint32_t epoch;
+		Config_Copy((uint8_t *)&epoch, block + CFG_CLOCK, 4);
+		if(epoch >= CFG_CLOCK_MAX){
+			return 0;
+		}
+	}
+	if(sections & CFG_SEC_CALIBRATION){
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			float calibration[2];
+			Config_Copy((uint8_t *)calibration, block + CFG_CALIBRATION + 8*ch, 8);
+			if(!Config_CalibrationValid(calibration[0], calibration[1])){
+				return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+// Copia a su lugar las secciones del bloque de paso (ya validado) y borra la marca. Se
+// puede repetir desde cualquier punto: el da atendido de una alarma va antes que su hora,
+// as que una alarma copiada a medias sigue distinta y la segunda pasada la termina. La hora
+// va primero, porque los das atendidos se calcularon con ella, y su seccin se borra del
+// bloque de paso en cuanto el DS3231 la tiene: repetirlo no regresa el reloj. Solo un corte
+// entre esas dos escrituras lo regresa a la hora pedida.
+void Config_Commit(const uint8_t *block){
+	uint8_t sections = block[CFG_SECTIONS];
+	
+	if(sections & CFG_SEC_CLOCK){
+		uint32_t epoch;
+		Config_Copy((uint8_t *)&epoch, block + CFG_CLOCK, 4);
+		Clock_Set(epoch);
+		EEPROM_update(EE_LINK_STAGE + CFG_SECTIONS, sections & ~CFG_SEC_CLOCK);
+	}
+	if(sections & CFG_SEC_ALARMS){
+		for(uint8_t i=0;i<ALARM_BITS;i+=2){
+			const uint8_t *alarm = block + CFG_ALARMS + 3*(i/2);
+			if(EEPROM_read(i) != alarm[0] || EEPROM_read(i+1) != alarm[1] || EEPROM_read(EE_ALARM_CHANNELS + i/2) != alarm[2]){
+				EEPROM_updateBlock(EE_ALARM_FIRED + i, block + CFG_SIZE + i, 2);
+				EEPROM_update(EE_ALARM_CHANNELS + i/2, alarm[2]);
+				EEPROM_update(i+1, alarm[1]);
+				EEPROM_update(i, alarm[0]);
+			}
+		}
+	}
+	if(sections & CFG_SEC_LIMITS){
+		EEPROM_updateBlock(EE_MAX_FOOD, block + CFG_MAX_FOOD, 2);
+	}
+	if(sections & CFG_SEC_CALIBRATION){
+		EEPROM_updateBlock(EE_CAL, block + CFG_CALIBRATION, 8*CHANNELS);
+	}
+	EEPROM_write(EE_LINK_STATE, LINK_IDLE);
+}
+
+// Aplica el bloque completo o nada: se copia a la EEPROM de paso con el da atendido de cada
+// alarma y la marca LINK_STAGED lo hace vlido. Un corte antes de la marca deja todo como
+// estaba; despus, Config_Load lo termina de copiar al arrancar, hora incluida.
+uint8_t Config_Write(uint8_t *block){
+	uint32_t now = Clock_Now();
+	
+	if(!Config_Valid(block)){
+		return LINK_BAD_VALUE;
+	}
+	if(block[CFG_SECTIONS] & CFG_SEC_CLOCK){
+		Config_Copy((uint8_t *)&now, block + CFG_CLOCK, 4);
+	}
+	
+	// Una hora que ya pas hoy cuenta como atendida, igual que al agregarla en la pantalla.
+	for(uint8_t i=0;i<ALARM_BITS;i+=2){
+		const uint8_t *alarm = block + CFG_ALARMS + 3*(i/2);
+		uint16_t day = alarm[0] == 255 ? ALARM_NOT_FIRED : alarmOccurrenceAt(alarm[0], alarm[1], now) / SECONDS_PER_DAY;
+		block[CFG_SIZE + i] = day & 0xFF;
+		block[CFG_SIZE + i + 1] = day >> 8;
+	}
+	
+	EEPROM_updateBlock(EE_LINK_STAGE, block, LINK_STAGE_SIZE);
+	EEPROM_write(EE_LINK_STATE, LINK_STAGED);
+	Config_Commit(block);
+	Config_Load();
+	
+	return LINK_OK;
+}
+#endif
+
+// Funciones del enlace.
+#if LINK
+// Arma la trama byte por byte. Una pausa de LINK_GAP_FRAMES la abandona (el anfitrin se
+// cort a la mitad) y lo que llegue mientras el programa no atienda la anterior se ignora.
+ISR(USART_RXC_vect){
+	uint8_t data = UDR, now = timer1Frames;
+	
+	if(linkReady){
+		return;
+	}
+	if(linkFill && (uint8_t)(now - linkLastFrame) > LINK_GAP_FRAMES){
+		linkFill = 0;
+	}
+	linkLastFrame = now;
+	if(!linkFill){
+		linkFill = data == LINK_START;
+		return;
+	}
+	linkFrame[linkFill++ - 1] = data;
+	if(linkFill == 3 && linkFrame[1] > LINK_MAX_DATA){
+		linkFill = 0;							// Largo imposible: buscar otro inicio.
+	}
+	else if(linkFill == 1 + 2 + linkFrame[1] + 2){
+		linkReady = 1;
+		linkFill = 0;
+	}
+}
+
+// Atiende la trama que dej la interrupcin. Escribir detiene las pantallas lo que tarden
+// las escrituras de la EEPROM (~8.5 ms por byte que cambia).
+void Link_Service(){
+	if(!linkReady){
+		return;
+	}
+	uint8_t command = linkFrame[0], length = linkFrame[1], *data = linkFrame + 2, reply = 0, status;
+	uint16_t crc = 0;
+	
+	for(uint8_t i=0;i<2+length;i++){
+		crc = _crc_xmodem_update(crc, linkFrame[i]);
+	}
+	if(crc != (linkFrame[2+length] << 8 | linkFrame[3+length])){
+		status = LINK_BAD_CRC;
+	}
+	else if(command == LINK_CMD_READ){
+		status = length ? LINK_BAD_LENGTH : LINK_OK;
+		if(status == LINK_OK){
+			Config_Read(data);
+			reply = CFG_SIZE;
+		}
+	}
+	else if(command == LINK_CMD_WRITE){
+		status = length != CFG_SIZE ? LINK_BAD_LENGTH : Config_Write(data);
+	}
+	else if(command == LINK_CMD_SAMPLES){
+		status = length ? LINK_BAD_LENGTH : LINK_OK;
+		if(status == LINK_OK){
+			if((int32_t)(linkSamplesUntil - Timer1_Frames()) <= 0){
+				Acq_Open(&linkReader);				// Pedido nuevo: nada de lo que pas sin nadie viendo.
+			}
+			linkSamplesUntil = Timer1_Frames() + LINK_SAMPLES_HOLD;
+			reply = Link_Samples(data);
+		}
+	}
+	else if(command == LINK_CMD_LOG){
+		uint16_t address = data[0] | data[1] << 8;
+		uint8_t count = data[2];
+		status = length != 3 || address >= AT24_SIZE || count > LINK_LOG_CHUNK ? LINK_BAD_LENGTH : LINK_OK;
+		if(status == LINK_OK){
+			AT24_Flush();
+			status = AT24_Read(address, data + 2, count) || (!count && at24State == AT24_PRESENT) ? LINK_OK : LINK_NO_DEVICE;
+			data[0] = at24Head & 0xFF;
+			data[1] = at24Head >> 8;
+			reply = status == LINK_OK ? 2 + count : 0;
+		}
+	}
+	else{
+		status = LINK_BAD_COMMAND;
+	}
+	Link_Reply(command | LINK_REPLY, status, data, reply);
+	linkReady = 0;
+}
+
+// Muestras nuevas del anillo desde el pedido anterior, en dcimas de gramo.
+uint8_t Link_Samples(uint8_t *data){
+	acqSample sample;
+	uint8_t len = 1;
+	
+	while(len < 1 + LINK_SAMPLES_MAX*LINK_SAMPLE && Acq_Next(&linkReader, &sample)){
+		float grams = Hx711_Grams(sample.tag & ACQ_CHANNEL, sample.count)*10;
+	#if BOWL
+		if(sample.tag & ACQ_BOWL){
+			grams = Bowl_Grams(sample.tag & ACQ_CHANNEL, sample.count)*10;	// Lo que lleg en esta comida.
+		}
+	#endif
+		int16_t tenths = grams > INT16_MAX ? INT16_MAX : grams < INT16_MIN ? INT16_MIN : grams;
+		Config_Copy(data + len, &sample.stamp, 4);
+		data[len+4] = sample.tag;
+		Config_Copy(data + len + 5, &tenths, 2);
+		len += LINK_SAMPLE;
+	}
+	data[0] = linkReader.lost;
+	linkReader.lost = 0;
+	return len;
+}
+
+// La respuesta siempre cabe en la cola (ver LINK_STAGE_SIZE): solo se espera a que se vace.
+void Link_Reply(uint8_t command, uint8_t status, const uint8_t *data, uint8_t len){
+	uint16_t crc = 0;
+	
+	while(Usart_Free() < len + 6){
+		wdt_reset();
+	}
+	Usart_Put(LINK_START);
+	crc = _crc_xmodem_update(crc, command);
+	Usart_Put(command);
+	crc = _crc_xmodem_update(crc, len + 1);
+	Usart_Put(len + 1);
+	crc = _crc_xmodem_update(crc, status);
+	Usart_Put(status);
+	while(len--){
+		crc = _crc_xmodem_update(crc, *data);
+		Usart_Put(*data++);
+	}
+	Usart_Put(crc >> 8);
+	Usart_Put(crc & 0xFF);
+	Usart_Send();
+}
+#endif
+
+// Funciones de la red.
+#if NET
+// Direccin de la EEPROM, mapa completo y entrada a la red. Lo de una comida reanudada antes
+// de llegar aqu ya est en netMeal.
+void Net_Init(){
+	uint8_t address = EEPROM_read(EE_NET_ADDRESS);
+	
+	netRegs[NET_REG_ID] = NET_ID;
+	netRegs[NET_REG_VERSION] = NET_VERSION;
+	netRegs[NET_REG_CHANNELS] = CHANNELS;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		netWeight[ch] = NET_NO_WEIGHT;
+		if(!netMeal[0]){
+			netMeal[NET_REG_MEAL - NET_REG_MEALS + NET_MEAL_SIZE*ch] = NET_NO_RESULT;
+		}
+	}
+	netAddress = address >= NET_ADDRESS_MIN && address <= NET_ADDRESS_MAX ? address : NET_ADDRESS;
+	TWAR = netAddress << 1;
+	NET_EN_DDR |= (1<<NET_EN_PIN);
+	
+	Acq_Open(&netReader);
+	netPublished = Timer1_Frames() - NET_PUBLISH_FRAMES;
+	Net_Publish();
+	Net_Attach();
+}
+
+// Vuelve a reconocer su direccin y une el bus de la tarjeta con la red. La condicin de
+// parada del maestro tiene que salir antes.
+void Net_Attach(){
+	if(!netAddress){
+		return;
+	}
+	while(TWCR & (1<<TWSTO));
+	TWCR = (1<<TWINT)|(1<<TWEA)|(1<<TWEN)|(1<<TWIE);
+	NET_EN_PORT |= (1<<NET_EN_PIN);
+}
+
+// Antes de ser maestro: deja terminar la transaccin de la red en curso (acotado) y separa
+// los buses. Sin TWIE el maestro espera TWINT sin la interrupcin.
+void Net_Detach(){
+	if(!netAddress || !(NET_EN_PORT & (1<<NET_EN_PIN))){
+		return;
+	}
+	for(uint8_t i=0;netBusy && i<NET_IDLE_WAIT_US/50;i++){
+		_delay_us(50);
+	}
+	NET_EN_PORT &= ~(1<<NET_EN_PIN);
+	TWCR = (1<<TWEN);
+	netBusy = 0;
+	netDeferred = 0;						// Net_Attach vuelve a reconocer; la publicacin se reintenta igual.
+}
+
+// Esclavo de la red. El primer byte escrito es el apuntador; los siguientes solo entran al
+// comando y al bloque de configuracin, y no mientras lo anterior espera al programa. Al
+// leer, el estado lleva en vivo si hay algo pendiente. No toca nada ms: publicar y atender
+// lo escrito es del programa.
+ISR(TWI_vect){
+	uint8_t status = TWSR & I2C_STATUS_MASK, ack = 1;
+	
+	switch(status){
+		case NET_SLA_W:
+		case NET_SLA_W_LOST:
+			netBusy = 1;
+			netFirst = 1;
+			netWritten = 0;
+			break;
+		case NET_DATA:
+			if(netFirst){
+				netFirst = 0;
+				netPointer = netWriteAt = TWDR;
+			}
+			else{
+				netRegs[netPointer++] = TWDR;
+				netWritten++;
+			}
+			ack = !netReady && netPointer >= NET_REG_COMMAND && netPointer < NET_MAP_SIZE;
+			break;
+		case NET_STOP:
+			if(netWriteAt == NET_REG_COMMAND && netWritten == NET_COMMAND_SIZE){
+				netReady |= NET_READY_COMMAND;
+			}
+			else if(netWriteAt == NET_REG_CONFIG && netWritten == CFG_SIZE){
+				netReady |= NET_READY_CONFIG;
+			}
+			netWritten = 0;
+			netBusy = 0;
+			ack = !netDeferred;
+			break;
+		case NET_SLA_R:
+		case NET_SLA_R_LOST:
+			netBusy = 1;
+			netPolled = 1;
+			// El primer byte sale igual que los dems.
+			__attribute__((fallthrough));
+		case NET_SENT:
+			TWDR = netPointer >= NET_MAP_SIZE ? 0xFF
+				: netPointer == NET_REG_STATUS && netReady ? netRegs[netPointer] | NET_ST_PENDING : netRegs[netPointer];
+			netPointer++;
+			break;
+		case NET_BUS_ERROR:
+			TWCR = (1<<TWINT)|(1<<TWSTO)|(1<<TWEA)|(1<<TWEN)|(1<<TWIE);
+			netBusy = 0;
+			return;
+		default:								// Dato rechazado o ltimo enviado: fuera de la transaccin.
+			netBusy = 0;
+			ack = !netDeferred;
+			break;
+	}
+	TWCR = (1<<TWINT)|(ack<<TWEA)|(1<<TWEN)|(1<<TWIE);
+}
+
+// Atiende lo que escribi el coordinador y publica el mapa. Un comando de dar comida corre
+// aqu como una alarma y regresa la pantalla que sigue (SCREEN_NONE si no hubo).
+uint8_t Net_Service(){
+	uint8_t next = SCREEN_NONE, pending = netReady & ~netDone;
+	
+	if(pending & NET_READY_CONFIG){
+		netStatus = Config_Write(netRegs + NET_REG_CONFIG) == LINK_OK ? netStatus & ~NET_ST_BAD_CONFIG : netStatus | NET_ST_BAD_CONFIG;
+		netDone |= NET_READY_CONFIG;
+	}
+	if(pending & NET_READY_COMMAND){
+		const uint8_t *command = netRegs + NET_REG_COMMAND;
+		uint8_t mask = command[1] == 0xFF ? ALL_CHANNELS : command[1];
+		int16_t value = command[2] | command[3] << 8;
+		
+		netStatus |= NET_ST_BAD_COMMAND;
+		if(command[0] == NET_CMD_DISPENSE && mask && !(mask & ~ALL_CHANNELS) && value > 0 && value <= maxFoodAmountToGive){
+			netStatus &= ~NET_ST_BAD_COMMAND;
+			next = screenAfterDispense(showGivingFoodScreen(value, mask));
+		}
+		else if(command[0] == NET_CMD_ADDRESS && (uint16_t)value == NET_ADDRESS_KEY
+				&& command[1] >= NET_ADDRESS_MIN && command[1] <= NET_ADDRESS_MAX){
+			netStatus &= ~NET_ST_BAD_COMMAND;
+			EEPROM_update(EE_NET_ADDRESS, command[1]);
+			netAddress = command[1];
+			TWAR = netAddress << 1;				// Vale desde la siguiente transaccin.
+		}
+		netDone |= NET_READY_COMMAND;
+	}
+	Net_Publish();
+	
+	return next;
+}
+
+// Pesos nuevos del anillo y, cada NET_PUBLISH_FRAMES o con algo atendido, el mapa. Se copia
+// sin reconocer la direccin (el coordinador reintenta) y nunca a la mitad de una transaccin,
+// as que cada lectura ve los valores juntos. TWEA solo se suelta con el bus libre: si hay una
+// transaccin (o su interrupcin espera), la publicacin queda para despus y el fin de esa
+// transaccin ya no reconoce la siguiente. Lo atendido deja de estar pendiente en la misma
+// copia que publica su resultado. El bloque de configuracin se copia una vez por segundo
+// salvo que uno escrito espere a aplicarse.
+void Net_Publish(){
+	acqSample sample;
+	
+	while(Acq_Next(&netReader, &sample)){
+		if(!(sample.tag & ACQ_BOWL)){
+			float tenths = Hx711_Grams(sample.tag & ACQ_CHANNEL, sample.count)*10;
+			netWeight[sample.tag & ACQ_CHANNEL] = tenths > INT16_MAX ? INT16_MAX : tenths < INT16_MIN + 1 ? INT16_MIN + 1 : tenths;
+		}
+	}
+	if(!netDone && (uint8_t)(Timer1_Frames() - netPublished) < NET_PUBLISH_FRAMES){
+		return;
+	}
+	cli();
+	if(netBusy || (TWCR & (1<<TWINT))){
+		netDeferred = 1;
+		sei();
+		return;
+	}
+	TWCR = (1<<TWEN)|(1<<TWIE);
+	sei();
+	
+	uint32_t now = Clock_Now();
+	netRegs[NET_REG_STATUS] = netStatus;
+	Config_Copy(netRegs + NET_REG_WEIGHT, netWeight, 2*CHANNELS);
+	Config_Copy(netRegs + NET_REG_MEALS, netMeal, sizeof(netMeal));
+	if(netDone & NET_READY_CONFIG){
+		netConfigAt = now - 1;
+	}
+	netReady &= ~netDone;
+	netDone = 0;
+	if(now != netConfigAt && !(netReady & NET_READY_CONFIG)){
+		Config_Read(netRegs + NET_REG_CONFIG);
+		netConfigAt = now;
+	}
+	netDeferred = 0;
+	TWCR = (1<<TWEA)|(1<<TWEN)|(1<<TWIE);
+	netPublished = Timer1_Frames();
+}
+
+// Una comida empieza: lo dems del mapa se queda como estaba hasta que termine.
+void Net_Feeding(){
+	netStatus |= NET_ST_FEEDING;
+	netRegs[NET_REG_STATUS] = netStatus;
+}
+
+// Resultado de la comida de las tolvas de mask para el mapa (la siguiente publicacin).
+void Net_Meal(uint8_t mask){
+	netStatus &= ~NET_ST_FEEDING;
+	netRegs[NET_REG_STATUS] = netStatus;
+	if(!mask){
+		return;
+	}
+	
+	uint32_t now = Clock_Now();
+	netMeal[0]++;
+	Config_Copy(netMeal + NET_REG_MEAL_TIME - NET_REG_MEALS, &now, 4);
+	netMeal[NET_REG_MEAL_MASK - NET_REG_MEALS] = mask;
+	for(uint8_t ch=0;ch<CHANNELS;ch++){
+		dispenserChannel *c = &channels[ch];
+		uint8_t *meal = netMeal + NET_REG_MEAL - NET_REG_MEALS + NET_MEAL_SIZE*ch;
+		int16_t grams = c->result == DISPENSE_LOW_FOOD ? 0 : c->startAmount - c->amount + 0.5f;
+		
+		meal[0] = mask & (1<<ch) ? c->result : NET_NO_RESULT;
+		meal[1] = mask & (1<<ch) ? grams & 0xFF : 0;
+		meal[2] = mask & (1<<ch) ? grams >> 8 : 0;
+	}
+}
+#endif
+
+uint8_t checkAlarms(){
+	PROFILE_BEGIN(PROF_CHECK_ALARMS);
+	if(searchAlarms() <= 0){
+		PROFILE_RETURN(PROF_CHECK_ALARMS, SCREEN_NONE);
+	}	
+	
+	uint8_t mask = alarmDue();
+	if(!mask){
+		PROFILE_RETURN(PROF_CHECK_ALARMS, SCREEN_NONE);
+	}
+	
+	// Marcar cada alarma con el da que se atiende antes de dar comida: un reinicio no la
+	// repite y la ventana de gracia no la vuelve a encontrar.
+	for(uint8_t i=0;i<ALARM_BITS;i+=2){
+		if(alarmsDue & (1<<(i/2))){
+			uint16_t day = alarmOccurrence(i, alarmCheckedAt) / SECONDS_PER_DAY;
+			EEPROM_write(EE_ALARM_FIRED + i, day & 0xFF);
+			EEPROM_write(EE_ALARM_FIRED + i + 1, day >> 8);
+		}
+	}
+	
+	PROFILE_RETURN(PROF_CHECK_ALARMS, screenAfterDispense(showGivingFoodScreen(30, mask)));
+}
+
+// Tolvas de las alarmas que tocan y no se han atendido (0: ninguna); deja cules en alarmsDue.
+// Una alarma toca durante ALARM_GRACE_S desde su hora (o desde un adelanto del reloj que la
+// salt) y se atiende una vez por da. No toca el LCD.
+uint8_t alarmDue(){
+	uint8_t mask = 0;
+	
+	alarmCheckedAt = Clock_Now();
+	alarmsDue = 0;
+	for(uint8_t i=0;i<ALARM_BITS;i+=2){
+		if(EEPROM_read(i) != 255){
+			uint32_t at = alarmOccurrence(i, alarmCheckedAt);
+			uint32_t since = at > clockSkipFrom && at <= clockSkipTo ? clockSkipTo : at;
+			uint16_t fired = EEPROM_read(EE_ALARM_FIRED + i) | (EEPROM_read(EE_ALARM_FIRED + i + 1) << 8);
+			
+			if(alarmCheckedAt - since < ALARM_GRACE_S && fired != (uint16_t)(at / SECONDS_PER_DAY)){
+				mask |= TARGET_MASK(alarmTarget(i));
+				alarmsDue |= 1<<(i/2);
+			}
+		}
+	}
+	
+	return mask;
+}
+
+// ltima vez (segundos de poca) que toc la alarma guardada en dir, sin pasar de now.
+uint32_t alarmOccurrence(uint8_t dir, uint32_t now){
+	return alarmOccurrenceAt(EEPROM_read(dir), EEPROM_read(dir+1), now);
+}
+
+uint32_t alarmOccurrenceAt(uint8_t hour, uint8_t minute, uint32_t now){
+	uint32_t at = now - now % SECONDS_PER_DAY + hour*3600UL + minute*60;
+	
+	return at > now ? at - SECONDS_PER_DAY : at;
+}
+	
+
+// Prints.
+void printValues8BitsTimeFormat(uint8_t valor){
+	uint8_t num[8] = {0};
+	uint8_t i = 0;
+	
+	if(valor == 0){
+		LCD_wr_char('0');
+		LCD_wr_char('0');
+		return;
+	}
+	
+	while(valor > 0){
+		num[i] = valor%10;
+		valor /= 10;
+		i++;
+	}
+	
+	int validacion = 0;
+	for(int i=7;i>=0;i--){
+		if(validacion == 1){
+			LCD_wr_char(num[i] + 48);
+		}
+		if(num[i] != 0 && validacion == 0){
+			if(i==0){
+				i+=2;
+			}
+			else if(i==1){
+				i++;
+			}
+			validacion = 1;
+		}
+		
+	}
+}
+
+void printValues8Bits(uint8_t valor){
+	uint8_t num[8] = {0};
+	uint8_t i = 0;
+	
+	while(valor > 0){
+		num[i] = valor%10;
+		valor /= 10;
+		i++;
+	}
+	
+	int validacion = 0;
+	for(int i=7;i>=0;i--){
+		if(num[i] != 0){
+			validacion = 1;
+		}
+		else if(validacion == 1){
+			LCD_wr_char(num[i] + 48);
+		}
+	}
+}
+
+void printValues(long valor){
+	if(valor <= 0){
+		LCD_wr_char('0');
+		return;
+	}
+	
+	uint8_t num[24] = {0};
+	uint8_t i = 0;
+	
+	while(valor > 0){
+		num[i] = valor%10;
+		valor /= 10;
+		i++;
+	}
+	
+	int validacion = 0;
+	for(int i=23;i>=0;i--){
+		if(num[i] != 0){
+			validacion = 1;
+		}
+		if(validacion == 1){
+			LCD_wr_char(num[i] + 48);
+		}
+	}
+}
+
+// Nmero alineado a la derecha en width caracteres; si no cabe se abrevia con k o M.
+void printCompact(uint32_t valor, uint8_t width){
+	uint32_t limit = 1;
+	char suffix = 0;
+	
+	for(uint8_t i=0;i<width;i++){
+		limit *= 10;
+	}
+	if(valor >= limit){
+		limit /= 10;
+		valor /= 1000;
+		suffix = 'k';
+		if(valor >= limit){
+			valor /= 1000;
+			suffix = 'M';
+		}
+		width--;
+	}
+	
+	uint8_t digits = 1;
+	for(uint32_t rest=valor/10;rest>0;rest/=10){
+		digits++;
+	}
+	while(width-- > digits){
+		LCD_wr_char(' ');
+	}
+	printValues(valor);
+	if(suffix){
+		LCD_wr_char(suffix);
+	}
+}
+
+void printValuesWithDecimal(float valor){
+	// Valor entero.
+	long int valorInt = valor;
+	
+	// Valor de los decimales en entero.
+	long int decimalValorInt = (valor-valorInt)*100;
+	
+	if(valor <= 0){
+		LCD_wr_char('0');
+		return;
+	}
+	
+	LCD_wr_instruction(LCD_Cmd_Clear);			// Limpiar el display
+	LCD_wr_instruction(LCD_LINE1);				// Posicin cero.
+	
+	uint8_t num[10] = {0};
+	uint8_t decimals[10] = {0};
+	uint8_t i = 0;
+	
+	// Obtener valores de la parte entera.
+	while(valorInt > 0){
+		num[i] = valorInt%10;
+		valorInt /= 10;
+		i++;
+	}
+	
+	i=0;
+	
+	// Obtener valores de la parte decimal.
+	while(decimalValorInt > 0){
+		decimals[i] = decimalValorInt%10;
+		decimalValorInt /= 10;
+		i++;
+	}
+	
+	// Imprimir valores de la parte entera.
+	int validacion = 0;
+	for(int i=9;i>=0;i--){
+		if(num[i] != 0){
+			validacion = 1;
+		}
+		if(validacion == 1){
+			LCD_wr_char(num[i] + 48);
+		}
+	}
+	
+	// Imprimir punto.
+	LCD_wr_char(46);
+	
+	// Imprimir valores de la parte decimal.
+	validacion = 0;
+	for(int i=9;i>=0;i--){
+		if(decimals[i] != 0){
+			validacion = 1;
+		}
+		if(validacion == 1){
+			LCD_wr_char(decimals[i] + 48);
+		}
+	}
+	
+	_delay_ms(300);
+}
+
+
+
+// ----------------------- Simulacin en PC (BOARD_HOST) -----------------------
+// Reemplaza al LCD, la EEPROM, el bus I2C (DS3231), el Hx711 y los botones con modelos
+// en memoria. El tiempo es virtual: avanza con los _delay, las transacciones del bus y
+// las esperas del Hx711, y dispara la interrupcin del Timer1 cada cuadro del servo.
+// El firmware corre en un proceso hijo; un reinicio (watchdog, brown-out, corte de luz)
+// termina al hijo y arranca otro con la RAM limpia, mientras la EEPROM, el DS3231, el LCD
+// y la tolva sobreviven en memoria compartida.
+#if BOARD == BOARD_HOST
+	#define SIM_HX_PERIOD_US   100000UL		// Hx711 con RATE en bajo: 10 muestras por segundo.
+	#define SIM_HX_FAST_US     12500UL			// Con RATE en alto: 80 muestras por segundo.
+	#define SIM_HX_NOISE       500				// Ruido pico en cuentas a 10 muestras/s...
+	#define SIM_HX_FAST_NOISE  900				// ... y a 80, con menos filtrado interno.
+	#define SIM_HX_ZERO        8615000L		// Cuenta del Hx711 con la tolva vaca.
+	#define SIM_HX_PER_GRAM    1900L
+	#define SIM_HX_DRIFT       600				// Cuentas por C que corre el cero de la celda (-C).
+	#define SIM_FLOW_PER_FRAME 0.25f		// Gramos que caen por cuadro con la compuerta abierta.
+	#define SIM_CHUTE_FRAMES   16				// Cuadros (~256 ms) que tarda la comida en llegar al plato.
+	#define SIM_BOWL_ZERO      8500000L		// Cuenta del Hx711 (ganancia 128) con el plato vaco.
+	#define SIM_MAX_PRESSES    32
+	#define SIM_MAX_RESETS     8
+	#define SIM_EXIT_RESET     10			// Cdigo de salida del hijo: SIM_EXIT_RESET + bit de MCUCSR.
+	#define SIM_UART_BYTE_US   (10*1000000UL/USART_ACTUAL_BAUD)	// Inicio, 8 bits y parada.
+	#define SIM_PACE_US        10000			// Con el enlace (-Q): cada cunto se espera al reloj real.
+	#define SIM_LINK_TIMEOUT_MS 5000		// El cliente (-U) espera la respuesta hasta este tiempo.
+	#define SIM_AT24_WRITE_US  5000			// Grabacin de una pgina del AT24C32 (10 ms en el peor caso).
+	#define SIM_TRACE_FEEDS    64
+	#define SIM_SOAK_DAYS      1100			// Mximo de das de la prueba de resistencia (-M).
+	#define SIM_SOAK_POLL_US   5000			// Cada lectura de botn sin pulsaciones cercanas (-M).
+	#define SIM_SOAK_SHIFT_DAYS 30			// Das entre cambios de horario.
+	#define SIM_SOAK_CUT_MIN_S 43200		// Entre cortes de luz: de 12 a 60 horas...
+	#define SIM_SOAK_CUT_MAX_S 216000
+	#define SIM_SOAK_OFF_MAX_S 600			// ... de hasta 10 minutos, menos que ALARM_GRACE_S.
+	#define SIM_SOAK_REFILL    150			// Gramos con los que el dueo rellena la tolva.
+	#define SIM_NET_NODES      8				// Equipos como mximo en la prueba de la red (-W).
+	#define SIM_NET_DATA       128				// Bytes como mximo por transaccin de la red.
+	#define SIM_NET_WAIT_US    50000			// Tiempo real sin respuesta: nadie tiene la direccin.
+	#define SIM_NET_RETRIES    100				// Reintentos mientras el equipo no reconoce su direccin...
+	#define SIM_NET_RETRY_US   2000			// ... cada tanto tiempo real.
+	#define SIM_NET_END_S      3600			// Los equipos corren hasta que el coordinador termina.
+	#define SIM_NET_WEIGHT_G   2.0f			// Error aceptable del peso publicado contra la tolva.
+	#define SIM_NET_FEED_G     20				// Gramos por tolva del comando de dar comida.
+	#define SIM_NET_FEED_S     60				// Tiempo real para que terminen las comidas.
+	#define SIM_NET_IDLE       0
+	#define SIM_NET_POSTED     1
+	#define SIM_NET_RUNNING    2
+	#define SIM_NET_DONE       3
+	
+	struct simState {
+		uint64_t micros, endMicros;
+		double nextFrame, frameUs;				// El Timer1 va con el oscilador del AVR (-F), no con el DS3231.
+		time_t rtcBase;
+		
+		// LCD 16x2.
+		char lcd[2][17];
+		uint8_t lcdAddr, lcdFourBit, lcdHalf, lcdHigh;
+		
+		// EEPROM interna.
+		uint8_t eeprom[512];
+		
+		// Tolvas, platos, servos y Hx711 (uno de cada por canal).
+		float hopperGrams[CHANNELS], bowlGrams[CHANNELS];
+		uint8_t jammed;							// Mscara de tolvas atascadas.
+		uint16_t servoUs[CHANNELS];				// Ancho del ltimo pulso medido en el pin de cada servo.
+		uint64_t hxNextReady[CHANNELS];
+		uint32_t hxConversions, hxCorruptEvery;	// Una de cada hxCorruptEvery conversiones sale mal (-X).
+		uint64_t flowFirst, flowLast;			// Primer y ltimo cuadro en que cay comida.
+		float chute[CHANNELS][SIM_CHUTE_FRAMES];	// Comida en el aire, por cuadro en que sali.
+		uint8_t chutePos;
+		float spill;							// Fraccin que se queda en la salida o cae fuera (-G).
+		uint16_t benchTrials;					// Comidas por tasa en la prueba de precisin (-S).
+		float tempSwing;						// Amplitud en C de la onda diaria de temperatura (-C).
+		float tempWorst[CHANNELS][2];			// Peor error del cero compensado: primer da y despus.
+		
+		// AT24C32: memoria, posicin interna, fin de la grabacin en curso y cuentas del bus.
+		uint8_t at24[AT24_SIZE];
+		uint16_t at24Address;
+		uint64_t at24BusyUntil;
+		uint32_t at24Pages, at24Bytes, at24Polls;
+		uint8_t listMeals;						// -L: listar el registro de comidas al final.
+		
+		// Botones: pulsaciones programadas (tiempo en ms, botn).
+		uint32_t pressAt[SIM_MAX_PRESSES];
+		uint16_t pressMs[SIM_MAX_PRESSES];
+		uint8_t pressBtn[SIM_MAX_PRESSES], pressCount;
+		
+		// Reinicios programados (tiempo, bit de MCUCSR) y bus I2C colgado.
+		uint64_t resetAt[SIM_MAX_RESETS];
+		uint8_t resetCause[SIM_MAX_RESETS], resetCount, resetNext;
+		uint64_t hangFrom, hangUntil;
+		uint16_t resets;
+		uint32_t eeWrites, eeCutAt;				// Corte de luz en la escritura eeCutAt de la EEPROM (-E).
+		
+		// Enlace (-Q): el tiempo virtual sigue al real desde paceStart.
+		uint8_t realTime;
+		uint64_t paceNext;
+		struct timespec paceStart;
+		
+		// Prueba de resistencia (-M): cortes de luz con tiempo apagado, cambios de hora y
+		// cuntas veces se atendi cada alarma cada da (desde soakFirstDay).
+		uint16_t soakDays, soakFirstDay, soakCuts, soakShifts, soakRefills;
+		uint32_t soakSeed;
+		uint64_t soakNextCut, soakOffUs, soakNextShift;
+		int8_t soakShiftHours;
+		uint8_t soakFired[ALARM_BITS/2][SIM_SOAK_DAYS];
+		uintptr_t stackTop, stackDeepest, stackFirstDay;
+	} *sim;
+	
+	// Bus de la red (-W), compartido por el coordinador y todos los equipos: una transaccin a
+	// la vez. Escribe writeLen bytes (el primero es el apuntador) y, si readLen, lee con un inicio
+	// repetido. El equipo deja cuntos bytes reconoci (con la direccin) y si se ley.
+	struct simNetBus {
+		volatile uint8_t state;
+		uint8_t address, writeLen, readLen;
+		uint8_t written, readAcked;
+		uint8_t data[SIM_NET_DATA];
+		uint32_t transfers, retries;
+	} *simNet = NULL;
+	
+	// Estado del micro y de los perifricos que se pierde con cada reinicio.
+	uint8_t simI2cState = 0, simI2cAddr = 0, simRtcPointer = 0, simRtcDirty = 0;
+	uint8_t simRtcRegs[0x13];
+	uint8_t simAt24Latch[AT24_PAGE], simAt24Count = 0;	// Pgina que llega antes del STOP.
+	uint32_t simAt24Mask = 0;
+	uint32_t simHxShift[CHANNELS];
+	uint8_t simHxPulses[CHANNELS], simHxReading[CHANNELS], simHxSck[CHANNELS];
+	uint8_t simHxGain[CHANNELS];					// Pulsos de la ltima lectura: eligen la conversin actual.
+	uint8_t simHxInput[CHANNELS], simHxMixing[CHANNELS];	// Entrada (1: canal B) y conversiones sin asentar.
+	float simHxLast[CHANNELS];						// Entrada de la ltima conversin, para el asentamiento.
+	uint8_t simWdtEnabled = 0;
+	uint64_t simWdtFed = 0, simWdtTimeout = 0;
+	uint64_t simUartFree = 0;						// Cuando la USART termina el byte en curso.
+	uint64_t simRxNext = 0;							// Cundo puede llegar el siguiente byte del enlace.
+	int simLinkFd = -1;								// -Q: lado del equipo de la pty.
+	
+	// Trace: registros decodificados (tiempo en us del Timer1 de su arranque) y comidas.
+	typedef struct {
+		uint64_t us;
+		uint8_t type, arg, session;
+		uint32_t value;
+	} simTraceEvent;
+	
+	typedef struct {
+		uint8_t session, channel, result, cycles;
+		int amount, grams;
+		uint64_t start, end, close, lastHx;
+	} simTraceFeed;
+	
+	FILE *simTraceOut = NULL;						// -O: lo que saca la USART.
+	simTraceEvent *simReplay = NULL;				// -R: primer arranque del trace grabado.
+	int simReplayCount = 0, simReplayNext = 0;
+	long simReplayLast[CHANNELS];
+	
+	// Bus I2C con un DS3231 en 0x68. Un byte son 9 pulsos de SCL.
+	#define SIM_I2C_BYTE_US (9*1000000L/I2C_ACTUAL_CLOCK)
+	
+	void simFinish(void);
+	long simReplayHx(uint8_t channel);
+	
+	void simReset(uint8_t cause){
+		if(!sim->soakDays){
+			printf("t=%.3f s  reinicio (MCUCSR bit %u)\n", sim->micros/1e6, cause);
+		}
+		fflush(stdout);
+		if(simTraceOut){
+			fflush(simTraceOut);					// Lo que qued en la cola de SRAM se pierde, como en el micro.
+		}
+		_exit(SIM_EXIT_RESET + cause);
+	}
+	
+	uint8_t simServoPin(uint8_t channel){
+		uint8_t level = 0;
+		
+		#define SERVO_LEVEL(n) level = (IO_PORT(CH##n##_SERVO_IO) >> CH##n##_SERVO_BIT) & 1
+		CH_DISPATCH(channel, SERVO_LEVEL);
+		#undef SERVO_LEVEL
+		return level;
+	}
+	
+	// Un cuadro del Timer1: la captura sube el primer pulso y cada comparacin A corta uno y
+	// sube el siguiente. Se mide en los pines el ancho que ve cada servo.
+	void simServoFrame(void){
+		uint16_t rise[CHANNELS] = {0};
+		uint8_t wasHigh[CHANNELS];
+		
+		TCNT1 = 0;
+		TIMER1_CAPT_vect();
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			wasHigh[ch] = simServoPin(ch);
+		}
+		for(uint8_t n=0;n<=CHANNELS && (TIMSK & (1<<OCIE1A)) && OCR1A <= ICR1;n++){
+			uint16_t at = OCR1A;
+			TCNT1 = at;
+			TIMER1_COMPA_vect();
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				uint8_t high = simServoPin(ch);
+				if(wasHigh[ch] && !high){
+					sim->servoUs[ch] = (at - rise[ch])/SERVO_TICKS_PER_US;
+				}
+				else if(!wasHigh[ch] && high){
+					rise[ch] = at;
+				}
+				wasHigh[ch] = high;
+			}
+		}
+	}
+	
+	// Generador propio en memoria compartida: rand() se repetira igual en cada hijo.
+	uint32_t simSoakRandom(uint32_t low, uint32_t high){
+		sim->soakSeed = sim->soakSeed*1103515245UL + 12345;
+		return low + (sim->soakSeed >> 8) % (high - low + 1);
+	}
+	
+	// Hora del DS3231 en segundos de la poca del firmware.
+	uint32_t simRtcEpoch(void){
+		return sim->rtcBase + sim->micros/1000000 - 946684800L;
+	}
+	
+	#if NET
+	// Un paso del TWI esclavo: el hardware deja el estado y levanta TWINT, corre la interrupcin
+	// y regresa si reconocer el siguiente byte (TWEA).
+	uint8_t simTwiStep(uint8_t status){
+		TWSR = status;
+		TWCR |= (1<<TWINT);
+		TWI_vect();
+		TWCR &= ~(1<<TWINT);				// La interrupcin lo escribi en 1: el hardware lo baja.
+		return (TWCR >> TWEA) & 1;
+	}
+	
+	// El equipo con la direccin de la transaccin pendiente la corre con los estados de TWSR que
+	// dara el hardware. Fuera de la red (EN en bajo: es maestro de su bus) o sin TWEA (publicando)
+	// no reconoce la direccin. Un byte rechazado termina la escritura: el coordinador manda STOP.
+	void simNetRespond(void){
+		struct simNetBus *bus = simNet;
+		
+		// Un TWINT escrito en 1 (Net_Attach) se borra; con TWIE no queda ninguno pendiente.
+		if(TWCR & (1<<TWIE)){
+			TWCR &= ~(1<<TWINT);
+		}
+		if(!bus || bus->state != SIM_NET_POSTED || bus->address != TWAR >> 1
+				|| !__sync_bool_compare_and_swap(&bus->state, SIM_NET_POSTED, SIM_NET_RUNNING)){
+			return;
+		}
+		bus->written = bus->readAcked = 0;
+		if((TWCR & (1<<TWEA)) && (TWCR & (1<<TWIE)) && (NET_EN_PORT & (1<<NET_EN_PIN))){
+			uint8_t ack = simTwiStep(NET_SLA_W), n = 0;
+			bus->written = 1;
+			while(n < bus->writeLen && ack){
+				TWDR = bus->data[n++];
+				ack = simTwiStep(NET_DATA);
+				bus->written++;
+			}
+			if(n < bus->writeLen){
+				TWDR = bus->data[n];
+				simTwiStep(NET_DATA_NACK);
+			}
+			else{
+				simTwiStep(NET_STOP);
+				if(bus->readLen && (TWCR & (1<<TWEA))){
+					simTwiStep(NET_SLA_R);
+					for(uint8_t i=0;i<bus->readLen;i++){
+						bus->data[i] = TWDR;
+						simTwiStep(i + 1 < bus->readLen ? NET_SENT : NET_SENT_NACK);
+					}
+					bus->readAcked = 1;
+				}
+			}
+		}
+		__sync_synchronize();
+		bus->state = SIM_NET_DONE;
+	}
+	#endif
+	
+	void simAdvanceUs(uint32_t us){
+		sim->micros += us;
+		if(sim->realTime && sim->micros >= sim->paceNext){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t ahead = (int64_t)sim->micros - ((now.tv_sec - sim->paceStart.tv_sec)*1000000LL
+				+ (now.tv_nsec - sim->paceStart.tv_nsec)/1000);
+			if(ahead > 0){
+				usleep(ahead);
+			}
+			sim->paceNext = sim->micros + SIM_PACE_US;
+		}
+		if(sim->soakDays){
+			// Profundidad de la pila (la del host, no la del AVR): no debe crecer con los das.
+			uint8_t probe;
+			uintptr_t depth = sim->stackTop - (uintptr_t)&probe;
+			if(depth > sim->stackDeepest){
+				sim->stackDeepest = depth;
+				if(sim->micros < SECONDS_PER_DAY*1000000ULL){
+					sim->stackFirstDay = depth;
+				}
+			}
+			if(sim->micros >= sim->soakNextCut){
+				sim->soakNextCut = sim->micros + simSoakRandom(SIM_SOAK_CUT_MIN_S, SIM_SOAK_CUT_MAX_S)*1000000ULL;
+				sim->soakOffUs = simSoakRandom(1, SIM_SOAK_OFF_MAX_S)*1000000ULL;
+				sim->soakCuts++;
+				simReset(PORF);
+			}
+		}
+		while(sim->nextFrame <= sim->micros){
+			sim->nextFrame += sim->frameUs;
+			if(TIMSK & (1<<TICIE1)){
+				simServoFrame();
+			}
+			
+			// Con la compuerta abierta cae comida de la tolva; llega al plato SIM_CHUTE_FRAMES despus.
+			sim->chutePos = (sim->chutePos + 1) % SIM_CHUTE_FRAMES;
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				sim->bowlGrams[ch] += sim->chute[ch][sim->chutePos];
+				sim->chute[ch][sim->chutePos] = 0;
+				if(!(sim->jammed & (1<<ch)) && sim->servoUs[ch] >= (SERVO_CLOSED_US+SERVO_OPEN_US)/2 && sim->hopperGrams[ch] > 0){
+					float flow = sim->hopperGrams[ch] < SIM_FLOW_PER_FRAME ? sim->hopperGrams[ch] : SIM_FLOW_PER_FRAME;
+					sim->hopperGrams[ch] -= flow;
+					sim->chute[ch][sim->chutePos] = flow*(1 - sim->spill);
+					if(!sim->flowFirst){
+						sim->flowFirst = sim->micros;
+					}
+					sim->flowLast = sim->micros;
+				}
+			}
+		}
+		TCNT1 = (sim->micros - (sim->nextFrame - sim->frameUs)) * (SERVO_FRAME_US*SERVO_TICKS_PER_US/sim->frameUs);
+		
+	#if USART_USED
+		// USART: un byte por SIM_UART_BYTE_US mientras su interrupcin est encendida. La
+		// interrupcin escribe UDR (8 bits) solo si tena algo que mandar.
+		while((UCSRB & (1<<UDRIE)) && simUartFree <= sim->micros){
+			UDR = 0x100;
+			USART_UDRE_vect();
+			if(UDR > 0xFF){
+				break;
+			}
+		#if TRACE
+			if(simTraceOut){
+				fputc(UDR, simTraceOut);
+			}
+		#else
+			uint8_t byte = UDR;
+			if(simLinkFd >= 0 && write(simLinkFd, &byte, 1) < 0){
+				// Sin cliente en la pty: el byte se pierde como en un cable suelto.
+			}
+		#endif
+			simUartFree = (simUartFree + SIM_UART_BYTE_US > sim->micros ? simUartFree : sim->micros) + SIM_UART_BYTE_US;
+		}
+	#endif
+	#if LINK
+		// Lo que escribe el cliente en la pty entra de a un byte por SIM_UART_BYTE_US.
+		if(simLinkFd >= 0 && (UCSRB & (1<<RXCIE)) && simRxNext <= sim->micros){
+			uint8_t byte;
+			simRxNext = sim->micros + SIM_UART_BYTE_US;
+			if(read(simLinkFd, &byte, 1) == 1){
+				UDR = byte;
+				USART_RXC_vect();
+			}
+		}
+	#endif
+	#if NET
+		simNetRespond();
+	#endif
+		
+		if(simWdtEnabled && sim->micros - simWdtFed > simWdtTimeout){
+			simReset(WDRF);
+		}
+		if(sim->resetNext < sim->resetCount && sim->micros >= sim->resetAt[sim->resetNext]){
+			simReset(sim->resetCause[sim->resetNext++]);
+		}
+		if(sim->micros >= sim->endMicros){
+			simFinish();
+		}
+	}
+	
+	void _delay_ms(double ms){
+		simAdvanceUs((uint32_t)(ms*1000));
+	}
+	
+	void _delay_us(double us){
+		simAdvanceUs((uint32_t)us);
+	}
+	
+	// Watchdog: WDTO_x equivale a 16 ms * 2^x.
+	void wdt_enable(uint8_t timeout){
+		simWdtEnabled = 1;
+		simWdtTimeout = 16384ULL << timeout;
+		simWdtFed = sim->micros;
+	}
+	
+	void wdt_reset(void){
+		simWdtFed = sim->micros;
+	}
+	
+	// LCD: decodifica el protocolo de 4 bits igual que el HD44780.
+	void simLcdByte(uint8_t data, uint8_t rs){
+		if(rs){
+			uint8_t line = sim->lcdAddr >= 0x40, col = sim->lcdAddr & 0x3F;
+			if(col < 16){
+				sim->lcd[line][col] = data;
+			}
+			sim->lcdAddr++;
+		}
+		else if(data == LCD_Cmd_Clear){
+			memset(sim->lcd, ' ', sizeof(sim->lcd));
+			sim->lcd[0][16] = sim->lcd[1][16] = 0;
+			sim->lcdAddr = 0;
+		}
+		else if(data & 0x80){
+			sim->lcdAddr = data & 0x7F;
+		}
+	}
+	
+	void LCD_wr_nibble(uint8_t nibble, uint8_t rs){
+		nibble &= 0x0F;
+		if(!sim->lcdFourBit){
+			sim->lcdFourBit = (nibble == 0b0010);
+			return;
+		}
+		if(!sim->lcdHalf){
+			sim->lcdHigh = nibble;
+			sim->lcdHalf = 1;
+			return;
+		}
+		sim->lcdHalf = 0;
+		simLcdByte((sim->lcdHigh<<4)|nibble, rs);
+		simAdvanceUs(40);
+	}
+	
+	void LCD_wait_flag(void){
+	}
+	
+	// EEPROM.
+	void EEPROM_write(volatile uint16_t dir, volatile uint8_t data){
+		if(sim->eeCutAt && ++sim->eeWrites == sim->eeCutAt){
+			simReset(PORF);							// Se va la luz antes de que el byte quede escrito.
+		}
+		// Prueba de resistencia: checkAlarms escribe el da atendido (el byte alto al final).
+		if(sim->soakDays && dir >= EE_ALARM_FIRED && dir < EE_ALARM_FIRED + ALARM_BITS && (dir & 1)){
+			uint16_t day = sim->eeprom[dir - 1] | data << 8;
+			if(day >= sim->soakFirstDay && day - sim->soakFirstDay < SIM_SOAK_DAYS){
+				uint8_t *fired = &sim->soakFired[(dir - EE_ALARM_FIRED)/2][day - sim->soakFirstDay];
+				if(*fired < 255){
+					(*fired)++;
+				}
+			}
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				if(sim->hopperGrams[ch] < SIM_SOAK_REFILL){
+					sim->hopperGrams[ch] = 500;
+					sim->soakRefills++;
+				}
+				sim->bowlGrams[ch] = 0;
+			}
+		}
+		sim->eeprom[dir & 511] = data;
+		simAdvanceUs(8500);
+	}
+	
+	uint8_t EEPROM_read(uint16_t dir){
+		PROFILE_BEGIN(PROF_EEPROM_READ);
+		PROFILE_RETURN(PROF_EEPROM_READ, sim->eeprom[dir & 511]);
+	}
+	
+	uint8_t EEPROM_busy(){
+		return 0;								// EEPROM_write ya esper los 8.5 ms.
+	}
+	
+	// Temperatura junto a la tolva: HX_DEFAULT_TEMP ms una onda diaria con el mximo a las 15:00.
+	float simTemperature(void){
+		time_t now = sim->rtcBase + sim->micros/1000000;
+		return HX_DEFAULT_TEMP + sim->tempSwing*sin(2*M_PI*((now % 86400) - 9*3600L)/86400.0);
+	}
+	
+	// DS3231. Cada lectura de la hora tambin mide qu tan lejos queda el cero compensado del
+	// firmware del peso real (sin ruido) con la temperatura de ese momento.
+	void simRtcLoad(void){
+		time_t now = sim->rtcBase + sim->micros/1000000;
+		struct tm t;
+		gmtime_r(&now, &t);
+		long quarters = lroundf(simTemperature()*4);
+		simRtcRegs[0x11] = (quarters >> 2) & 0xFF;
+		simRtcRegs[0x12] = (quarters & 3) << 6;
+		for(uint8_t ch=0;ch<CHANNELS && sim->tempSwing && rtcTemperature != HX_TEMP_NONE;ch++){
+			float count = SIM_HX_ZERO + sim->hopperGrams[ch]*SIM_HX_PER_GRAM + SIM_HX_DRIFT*(simTemperature() - HX_DEFAULT_TEMP);
+			float offset = HX_COUNT_ZERO + (Hx711_Offset(ch) - HX_COUNT_ZERO)/HX_GAIN_FACTOR(channels[ch].gain);
+			float error = fabsf((count - offset)/channels[ch].scale - sim->hopperGrams[ch]);
+			float *worst = &sim->tempWorst[ch][sim->micros >= SECONDS_PER_DAY*1000000ULL];
+			if(error > *worst){
+				*worst = error;
+			}
+		}
+		simRtcRegs[0] = DEC_To_BCD(t.tm_sec);
+		simRtcRegs[1] = DEC_To_BCD(t.tm_min);
+		simRtcRegs[2] = DEC_To_BCD(t.tm_hour);
+		simRtcRegs[3] = t.tm_wday + 1;
+		simRtcRegs[4] = DEC_To_BCD(t.tm_mday);
+		simRtcRegs[5] = DEC_To_BCD(t.tm_mon + 1);
+		simRtcRegs[6] = DEC_To_BCD(t.tm_year % 100);
+	}
+	
+	void simRtcStore(void){
+		struct tm t = {0};
+		t.tm_sec = BCD_To_DEC(simRtcRegs[0]);
+		t.tm_min = BCD_To_DEC(simRtcRegs[1]);
+		t.tm_hour = BCD_To_DEC(simRtcRegs[2]);
+		t.tm_mday = BCD_To_DEC(simRtcRegs[4]);
+		t.tm_mon = BCD_To_DEC(simRtcRegs[5]) - 1;
+		t.tm_year = BCD_To_DEC(simRtcRegs[6]) + 100;
+		sim->rtcBase = timegm(&t) - sim->micros/1000000;
+	}
+	
+	// Bus I2C: 0 libre, 1 esperando direccin, 2 escribiendo al DS3231, 3 leyendo del DS3231,
+	// 4 sin respuesta, 5 escribiendo al AT24C32, 6 leyendo del AT24C32.
+	void I2C_Init(){
+	}
+	
+	void I2C_Start(){
+		NET_DETACH();
+		simI2cState = 1;
+		simAdvanceUs(10);
+	}
+	
+	// AT24C32: los dos primeros bytes son la posicin; los datos van a la pgina de esa posicin
+	// y dan la vuelta dentro de ella. Se graban con el STOP.
+	void simAt24Write(uint8_t data){
+		if(simAt24Count < 2){
+			sim->at24Address = simAt24Count ? (sim->at24Address & 0xF00) | data : (data & 0x0F) << 8;
+			simAt24Count++;
+			return;
+		}
+		uint8_t offset = sim->at24Address & (AT24_PAGE - 1);
+		simAt24Latch[offset] = data;
+		simAt24Mask |= 1UL << offset;
+		sim->at24Address = (sim->at24Address & ~(AT24_PAGE - 1)) | ((offset + 1) & (AT24_PAGE - 1));
+		simAt24Count++;
+	}
+	
+	uint8_t I2C_Write(uint8_t data){
+		simAdvanceUs(SIM_I2C_BYTE_US);
+		if(simI2cState == 1){
+			uint8_t read = data & 1;
+			if(data >> 1 == 0x68){
+				simI2cState = read ? 3 : 2;
+			}
+			else if(data >> 1 == AT24_ADDRESS >> 1 && sim->micros >= sim->at24BusyUntil){
+				simI2cState = read ? 6 : 5;
+				simAt24Count = 0;
+				simAt24Mask = 0;
+			}
+			else{
+				simI2cState = 4;					// Nadie con esa direccin, o el AT24C32 grabando.
+				sim->at24Polls += data >> 1 == AT24_ADDRESS >> 1;
+			}
+			simI2cAddr = data;
+			if(simI2cState == 3){
+				simRtcLoad();
+			}
+			return simI2cState != 4;
+		}
+		if(simI2cState == 5){
+			simAt24Write(data);
+			return 1;
+		}
+		if(simI2cState != 2){
+			return 0;
+		}
+		if(simI2cAddr == 0xD0 && !(simRtcDirty & 0x80)){
+			simRtcPointer = data;					// Primer byte: apuntador de registro.
+			simRtcDirty |= 0x80;
+			return 1;
+		}
+		if(simRtcPointer < sizeof(simRtcRegs)){
+			if(simRtcPointer == 0){
+				simRtcLoad();
+			}
+			simRtcRegs[simRtcPointer] = data;
+			simRtcDirty |= 1;
+		}
+		simRtcPointer++;
+		return 1;
+	}
+	
+	uint8_t simI2cRead(void){
+		simAdvanceUs(SIM_I2C_BYTE_US);
+		if(simI2cState == 6){
+			uint8_t data = sim->at24[sim->at24Address];
+			sim->at24Address = (sim->at24Address + 1) & (AT24_SIZE - 1);
+			return data;
+		}
+		if(simI2cState != 3){
+			return 0xFF;
+		}
+		uint8_t data = simRtcPointer < sizeof(simRtcRegs) ? simRtcRegs[simRtcPointer] : 0xFF;
+		simRtcPointer++;
+		return data;
+	}
+	
+	uint8_t I2C_Read_Acknoledgement(){
+		return simI2cRead();
+	}
+	
+	uint8_t I2C_Read_Not_Acknoledgement(){
+		return simI2cRead();
+	}
+	
+	// Hardware del TWI al poner la condicin de parada: baja TWSTO cuando sale al bus. Un esclavo
+	// que detiene SCL (-H) la retiene y deja a TWSTO arriba.
+	void simTwiStop(void){
+		if(sim->micros >= sim->hangFrom && sim->micros < sim->hangUntil){
+			simAdvanceUs(100);
+			return;
+		}
+		simAdvanceUs(10);
+		TWCR &= ~(1<<TWSTO);
+	}
+	
+	void I2C_Stop(){
+		// Igual que el firmware: pone TWSTO y espera a que el hardware lo baje.
+		TWCR = (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
+		while(TWCR & (1<<TWSTO)){
+			simTwiStop();
+		}
+		if(simRtcDirty & 1){
+			simRtcStore();
+		}
+		if(simI2cState == 5 && simAt24Mask){
+			uint16_t page = sim->at24Address & ~(AT24_PAGE - 1);
+			for(uint8_t i=0;i<AT24_PAGE;i++){
+				if(simAt24Mask & (1UL << i)){
+					sim->at24[page + i] = simAt24Latch[i];
+				}
+			}
+			sim->at24BusyUntil = sim->micros + SIM_AT24_WRITE_US;
+			sim->at24Pages++;
+			sim->at24Bytes += simAt24Count - 2;
+		}
+		simRtcDirty = 0;
+		simI2cState = 0;
+		NET_ATTACH();
+	}
+	
+	// Hx711 de cada tolva: registro de corrimiento de 24 bits en complemento a dos. Cada flanco
+	// de subida saca el siguiente bit; a partir del pulso 25 DOUT queda en alto hasta la
+	// siguiente conversin. Todos convierten a la vez, cada uno a su ritmo, con el periodo
+	// que marca el pin RATE. Los pulsos de una lectura (25, 26 o 27) eligen canal y ganancia
+	// de la siguiente; el canal B tiene la celda del plato. Tras cambiar de canal las primeras
+	// conversiones mezclan las dos entradas y la cuarta ya sale limpia (se cuentan lecturas,
+	// no conversiones: el firmware lee todas mientras alterna).
+	uint8_t simHxDout(uint8_t channel){
+		if(simHxReading[channel] && simHxPulses[channel] < 25){
+			return (simHxShift[channel] >> (24 - simHxPulses[channel])) & 1;
+		}
+		if(sim->micros < sim->hxNextReady[channel]){
+			simAdvanceUs(50);						// Esperar la conversin consume tiempo virtual.
+			return 1;
+		}
+		simHxReading[channel] = 0;
+		return 0;
+	}
+	
+	void simHxClock(uint8_t channel, uint8_t level){
+		if(level && !simHxSck[channel]){
+			if(!simHxReading[channel] && sim->micros >= sim->hxNextReady[channel]){
+				uint8_t fast = PORTB & (1<<HX_RATE_PIN);
+				int noise = fast ? SIM_HX_FAST_NOISE : SIM_HX_NOISE;
+				float input = SIM_HX_ZERO - HX_COUNT_ZERO + sim->hopperGrams[channel]*SIM_HX_PER_GRAM
+					+ SIM_HX_DRIFT*(simTemperature() - HX_DEFAULT_TEMP);
+				
+				uint8_t bowl = simHxGain[channel] == HX_GAIN_B32;
+				if(bowl){
+					input = (SIM_BOWL_ZERO - HX_COUNT_ZERO + sim->bowlGrams[channel]*SIM_HX_PER_GRAM)/4;
+				}
+				else if(simHxGain[channel] == HX_GAIN_A64){
+					input /= 2;
+				}
+				if(bowl != simHxInput[channel]){
+					simHxInput[channel] = bowl;
+					simHxMixing[channel] = HX_SETTLE_CONVERSIONS - 1;
+				}
+				if(simHxMixing[channel]){
+					input = simHxLast[channel] + (input - simHxLast[channel])*(HX_SETTLE_CONVERSIONS - simHxMixing[channel])/HX_SETTLE_CONVERSIONS;
+					simHxMixing[channel]--;
+				}
+				simHxLast[channel] = input;
+				long count = HX_COUNT_ZERO + (long)input + (rand() % (2*noise + 1)) - noise;
+				
+				// Muestras corruptas: pico por vibracin, saturacin o un reloj perdido (bits corridos).
+				if(sim->hxCorruptEvery && ++sim->hxConversions % sim->hxCorruptEvery == 0){
+					switch(sim->hxConversions / sim->hxCorruptEvery % 3){
+						case 0: count += 200000; break;
+						case 1: count = rand() & 1 ? HX_COUNT_MAX : HX_COUNT_MIN; break;
+						case 2: count = count << 1; break;
+					}
+				}
+				if(count < 0) count = 0;
+				if(count > 0xFFFFFF) count = 0xFFFFFF;
+			#if TRACE
+				if(simReplay){
+					count = simReplayHx(channel);
+				}
+			#endif
+				simHxShift[channel] = (uint32_t)count ^ 0x800000;
+				simHxReading[channel] = 1;
+				simHxPulses[channel] = 0;
+			}
+			if(simHxReading[channel] && ++simHxPulses[channel] >= 25){
+				simHxGain[channel] = simHxPulses[channel];
+				if(simHxPulses[channel] == 25){
+					sim->hxNextReady[channel] = sim->micros + ((PORTB & (1<<HX_RATE_PIN)) ? SIM_HX_FAST_US : SIM_HX_PERIOD_US);
+				}
+			}
+		}
+		simHxSck[channel] = level;
+		simAdvanceUs(1);
+	}
+	
+	// Cambio de horario de la prueba de resistencia: se adelanta a las 02:00 y se atrasa a las
+	// 03:00 con SetTimeDate, como lo hara el dueo desde una pantalla. Planea el siguiente.
+	void simSoakShift(void){
+		uint32_t now = simRtcEpoch();
+		
+		if(sim->soakShiftHours){
+			Clock_Split(now + sim->soakShiftHours*3600L);	// Deja la hora nueva en los campos mostrados.
+			SetTimeDate(minutes, hours, date, month, year);
+			sim->soakShifts++;
+			now = simRtcEpoch();
+		}
+		sim->soakShiftHours = sim->soakShiftHours > 0 ? -1 : 1;
+		uint32_t at = (now/SECONDS_PER_DAY + SIM_SOAK_SHIFT_DAYS)*SECONDS_PER_DAY + (sim->soakShiftHours > 0 ? 2 : 3)*3600UL;
+		sim->soakNextShift = sim->micros + (uint64_t)(at - now)*1000000ULL;
+	}
+	
+	// Botones: cada pulsacin dura 100 ms salvo que se indique otra duracin. Es el punto de
+	// espera de las pantallas: en la prueba de resistencia adelanta el tiempo de a poco y
+	// aplica los cambios de hora.
+	uint8_t simButtonDown(uint8_t bit){
+		uint32_t nowMs = sim->micros/1000;
+		if(sim->soakDays){
+			if(sim->micros >= sim->soakNextShift){
+				simSoakShift();
+			}
+			simAdvanceUs(SIM_SOAK_POLL_US);
+			return 0;								// Sin pulsaciones: nadie toca el equipo.
+		}
+		simAdvanceUs(20);
+		for(uint8_t i=0;i<sim->pressCount;i++){
+			if(sim->pressBtn[i] == bit && nowMs >= sim->pressAt[i] && nowMs < sim->pressAt[i]+sim->pressMs[i]){
+				return 1;
+			}
+		}
+		return 0;
+	}
+	
+	// CRC-16 de las tramas del enlace, igual que _crc_xmodem_update de avr-libc.
+	uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data){
+		crc ^= (uint16_t)data << 8;
+		for(uint8_t i=0;i<8;i++){
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+		return crc;
+	}
+	
+	// Registro de comidas desde head (el ms viejo primero); los lugares vacos se saltan.
+	void simMealLogPrint(const uint8_t *log, uint16_t head){
+		int count = 0;
+		
+		for(uint16_t i=0;i<AT24_SIZE;i+=MEAL_RECORD){
+			const uint8_t *r = log + ((head + i) & (AT24_SIZE - 1));
+			uint32_t epoch = r[0] | r[1] << 8 | r[2] << 16 | (uint32_t)r[3] << 24;
+			if(epoch == MEAL_EMPTY){
+				continue;
+			}
+			Clock_Split(epoch);
+			printf("  20%02u-%02u-%02u %02u:%02u:%02u  tolva %u: %d g  resultado %u  %u ciclos\n", year, month, date,
+				hours, minutes, seconds, (r[4] >> 4) + 1, (int16_t)(r[5] | r[6] << 8), r[4] & 0x0F, r[7]);
+			count++;
+		}
+		printf("Registro de comidas: %d registros\n", count);
+	}
+	
+	// Pty del enlace (-Q): el cliente abre path como si fuera el puerto serie del equipo. El
+	// simulador deja abierto el otro extremo para que leer no falle mientras no haya cliente.
+	int simLinkOpen(const char *path){
+		int fd = posix_openpt(O_RDWR|O_NOCTTY);
+		struct termios t;
+		
+		if(fd < 0 || grantpt(fd) || unlockpt(fd)){
+			return -1;
+		}
+		const char *name = ptsname(fd);
+		int other = open(name, O_RDWR|O_NOCTTY);
+		if(other < 0 || tcgetattr(other, &t)){
+			return -1;
+		}
+		cfmakeraw(&t);
+		tcsetattr(other, TCSANOW, &t);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		unlink(path);
+		if(symlink(name, path)){
+			return -1;
+		}
+		printf("Enlace en %s (%s), tiempo real\n", path, name);
+		
+		return fd;
+	}
+	
+	// Cliente del enlace (-U): habla con el equipo por un puerto serie o con el simulador por la
+	// pty de -Q. Escribir primero lee la configuracin y solo cambia las secciones que se piden.
+	int simLinkPort(const char *path){
+		int fd = open(path, O_RDWR|O_NOCTTY);
+		struct termios t;
+		
+		if(fd < 0 || tcgetattr(fd, &t)){
+			return -1;
+		}
+		cfmakeraw(&t);
+		cfsetispeed(&t, B38400);
+		cfsetospeed(&t, B38400);
+		t.c_cflag |= CLOCAL|CREAD;
+		t.c_cc[VMIN] = 0;
+		t.c_cc[VTIME] = 1;
+		tcsetattr(fd, TCSANOW, &t);
+		tcflush(fd, TCIOFLUSH);
+		
+		return fd;
+	}
+	
+	// Manda una trama y espera la respuesta a ese comando. Deja los datos (el estado primero) en
+	// reply y regresa su largo, o -1 si no lleg una respuesta vlida a tiempo.
+	int simLinkRequest(int fd, uint8_t command, const uint8_t *data, uint8_t len, uint8_t *reply){
+		uint8_t frame[3 + LINK_MAX_DATA + 2], got[2 + LINK_MAX_DATA + 2], fill = 0;
+		uint16_t crc = 0;
+		int n = 0;
+		struct timespec start, now;
+		
+		frame[n++] = LINK_START;
+		frame[n++] = command;
+		frame[n++] = len;
+		memcpy(frame + n, data, len);
+		n += len;
+		for(int i=1;i<n;i++){
+			crc = _crc_xmodem_update(crc, frame[i]);
+		}
+		frame[n++] = crc >> 8;
+		frame[n++] = crc & 0xFF;
+		if(write(fd, frame, n) != n){
+			return -1;
+		}
+		
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		now = start;								// El continue de abajo salta a la condicin.
+		do{
+			uint8_t byte;
+			if(read(fd, &byte, 1) == 1){
+				if(!fill){
+					fill = byte == LINK_START;
+					continue;
+				}
+				got[fill++ - 1] = byte;
+				if(fill == 3 && got[1] > LINK_MAX_DATA){
+					fill = 0;
+				}
+				else if(fill == 5 + got[1]){
+					crc = 0;
+					for(int i=0;i<2+got[1];i++){
+						crc = _crc_xmodem_update(crc, got[i]);
+					}
+					if(got[0] == (command | LINK_REPLY) && crc == (got[2+got[1]] << 8 | got[3+got[1]])){
+						memcpy(reply, got + 2, got[1]);
+						return got[1];
+					}
+					fill = 0;
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}while((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000 < SIM_LINK_TIMEOUT_MS);
+		
+		return -1;
+	}
+	
+	void simLinkPrint(const uint8_t *block, uint8_t count){
+		int16_t food;
+		uint32_t epoch;
+		
+		for(uint8_t i=0;i<ALARM_BITS/2;i++){
+			const uint8_t *alarm = block + CFG_ALARMS + 3*i;
+			if(alarm[0] == 255){
+				printf("Alarma %u: -\n", i+1);
+				continue;
+			}
+			printf("Alarma %u: %02u:%02u ", i+1, alarm[0], alarm[1]);
+			if(alarm[2] == 255 || (alarm[2] & ((1<<count) - 1)) == (1<<count) - 1){
+				printf("todas\n");
+			}
+			else{
+				printf("tolvas");
+				for(uint8_t ch=0;ch<count;ch++){
+					if(alarm[2] & (1<<ch)){
+						printf(" %u", ch+1);
+					}
+				}
+				printf("\n");
+			}
+		}
+		memcpy(&food, block + CFG_MAX_FOOD, 2);
+		memcpy(&epoch, block + CFG_CLOCK, 4);
+		Clock_Split(epoch);
+		printf("Tope de comida: %d g\n", food);
+		printf("Reloj: 20%02u-%02u-%02u %02u:%02u:%02u\n", year, month, date, hours, minutes, seconds);
+		for(uint8_t ch=0;ch<count;ch++){
+			float calibration[2];
+			memcpy(calibration, block + CFG_CALIBRATION + 8*ch, 8);
+			printf("Tolva %u: offset %.1f  escala %.3f\n", ch+1, calibration[0], calibration[1]);
+		}
+	}
+	
+	int simLinkCli(int argc, char **argv){
+		static const char *const errors[] = {"ok", "CRC", "comando desconocido", "largo", "valor fuera de rango", "sin EEPROM externa"};
+		uint8_t reply[LINK_MAX_DATA], block[LINK_MAX_DATA];
+		int fd = argc > 3 ? simLinkPort(argv[2]) : -1, n;
+		
+		if(argc <= 3 || (strcmp(argv[3], "leer") && strcmp(argv[3], "escribir") && strcmp(argv[3], "comidas")
+				&& strcmp(argv[3], "muestras"))){
+			printf("uso: %s -U puerto leer|comidas|muestras [segundos]\n"
+				   "       %s -U puerto escribir [-a HH:MM[:tolva]|-]... [-m gramos] [-c tolva:offset:escala]...\n"
+				   "          [-r [AAAA-MM-DDTHH:MM:SS] (sin fecha: la hora de esta PC)]\n"
+				   "  Las -a reemplazan la tabla de alarmas completa (-a - la deja vacia).\n", argv[0], argv[0]);
+			return 1;
+		}
+		if(fd < 0){
+			printf("No se pudo abrir %s\n", argv[2]);
+			return 1;
+		}
+		if(!strcmp(argv[3], "muestras")){
+			struct timespec from, now;
+			double seconds = argc > 4 ? atof(argv[4]) : 5;
+			int total = 0, lost = 0;
+			
+			clock_gettime(CLOCK_MONOTONIC, &from);
+			do{
+				n = simLinkRequest(fd, LINK_CMD_SAMPLES, NULL, 0, reply);
+				if(n < 2 || reply[0] != LINK_OK || (n - 2) % LINK_SAMPLE){
+					printf("Sin respuesta valida del equipo: %s\n", n > 0 && reply[0] <= LINK_NO_DEVICE ? errors[reply[0]] : "?");
+					return 1;
+				}
+				lost += reply[1];
+				for(int at=2;at<n;at+=LINK_SAMPLE){
+					const uint8_t *r = reply + at;
+					uint32_t stamp = r[0] | r[1] << 8 | r[2] << 16 | (uint32_t)r[3] << 24;
+					printf("%11.3f s  %s %u  %7.1f g%s\n", stamp/1000.0, r[4] & ACQ_BOWL ? "plato" : "tolva", (r[4] & ACQ_CHANNEL) + 1,
+						(int16_t)(r[5] | r[6] << 8)/10.0, r[4] & ACQ_SERVO ? "  servo" : "");
+					total++;
+				}
+				usleep(50000);
+				clock_gettime(CLOCK_MONOTONIC, &now);
+			}while(now.tv_sec - from.tv_sec + (now.tv_nsec - from.tv_nsec)/1e9 < seconds);
+			printf("%d muestras, %d perdidas\n", total, lost);
+			return 0;
+		}
+		if(!strcmp(argv[3], "comidas")){
+			uint8_t log[AT24_SIZE], request[3];
+			for(uint16_t at=0;at<AT24_SIZE;at+=LINK_LOG_CHUNK){
+				uint8_t count = AT24_SIZE - at < LINK_LOG_CHUNK ? AT24_SIZE - at : LINK_LOG_CHUNK;
+				request[0] = at & 0xFF;
+				request[1] = at >> 8;
+				request[2] = count;
+				n = simLinkRequest(fd, LINK_CMD_LOG, request, 3, reply);
+				if(n < 1 || reply[0] != LINK_OK || n != 3 + count){
+					printf("Sin respuesta valida del equipo: %s\n", n > 0 && reply[0] <= LINK_NO_DEVICE ? errors[reply[0]] : "?");
+					return 1;
+				}
+				memcpy(log + at, reply + 3, count);
+			}
+			simMealLogPrint(log, reply[1] | reply[2] << 8);
+			return 0;
+		}
+		n = simLinkRequest(fd, LINK_CMD_READ, NULL, 0, reply);
+		if(n < 1 + CFG_CALIBRATION + 8 || reply[0] != LINK_OK || (n - 1 - CFG_CALIBRATION) % 8){
+			printf("Sin respuesta valida del equipo\n");
+			return 1;
+		}
+		uint8_t size = n - 1, count = (size - CFG_CALIBRATION)/8;
+		memcpy(block, reply + 1, size);
+		if(!strcmp(argv[3], "leer")){
+			simLinkPrint(block, count);
+			return 0;
+		}
+		
+		block[CFG_SECTIONS] = 0;
+		for(int i=4;i<argc;i++){
+			int h, m, ch = 0, y, mo, d, sec;
+			double offset, scale;
+			if(!strcmp(argv[i], "-a") && i+1 < argc){
+				if(!(block[CFG_SECTIONS] & CFG_SEC_ALARMS)){
+					memset(block + CFG_ALARMS, 255, 3*ALARM_BITS/2);
+					block[CFG_SECTIONS] |= CFG_SEC_ALARMS;
+				}
+				if(!strcmp(argv[++i], "-")){
+					continue;
+				}
+				uint8_t j = 0;
+				while(j < ALARM_BITS/2 && block[CFG_ALARMS + 3*j] != 255){
+					j++;
+				}
+				if(sscanf(argv[i], "%d:%d", &h, &m) != 2 || j == ALARM_BITS/2){
+					printf("Alarma invalida o sin lugar: %s\n", argv[i]);
+					return 1;
+				}
+				sscanf(argv[i], "%*d:%*d:%d", &ch);
+				block[CFG_ALARMS + 3*j] = h;
+				block[CFG_ALARMS + 3*j + 1] = m;
+				block[CFG_ALARMS + 3*j + 2] = ch > 0 ? 1<<(ch - 1) : 255;
+			}
+			else if(!strcmp(argv[i], "-m") && i+1 < argc){
+				int16_t food = atoi(argv[++i]);
+				memcpy(block + CFG_MAX_FOOD, &food, 2);
+				block[CFG_SECTIONS] |= CFG_SEC_LIMITS;
+			}
+			else if(!strcmp(argv[i], "-c") && i+1 < argc && sscanf(argv[++i], "%d:%lf:%lf", &ch, &offset, &scale) == 3
+					&& ch >= 1 && ch <= count){
+				float calibration[2] = {offset, scale};
+				memcpy(block + CFG_CALIBRATION + 8*(ch - 1), calibration, 8);
+				block[CFG_SECTIONS] |= CFG_SEC_CALIBRATION;
+			}
+			else if(!strcmp(argv[i], "-r")){
+				uint32_t epoch;
+				if(i+1 < argc && sscanf(argv[i+1], "%d-%d-%dT%d:%d:%d", &y, &mo, &d, &h, &m, &sec) == 6){
+					epoch = Clock_FromFields(y - 2000, mo, d, h, m, sec);
+					i++;
+				}
+				else{
+					time_t now = time(NULL);
+					struct tm t;
+					localtime_r(&now, &t);
+					epoch = Clock_FromFields(t.tm_year - 100, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+				}
+				memcpy(block + CFG_CLOCK, &epoch, 4);
+				block[CFG_SECTIONS] |= CFG_SEC_CLOCK;
+			}
+			else{
+				printf("Opcion invalida: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		if(!block[CFG_SECTIONS]){
+			printf("Nada que escribir\n");
+			return 1;
+		}
+		
+		n = simLinkRequest(fd, LINK_CMD_WRITE, block, size, reply);
+		if(n < 1){
+			printf("Sin respuesta del equipo: no se sabe si aplico el bloque, vuelva a leer\n");
+			return 1;
+		}
+		if(reply[0] != LINK_OK){
+			printf("El equipo rechazo el bloque: %s\n", reply[0] <= LINK_NO_DEVICE ? errors[reply[0]] : "?");
+			return 1;
+		}
+		printf("Configuracion aplicada\n");
+		
+		return 0;
+	}
+	
+	#if NET
+	// Una transaccin del coordinador desde el registro reg: escribe len bytes de data o, con
+	// read, los lee. Repite mientras el equipo no reconozca su direccin (hasta retries veces);
+	// un byte rechazado no se repite. Regresa 1 si todo se reconoci.
+	uint8_t simNetTransfer(uint8_t address, uint8_t reg, void *data, uint8_t len, uint8_t read, uint16_t retries){
+		for(uint16_t attempt=0;attempt<retries;attempt++){
+			simNet->address = address;
+			simNet->data[0] = reg;
+			simNet->writeLen = read ? 1 : 1 + len;
+			simNet->readLen = read ? len : 0;
+			if(!read){
+				memcpy(simNet->data + 1, data, len);
+			}
+			__sync_synchronize();
+			simNet->state = SIM_NET_POSTED;
+			simNet->transfers++;
+			for(uint32_t waited=0;simNet->state != SIM_NET_DONE && waited < SIM_NET_WAIT_US;waited+=100){
+				usleep(100);
+			}
+			if(!__sync_bool_compare_and_swap(&simNet->state, SIM_NET_POSTED, SIM_NET_IDLE)){
+				while(simNet->state != SIM_NET_DONE){
+					usleep(100);					// El equipo ya la estaba corriendo.
+				}
+				simNet->state = SIM_NET_IDLE;
+				if(simNet->written){
+					if(read && simNet->readAcked){
+						memcpy(data, simNet->data, len);
+					}
+					return read ? simNet->readAcked : simNet->written == 2 + len;
+				}
+			}
+			simNet->retries++;
+			usleep(SIM_NET_RETRY_US);
+		}
+		
+		return 0;
+	}
+	
+	uint8_t simNetRead(uint8_t address, uint8_t reg, void *data, uint8_t len){
+		return simNetTransfer(address, reg, data, len, 1, SIM_NET_RETRIES);
+	}
+	
+	uint8_t simNetWrite(uint8_t address, uint8_t reg, const void *data, uint8_t len){
+		uint8_t copy[SIM_NET_DATA];
+		
+		memcpy(copy, data, len);
+		return simNetTransfer(address, reg, copy, len, 0, SIM_NET_RETRIES);
+	}
+	
+	// Espera a que el equipo atienda lo escrito y regresa su estado (0xFF: no respondi).
+	uint8_t simNetSettle(uint8_t address){
+		uint8_t status = 0xFF;
+		
+		for(int i=0;i<SIM_NET_FEED_S*100;i++){
+			if(!simNetRead(address, NET_REG_STATUS, &status, 1)){
+				return 0xFF;
+			}
+			if(!(status & (NET_ST_PENDING|NET_ST_FEEDING))){
+				break;
+			}
+			usleep(10000);
+		}
+		
+		return status;
+	}
+	
+	// Arranca count equipos (-W), cada uno con su memoria, su direccin y otro peso en las
+	// tolvas, en tiempo real. Regresa 0 en el coordinador y el nmero de equipo en cada uno.
+	uint8_t simNetSpawn(uint8_t count, struct simState **nodes, pid_t *pids){
+		simNet = mmap(NULL, sizeof(*simNet), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		memset(simNet, 0, sizeof(*simNet));
+		for(uint8_t k=0;k<count;k++){
+			struct simState *node = mmap(NULL, sizeof(*sim), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+			memcpy(node, sim, sizeof(*sim));
+			node->eeprom[EE_NET_ADDRESS] = NET_ADDRESS + k;
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				node->hopperGrams[ch] = sim->hopperGrams[ch] - 40*k - 10*ch;
+			}
+			node->realTime = 1;
+			clock_gettime(CLOCK_MONOTONIC, &node->paceStart);
+			nodes[k] = node;
+			
+			fflush(stdout);
+			pid_t pid = fork();
+			if(pid == 0){
+				setpgid(0, 0);						// El equipo y sus arranques: el coordinador los termina juntos.
+				sim = node;
+				return k + 1;
+			}
+			setpgid(pid, pid);
+			pids[k] = pid;
+		}
+		
+		return 0;
+	}
+	
+	// Coordinador de la prueba de la red: identifica a los equipos, lee su peso, les escribe
+	// una alarma, da comida en los pares mientras lee a todos sin pausa, revisa lo que
+	// publicaron contra la tolva y el plato simulados, y prueba rechazos y el cambio de direccin.
+	int simNetCoordinate(uint8_t count, struct simState **nodes, pid_t *pids){
+		uint8_t regs[NET_MAP_SIZE], meals[SIM_NET_NODES], feeding = 0;
+		float dropped[SIM_NET_NODES][CHANNELS], landed[SIM_NET_NODES][CHANNELS];
+		int failures = 0;
+		uint32_t polls = 0;
+		
+		for(uint8_t k=0;k<count;k++){
+			uint8_t address = NET_ADDRESS + k, ok = 0;
+			for(int i=0;i<50 && !ok;i++){
+				ok = simNetRead(address, NET_REG_ID, regs, 4) && regs[NET_REG_ID] == NET_ID
+					&& regs[NET_REG_VERSION] == NET_VERSION && regs[NET_REG_CHANNELS] == CHANNELS;
+				if(!ok){
+					usleep(100000);
+				}
+			}
+			printf("Equipo 0x%02X: %s\n", address, ok ? "responde" : "FALLA: no responde");
+			failures += !ok;
+		}
+		
+		// Peso: la primera lectura enciende la adquisicin del equipo.
+		for(uint8_t k=0;k<count;k++){
+			uint8_t address = NET_ADDRESS + k, ok = 0;
+			int16_t tenths[CHANNELS];
+			for(int i=0;i<50 && !ok;i++){
+				ok = simNetRead(address, NET_REG_WEIGHT, tenths, 2*CHANNELS);
+				for(uint8_t ch=0;ch<CHANNELS;ch++){
+					ok = ok && tenths[ch] != NET_NO_WEIGHT && fabsf(tenths[ch]/10.0f - nodes[k]->hopperGrams[ch]) <= SIM_NET_WEIGHT_G;
+				}
+				usleep(ok ? 0 : 100000);
+			}
+			printf("Equipo 0x%02X: peso", address);
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				printf("  tolva %u %.1f g (real %.1f g)", ch+1, tenths[ch]/10.0, nodes[k]->hopperGrams[ch]);
+			}
+			printf("%s\n", ok ? "" : "  FALLA");
+			failures += !ok;
+		}
+		
+		// Alarmas por la ventana de configuracin: solo esa seccin, leda de vuelta.
+		for(uint8_t k=0;k<count;k++){
+			uint8_t address = NET_ADDRESS + k, block[CFG_SIZE], ok, status;
+			ok = simNetRead(address, NET_REG_CONFIG, block, CFG_SIZE);
+			block[CFG_SECTIONS] = CFG_SEC_ALARMS;
+			block[CFG_ALARMS] = 6;
+			block[CFG_ALARMS + 1] = 10*k;
+			block[CFG_ALARMS + 2] = 255;
+			ok = ok && simNetWrite(address, NET_REG_CONFIG, block, CFG_SIZE);
+			status = simNetSettle(address);
+			ok = ok && !(status & NET_ST_BAD_CONFIG) && simNetRead(address, NET_REG_CONFIG, regs, CFG_SIZE)
+				&& !memcmp(regs + CFG_ALARMS, block + CFG_ALARMS, 3*ALARM_BITS/2)
+				&& nodes[k]->eeprom[0] == 6 && nodes[k]->eeprom[1] == 10*k;
+			printf("Equipo 0x%02X: alarma 06:%02u %s\n", address, 10*k, ok ? "guardada" : "FALLA");
+			failures += !ok;
+		}
+		
+		// Comida en los equipos pares; todos se leen sin pausa mientras tanto.
+		for(uint8_t k=0;k<count;k++){
+			uint8_t address = NET_ADDRESS + k;
+			uint8_t command[NET_COMMAND_SIZE] = {NET_CMD_DISPENSE, 0xFF, SIM_NET_FEED_G, 0};
+			meals[k] = simNetRead(address, NET_REG_MEALS, regs, 1) ? regs[0] : 0;
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				dropped[k][ch] = nodes[k]->hopperGrams[ch];
+				landed[k][ch] = nodes[k]->bowlGrams[ch];
+			}
+			if(!(k & 1) && !simNetWrite(address, NET_REG_COMMAND, command, NET_COMMAND_SIZE)){
+				printf("Equipo 0x%02X: FALLA: no acepto el comando\n", address);
+				failures++;
+			}
+		}
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do{
+			uint8_t busy = 0;
+			for(uint8_t k=0;k<count;k++){
+				if(simNetRead(NET_ADDRESS + k, NET_REG_STATUS, regs, NET_REG_MEAL - NET_REG_STATUS)){
+					polls++;
+					feeding |= (regs[0] & NET_ST_FEEDING) ? 1<<k : 0;
+					busy |= !(k & 1) && ((regs[0] & (NET_ST_PENDING|NET_ST_FEEDING)) || regs[NET_REG_MEALS - NET_REG_STATUS] == meals[k]);
+				}
+			}
+			if(!busy){
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}while(now.tv_sec - start.tv_sec < SIM_NET_FEED_S);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		printf("Comidas: %u lecturas en %.1f s mientras daban comida\n", polls,
+			now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec)/1e9);
+		for(uint8_t k=0;k<count;k++){
+			uint8_t address = NET_ADDRESS + k, fed = !(k & 1);
+			uint8_t ok = simNetRead(address, NET_REG_MEALS, regs, NET_REG_COMMAND - NET_REG_MEALS)
+				&& regs[0] == (uint8_t)(meals[k] + fed) && (!fed || ((feeding >> k) & 1));
+			for(uint8_t ch=0;ch<CHANNELS && ok && fed;ch++){
+				const uint8_t *meal = regs + NET_REG_MEAL - NET_REG_MEALS + NET_MEAL_SIZE*ch;
+				int16_t grams = meal[1] | meal[2] << 8;
+				float down = dropped[k][ch] - nodes[k]->hopperGrams[ch], bowl = nodes[k]->bowlGrams[ch] - landed[k][ch];
+				ok = meal[0] == DISPENSE_OK && fabsf(grams - down) <= SIM_NET_WEIGHT_G && abs(grams - SIM_NET_FEED_G) <= 3;
+				printf("Equipo 0x%02X: tolva %u resultado %u, %d g (bajaron %.1f g, al plato %.1f g)\n",
+					address, ch+1, meal[0], grams, down, bowl);
+			}
+			if(!fed){
+				printf("Equipo 0x%02X: sin comida, %u comidas\n", address, regs[0]);
+			}
+			if(!ok){
+				printf("Equipo 0x%02X: FALLA en la comida\n", address);
+			}
+			failures += !ok;
+		}
+		
+		// Rechazos: comando sin tolvas y escritura fuera del comando y la configuracin.
+		uint8_t bad[NET_COMMAND_SIZE] = {NET_CMD_DISPENSE, 0, SIM_NET_FEED_G, 0}, ok;
+		ok = simNetWrite(NET_ADDRESS, NET_REG_COMMAND, bad, NET_COMMAND_SIZE)
+			&& (simNetSettle(NET_ADDRESS) & NET_ST_BAD_COMMAND)
+			&& !simNetWrite(NET_ADDRESS, NET_REG_ID, bad, 1);
+		printf("Rechazos: %s\n", ok ? "OK" : "FALLA");
+		failures += !ok;
+		
+		// Direccin nueva para el ltimo equipo.
+		uint8_t from = NET_ADDRESS + count - 1, to = NET_ADDRESS + 0x20;
+		uint8_t move[NET_COMMAND_SIZE] = {NET_CMD_ADDRESS, to, NET_ADDRESS_KEY & 0xFF, NET_ADDRESS_KEY >> 8};
+		ok = simNetWrite(from, NET_REG_COMMAND, move, NET_COMMAND_SIZE) && !(simNetSettle(to) & NET_ST_BAD_COMMAND)
+			&& simNetRead(to, NET_REG_ID, regs, 1) && regs[0] == NET_ID
+			&& !simNetTransfer(from, NET_REG_ID, regs, 1, 1, 1) && nodes[count - 1]->eeprom[EE_NET_ADDRESS] == to;
+		printf("Cambio de direccion 0x%02X -> 0x%02X: %s\n", from, to, ok ? "OK" : "FALLA");
+		failures += !ok;
+		
+		for(uint8_t k=0;k<count;k++){
+			kill(-pids[k], SIGKILL);
+			waitpid(pids[k], NULL, 0);
+		}
+		printf("Red: %u equipos, %lu transacciones, %lu sin reconocer la direccion\n", count,
+			(unsigned long)simNet->transfers, (unsigned long)simNet->retries);
+		printf("Red: %s\n", failures ? "FALLA" : "OK");
 		
-		showWeightScreen();
+		return failures != 0;
 	}
+	#endif
 	
-	currentFoodAmount = get_units(100);
-
-	// Mostrar mensajes estticos.
-	LCD_wr_instruction(0b11000000);
-	LCD_wr_string("Dando comida...");
-	
-	// Dar comida.
-	while(currentFoodAmount > pastAmountFood-foodAmount){
-		OCR0 = 14;
-		_delay_ms(400);
-		OCR0 = 10;
-		_delay_ms(1000);
-		currentFoodAmount = get_units(1);
+	// Perfilado desde el ltimo arranque. En el host los ciclos son del tiempo virtual: cuentan
+	// esperas de buses, del LCD y del Hx711 como en el micro, pero no las instrucciones.
+	void simProfileDump(void){
+	#if PROFILE
+		static const char *const names[PROF_FUNCS] = {
+			"checkAlarms", "searchAlarms", "readTimeDate", "Hx711_ReadCount", "Acq_Service",
+			"LCD_wr_char", "LCD_wr_instruction", "EEPROM_read"
+		};
+		uint32_t now = Timer1_Cycles();
+		
+		printf("Perfil (%.1f s de Timer1, ciclos de %lu MHz):\n", now/(double)F_CPU, (unsigned long)(F_CPU/1000000UL));
+		printf("  %-18s %9s %12s %9s %9s %6s\n", "funcion", "llamadas", "total", "promedio", "maximo", "%");
+		for(uint8_t id=0;id<PROF_FUNCS;id++){
+			profileCounter *p = &profileCounters[id];
+			printf("  %-18s %9lu %12lu %9lu %9lu %5.1f%%\n", names[id], (unsigned long)p->calls, (unsigned long)p->total,
+				(unsigned long)(p->calls ? p->total/p->calls : 0), (unsigned long)p->max, now ? 100.0*p->total/now : 0);
+		}
+	#endif
 	}
-	OCR0 = 10;
-	
-	
-	
-	// Mostrar mensajes estticos.
-	LCD_wr_instruction(LCD_Cmd_Clear);			
-	LCD_wr_instruction(0b10000000);			
-	LCD_wr_string("=====Exito=====");
-	LCD_wr_instruction(0b11000000);
-	LCD_wr_string("Tortuguita feli");
-	_delay_ms(1000);
-	
-	showMainScreen();
-}
-
-void checkAlarms(){
-	if(searchAlarms() <= 0){
-		return;
-	}	
 	
-	readTimeDate();
-	if(pastAlarmHours == hours && pastAlarmMinutes == minutes){
-		return;
+	void simFinish(void){
+		printf("t=%.3f s  ultimo resultado=%u  reinicios=%u\n", sim->micros/1e6, lastDispenseResult, sim->resets);
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			printf("  tolva %u: %.1f g  plato=%.1f g  rechazos: %u saturadas, %u picos\n", ch+1, sim->hopperGrams[ch],
+				sim->bowlGrams[ch], channels[ch].filter.saturated, channels[ch].filter.spikes);
+			printf("    historial: %u ranuras, base %d g, consumo %u g/dia\n", histCount, channels[ch].history.base, History_Daily(ch));
+			if(channels[ch].rate){
+				printf("    despacho: %.1f g/s en la ultima comida\n", channels[ch].rate);
+			}
+		#if BOWL
+			if(channels[ch].rate){
+				printf("    plato: llegaron %.1f g de %.1f g que bajo la tolva\n", channels[ch].bowl.grams, channels[ch].bowl.dropped);
+			}
+		#endif
+			if(sim->tempSwing){
+				printf("    temperatura: deriva aprendida %.0f cuentas/C (modelo %d), peor error del cero %.2f g el primer dia, %.2f g despues\n",
+					channels[ch].temp.slope, SIM_HX_DRIFT, sim->tempWorst[ch][0], sim->tempWorst[ch][1]);
+			}
+		}
+		if(sim->flowFirst){
+			printf("Cayo comida de t=%.3f s a t=%.3f s (%.3f s)\n",
+				sim->flowFirst/1e6, sim->flowLast/1e6, (sim->flowLast - sim->flowFirst)/1e6);
+		}
+		if(acqSynced){
+			// Desfase contra el inicio verdadero de cada segundo del DS3231: el origen lo supone
+			// a la mitad del segundo, as que sin deriva queda dentro de +-1000 ms.
+			double rtcMs = (double)(sim->rtcBase - 946684800L)*1000 + sim->micros/1000.0;
+			double offset = (int32_t)(Acq_StampAt(timer1Frames, TCNT1) - acqOriginMs) - (rtcMs - acqOriginEpoch*1000.0);
+			printf("Hora de las muestras: %.4f ms por cuadro (reales %.4f, %+.0f ppm), desfase %+.0f ms\n",
+				acqFrameMs, sim->frameUs/1000, (acqFrameMs/(sim->frameUs/1000) - 1)*1e6, offset);
+		}
+		printf("I2C a %ld Hz: readTimeDate ocupa el bus %lu us\n",
+			(long)I2C_ACTUAL_CLOCK, (unsigned long)(i2cBusCycles/(F_CPU/1000000UL)));
+		if(sim->at24Pages){
+			printf("EEPROM externa: %lu escrituras de pagina con %lu bytes (%.1f por pagina), %lu sondeos sin respuesta\n",
+				(unsigned long)sim->at24Pages, (unsigned long)sim->at24Bytes, (double)sim->at24Bytes/sim->at24Pages,
+				(unsigned long)sim->at24Polls);
+		}
+		if(sim->listMeals){
+			simMealLogPrint(sim->at24, at24Head);
+		}
+		if(histDaysLeft == HIST_UNKNOWN){
+			printf("Pronostico: sin consumo suficiente\n");
+		}
+		else{
+			printf("Pronostico: %u dias de comida en la tolva que se acaba primero\n", histDaysLeft);
+		}
+		printf("Arranque (ms desde Timer1):");
+		for(uint8_t i=0;i<BOOT_PHASES;i++){
+			printf(" %.8s=%.2f", (const char *)bootPhaseNames[i], bootStamps[i]*1000.0/F_CPU);
+		}
+		printf("\nPrimera pantalla en %.2f ms (presupuesto %d ms)\n", bootStamps[BOOT_DISPLAY]*1000.0/F_CPU, BOOT_BUDGET_MS);
+		printf("+----------------+\n|%s|\n|%s|\n+----------------+\n", sim->lcd[0], sim->lcd[1]);
+	#if PROFILE
+		simProfileDump();
+	#endif
+		exit(0);
 	}
 	
-	uint8_t hoursRegister1 = 0, minutesRegister1 = 0;
-
-	for(uint8_t i=0;i<ALARM_BITS;i+=2){
-		hoursRegister1 = EEPROM_read(i);
-		if(hoursRegister1 != 255){
-			minutesRegister1 = EEPROM_read(i+1);
+	// Precisin del corte (-S n): n comidas de 20 a 60 g con cada tasa de despacho. El error
+	// es lo que lleg al plato menos lo pedido; el tiempo es el de la compuerta abierta.
+	void simStopBenchmark(void){
+		const uint8_t rates[2] = {HX_RATE_10SPS, HX_RATE_80SPS};
+		
+		LCD_init();
+		Channels_Init();
+		Servo_Init();
+		sei();
+		sim->endMicros = UINT64_MAX;
+		
+		for(uint8_t r=0;r<2;r++){
+			double sum = 0, sumSq = 0, worst = 0, flowTime = 0;
+			uint16_t meals = 0;
+			uint32_t rejected = 0;
 			
-			if(hoursRegister1 == hours && minutesRegister1 == minutes){
-				pastAlarmHours = hours;
-				pastAlarmMinutes = minutes;
+			hxDispenseRate = rates[r];
+			for(uint16_t t=0;t<sim->benchTrials;t++){
+				int amount = 20 + (t*7) % 41;
+				for(uint8_t ch=0;ch<CHANNELS;ch++){
+					sim->hopperGrams[ch] = 500;
+					sim->bowlGrams[ch] = 0;
+				}
+				sim->flowFirst = 0;
+				showGivingFoodScreen(amount, ALL_CHANNELS);
+				flowTime += (sim->flowLast - sim->flowFirst)/1e6;
 				
-				showGivingFoodScreen(30);
+				for(uint8_t ch=0;ch<CHANNELS;ch++){
+					double error = sim->bowlGrams[ch] - amount;
+					sum += error;
+					sumSq += error*error;
+					if(fabs(error) > fabs(worst)){
+						worst = error;
+					}
+					rejected += channels[ch].filter.saturated + channels[ch].filter.spikes;
+					meals++;
+				}
 			}
+			
+			double mean = sum/meals;
+			printf("%2d muestras/s: error medio %+.2f g  desviacion %.2f g  peor %+.2f g  compuerta %.2f s/comida (%u comidas, %lu rechazadas)\n",
+				HX_SPS(rates[r]), mean, sqrt(sumSq/meals - mean*mean), worst, flowTime/sim->benchTrials, meals, (unsigned long)rejected);
 		}
+		exit(0);
 	}
 	
-	return;
-}
-	
-
-// Prints.
-void printValues8BitsTimeFormat(uint8_t valor){
-	uint8_t num[8] = {0};
-	uint8_t i = 0;
-	
-	if(valor == 0){
-		LCD_wr_string("00");
-		return;
-	}
-	
-	while(valor > 0){
-		num[i] = valor%10;
-		valor /= 10;
-		i++;
+	// Cuenta grabada ms reciente de la tolva al tiempo del Timer1: la reproduccin retiene
+	// cada muestra del trace hasta la siguiente, sin importar cundo la pida el firmware.
+	long simReplayHx(uint8_t channel){
+	#if TRACE
+		uint64_t now = (uint64_t)Trace_Now()*TRACE_TICK_US;
+		while(simReplayNext < simReplayCount && simReplay[simReplayNext].us <= now){
+			simTraceEvent *e = &simReplay[simReplayNext++];
+			if(e->type == TR_HX && e->arg < CHANNELS){
+				simReplayLast[e->arg] = e->value;
+			}
+		}
+	#endif
+		return simReplayLast[channel];
 	}
 	
-	int validacion = 0;
-	for(int i=7;i>=0;i--){
-		if(validacion == 1){
-			LCD_wr_char(num[i] + 48);
+	// Decodifica un trace. Los tiempos se reconstruyen con los dt; cada TR_BOOT empieza un
+	// arranque nuevo con el Timer1 en cero. Regresa los registros o -1 si no se puede leer.
+	int simTraceLoad(const char *path, simTraceEvent **events, uint32_t *lost){
+		static const uint8_t length[TR_TYPES] = {1, 4, 3, 4, 1, 1, 3, 4, 2};
+		FILE *f = fopen(path, "rb");
+		uint64_t ticks = 0;
+		uint8_t session = 0, data[4];
+		int count = 0, size = 0, header;
+		
+		if(!f){
+			return -1;
 		}
-		if(num[i] != 0 && validacion == 0){
-			if(i==0){
-				i+=2;
+		*events = NULL;
+		*lost = 0;
+		while((header = fgetc(f)) != EOF){
+			uint8_t type = header & 0x0F, dt[2];
+			if(type >= TR_TYPES || fread(dt, 1, 2, f) != 2 || fread(data, 1, length[type], f) != length[type]){
+				break;								// Registro cortado o basura al final.
 			}
-			else if(i==1){
-				i++;
+			uint32_t value = 0;
+			for(uint8_t i=length[type];i>0;i--){
+				value = value<<8 | data[i-1];
 			}
-			validacion = 1;
+			
+			ticks += dt[0] | dt[1]<<8;
+			if(type == TR_BOOT){
+				ticks = dt[0] | dt[1]<<8;
+				session++;
+			}
+			else if(type == TR_SYNC){
+				ticks = value;
+			}
+			else if(type == TR_LOST){
+				*lost += value;
+			}
+			if(count == size){
+				size = size ? 2*size : 1024;
+				*events = realloc(*events, size*sizeof(simTraceEvent));
+			}
+			(*events)[count++] = (simTraceEvent){ticks*TRACE_TICK_US, type, header >> 4, session, value};
 		}
+		fclose(f);
 		
-	}
-}
-
-void printValues8Bits(uint8_t valor){
-	uint8_t num[8] = {0};
-	uint8_t i = 0;
-	
-	while(valor > 0){
-		num[i] = valor%10;
-		valor /= 10;
-		i++;
+		return count;
 	}
 	
-	int validacion = 0;
-	for(int i=7;i>=0;i--){
-		if(num[i] != 0){
-			validacion = 1;
+	// Comidas del trace, una por tolva: gramos, resultado y ciclos que report el firmware,
+	// duracin y latencia del corte (ltima muestra del Hx711 antes de cerrar la compuerta).
+	int simTraceFeeds(simTraceEvent *events, int count, simTraceFeed *feeds){
+		int open[CHANNELS], n = 0;
+		uint64_t lastHx[CHANNELS] = {0};
+		
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			open[ch] = -1;
 		}
-		else if(validacion == 1){
-			LCD_wr_char(num[i] + 48);
+		for(int i=0;i<count;i++){
+			simTraceEvent *e = &events[i];
+			uint8_t ch = e->arg;
+			if(e->type == TR_BOOT){
+				for(ch=0;ch<CHANNELS;ch++){
+					open[ch] = -1;					// Cortada por el reinicio: la termina el arranque.
+				}
+			}
+			else if(e->type == TR_FEED){
+				for(ch=0;ch<CHANNELS && n < SIM_TRACE_FEEDS;ch++){
+					if(e->value & (1<<ch)){
+						feeds[n] = (simTraceFeed){e->session, ch, 255, 0, e->value >> 8, 0, e->us, 0, 0, 0};
+						open[ch] = n++;
+					}
+				}
+			}
+			else if(ch >= CHANNELS || open[ch] < 0){
+				continue;
+			}
+			else if(e->type == TR_HX){
+				lastHx[ch] = e->us;
+			}
+			else if(e->type == TR_SERVO && e->value == MOTION_CLOSE && !feeds[open[ch]].close){
+				feeds[open[ch]].close = e->us;
+				feeds[open[ch]].lastHx = lastHx[ch];
+			}
+			else if(e->type == TR_RESULT){
+				simTraceFeed *f = &feeds[open[ch]];
+				f->result = e->value & 0xFF;
+				f->grams = (int16_t)(e->value >> 8);
+				f->cycles = e->value >> 24;
+				f->end = e->us;
+				open[ch] = -1;
+			}
 		}
+		
+		return n;
 	}
-}
-
-void printValues(long valor){
-	if(valor <= 0){
-		LCD_wr_string("0");
-		return;
-	}
-	
-	uint8_t num[24] = {0};
-	uint8_t i = 0;
 	
-	while(valor > 0){
-		num[i] = valor%10;
-		valor /= 10;
-		i++;
+	int simTraceSummary(const char *path, simTraceFeed *feeds){
+		simTraceEvent *events;
+		uint32_t lost;
+		int count = simTraceLoad(path, &events, &lost);
+		
+		if(count < 0){
+			printf("No se pudo leer el trace %s\n", path);
+			return -1;
+		}
+		int n = simTraceFeeds(events, count, feeds);
+		printf("Trace %s: %d registros, %u arranques, %lu perdidos\n", path, count,
+			count ? events[count-1].session : 0, (unsigned long)lost);
+		for(int i=0;i<n;i++){
+			simTraceFeed *f = &feeds[i];
+			printf("  arranque %u tolva %u: pedido %d g  entregado %d g  resultado %u  %u ciclos  %.3f s  corte %.1f ms tras la muestra\n",
+				f->session, f->channel+1, f->amount, f->grams, f->result, f->cycles,
+				f->end > f->start ? (f->end - f->start)/1e6 : 0, f->close ? (f->close - f->lastHx)/1e3 : 0);
+		}
+		free(events);
+		
+		return n;
 	}
 	
-	int validacion = 0;
-	for(int i=23;i>=0;i--){
-		if(num[i] != 0){
-			validacion = 1;
+	// Diferencia comida por comida entre el trace grabado y el de la reproduccin.
+	void simTraceDiff(const char *before, const char *after){
+		simTraceFeed a[SIM_TRACE_FEEDS], b[SIM_TRACE_FEEDS];
+		int na = simTraceSummary(before, a), nb = simTraceSummary(after, b);
+		
+		if(na < 0 || nb < 0){
+			return;
 		}
-		if(validacion == 1){
-			LCD_wr_char(num[i] + 48);
+		if(na != nb){
+			printf("Diferencia: %d comidas contra %d\n", na, nb);
+		}
+		for(int i=0;i<na && i<nb;i++){
+			printf("Diferencia tolva %u: %+d g  %+d ciclos  %+.3f s  corte %+.1f ms%s\n", a[i].channel+1,
+				b[i].grams - a[i].grams, b[i].cycles - a[i].cycles,
+				((double)b[i].end - b[i].start - ((double)a[i].end - a[i].start))/1e6,
+				((double)b[i].close - b[i].lastHx - ((double)a[i].close - a[i].lastHx))/1e3,
+				a[i].result != b[i].result ? "  (otro resultado)" : "");
 		}
 	}
-}
-
-void printValuesWithDecimal(float valor){
-	// Valor entero.
-	long int valorInt = valor;
-	
-	// Valor de los decimales en entero.
-	long int decimalValorInt = (valor-valorInt)*100;
 	
-	if(valor <= 0){
-		LCD_wr_string("0");
-		return;
+	// Prepara la reproduccin: el primer arranque del trace da las cuentas de los Hx711, la
+	// hora del DS3231 y las pulsaciones de los botones. Regresa el tiempo del ltimo registro.
+	uint64_t simReplayLoad(const char *path){
+		simTraceEvent *events;
+		uint32_t lost;
+		int count = simTraceLoad(path, &events, &lost);
+		uint8_t buttons = 0, rtcSet = 0;
+		
+		if(count <= 0){
+			printf("No se pudo leer el trace %s\n", path);
+			exit(1);
+		}
+		while(simReplayCount < count && events[simReplayCount].session <= 1){
+			simTraceEvent *e = &events[simReplayCount++];
+			if(e->type == TR_HX && e->arg < CHANNELS && !simReplayLast[e->arg]){
+				simReplayLast[e->arg] = e->value;
+			}
+			else if(e->type == TR_RTC && !rtcSet){
+				sim->rtcBase = e->value + 946684800L - e->us/1000000;	// poca del firmware: 2000-01-01.
+				rtcSet = 1;
+			}
+			else if(e->type == TR_BUTTONS){
+				for(uint8_t bit=0;bit<8;bit++){
+					if((e->value & ~buttons & (1<<bit)) && sim->pressCount < SIM_MAX_PRESSES){
+						sim->pressAt[sim->pressCount] = e->us/1000;
+						sim->pressMs[sim->pressCount] = 0xFFFF;
+						sim->pressBtn[sim->pressCount++] = bit;
+					}
+					if(buttons & ~e->value & (1<<bit)){
+						for(uint8_t i=0;i<sim->pressCount;i++){
+							if(sim->pressBtn[i] == bit && sim->pressMs[i] == 0xFFFF){
+								sim->pressMs[i] = e->us/1000 - sim->pressAt[i] + 1;
+							}
+						}
+					}
+				}
+				buttons = e->value;
+			}
+		}
+		simReplay = events;
+		
+		return events[simReplayCount-1].us;
 	}
 	
-	LCD_wr_instruction(LCD_Cmd_Clear);			// Limpiar el display
-	LCD_wr_instruction(0b10000000);				// Posicin cero.
-	
-	uint8_t num[10] = {0};
-	uint8_t decimals[10] = {0};
-	uint8_t i = 0;
-	
-	// Obtener valores de la parte entera.
-	while(valorInt > 0){
-		num[i] = valorInt%10;
-		valorInt /= 10;
-		i++;
+	// Resultado de la prueba de resistencia: cada alarma se atiende exactamente una vez cada
+	// da en que su hora qued entre el inicio y el final (menos la ventana de gracia); fuera
+	// de eso, a lo ms una vez. Regresa el nmero de fallas.
+	uint32_t simSoakReport(uint32_t startEpoch, double wall){
+		uint32_t endEpoch = simRtcEpoch(), failures = 0;
+		double days = sim->micros/(SECONDS_PER_DAY*1e6);
+		
+		printf("Resistencia: %.1f dias simulados en %.1f s (%.1f dias/s), %u cortes de luz, %u cambios de hora, %u rellenos\n",
+			days, wall, days/wall, sim->soakCuts, sim->soakShifts, sim->soakRefills);
+		for(uint8_t i=0;i<ALARM_BITS;i+=2){
+			uint32_t expected = 0, once = 0, missing = 0, repeated = 0;
+			if(sim->eeprom[i] == 255){
+				continue;
+			}
+			for(uint16_t d=0;d<SIM_SOAK_DAYS;d++){
+				uint32_t at = (sim->soakFirstDay + d)*SECONDS_PER_DAY + sim->eeprom[i]*3600UL + sim->eeprom[i+1]*60;
+				uint8_t fired = sim->soakFired[i/2][d];
+				if(at >= startEpoch && at + ALARM_GRACE_S <= endEpoch){
+					expected++;
+					once += fired == 1;
+					missing += fired == 0;
+				}
+				if(fired > 1){
+					repeated++;
+				}
+				if(fired != (at >= startEpoch && at + ALARM_GRACE_S <= endEpoch) && (fired > 1 || at + ALARM_GRACE_S <= endEpoch) && failures++ < 10){
+					Clock_Split(at);
+					printf("  FALLA: alarma %u el %02u/%02u/%02u a las %02u:%02u atendida %u veces\n",
+						i/2+1, date, month, year, hours, minutes, fired);
+				}
+			}
+			printf("  alarma %u (%02u:%02u): %lu esperadas, %lu una vez, %lu faltantes, %lu repetidas\n", i/2+1,
+				sim->eeprom[i], sim->eeprom[i+1], (unsigned long)expected, (unsigned long)once, (unsigned long)missing, (unsigned long)repeated);
+		}
+		printf("Pila en el host: %lu bytes como maximo (%lu el primer dia)\n",
+			(unsigned long)sim->stackDeepest, (unsigned long)sim->stackFirstDay);
+		printf("Resistencia: %s\n", failures ? "FALLA" : "OK");
+		
+		return failures;
 	}
 	
-	i=0;
-	
-	// Obtener valores de la parte decimal.
-	while(decimalValorInt > 0){
-		decimals[i] = decimalValorInt%10;
-		decimalValorInt /= 10;
-		i++;
-	}
+	int firmwareMain(void);
 	
-	// Imprimir valores de la parte entera.
-	int validacion = 0;
-	for(int i=9;i>=0;i--){
-		if(num[i] != 0){
-			validacion = 1;
+	int main(int argc, char **argv){
+		struct tm start = {0};
+		int opt_h, opt_m, opt_y, opt_mo, opt_d;
+		double opt_s;
+		const char *opt_replay = NULL, *opt_out = NULL, *opt_summary[2] = {NULL, NULL}, *opt_link = NULL;
+		uint8_t opt_end = 0;
+	#if NET
+		uint8_t opt_nodes = 0;
+	#endif
+		
+		if(argc > 1 && !strcmp(argv[1], "-U")){
+			return simLinkCli(argc, argv);
 		}
-		if(validacion == 1){
-			LCD_wr_char(num[i] + 48);
+		sim = mmap(NULL, sizeof(*sim), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		memset(sim->eeprom, 0xFF, sizeof(sim->eeprom));
+		memset(sim->at24, 0xFF, sizeof(sim->at24));
+		memset(sim->lcd, ' ', sizeof(sim->lcd));
+		sim->lcd[0][16] = sim->lcd[1][16] = 0;
+		sim->endMicros = 120000000ULL;
+		sim->nextFrame = sim->frameUs = SERVO_FRAME_US;
+		for(uint8_t ch=0;ch<CHANNELS;ch++){
+			sim->hopperGrams[ch] = 500;
+			sim->hxNextReady[ch] = 400000;
+			simHxGain[ch] = HX_GAIN_A128;
 		}
-	}
-	
-	// Imprimir punto.
-	LCD_wr_char(46);
-	
-	// Imprimir valores de la parte decimal.
-	validacion = 0;
-	for(int i=9;i>=0;i--){
-		if(decimals[i] != 0){
-			validacion = 1;
+		start.tm_year = 122; start.tm_mon = 5; start.tm_mday = 9; start.tm_hour = 12;
+		
+		for(int i=1;i<argc;i++){
+			if(!strcmp(argv[i], "-t") && i+1 < argc){
+				sim->endMicros = (uint64_t)(atof(argv[++i])*1e6);
+				opt_end = 1;
+			}
+			else if(!strcmp(argv[i], "-d") && i+1 < argc && sscanf(argv[++i], "%d-%d-%d", &opt_y, &opt_mo, &opt_d) == 3){
+				start.tm_year = opt_y - 1900; start.tm_mon = opt_mo - 1; start.tm_mday = opt_d;
+			}
+			else if(!strcmp(argv[i], "-T") && i+1 < argc && sscanf(argv[++i], "%d:%d", &opt_h, &opt_m) == 2){
+				start.tm_hour = opt_h; start.tm_min = opt_m;
+			}
+			else if(!strcmp(argv[i], "-a") && i+1 < argc && sscanf(argv[++i], "%d:%d", &opt_h, &opt_m) == 2){
+				int opt_ch = 0;
+				sscanf(argv[i], "%*d:%*d:%d", &opt_ch);
+				for(uint8_t j=0;j<ALARM_BITS;j+=2){
+					if(sim->eeprom[j] == 255){
+						sim->eeprom[j] = opt_h;
+						sim->eeprom[j+1] = opt_m;
+						sim->eeprom[EE_ALARM_CHANNELS + j/2] = opt_ch > 0 ? 1<<(opt_ch - 1) : 255;
+						break;
+					}
+				}
+			}
+			else if(!strcmp(argv[i], "-k") && i+1 < argc && sim->pressCount < SIM_MAX_PRESSES
+					&& sscanf(argv[++i], "%d:%d", &opt_m, &opt_h) == 2){
+				int opt_len = 100;
+				sscanf(argv[i], "%*d:%*d:%d", &opt_len);
+				sim->pressAt[sim->pressCount] = opt_m;
+				sim->pressMs[sim->pressCount] = opt_len;
+				sim->pressBtn[sim->pressCount++] = opt_h;
+			}
+			else if(!strcmp(argv[i], "-w") && i+1 < argc){
+				int opt_ch;
+				if(sscanf(argv[++i], "%d:%lf", &opt_ch, &opt_s) == 2 && opt_ch >= 1 && opt_ch <= CHANNELS){
+					sim->hopperGrams[opt_ch - 1] = opt_s;
+				}
+				else{
+					for(uint8_t ch=0;ch<CHANNELS;ch++){
+						sim->hopperGrams[ch] = atof(argv[i]);
+					}
+				}
+			}
+			else if(!strcmp(argv[i], "-C") && i+1 < argc){
+				sim->tempSwing = atof(argv[++i]);
+			}
+			else if(!strcmp(argv[i], "-F") && i+1 < argc){
+				sim->nextFrame = sim->frameUs = SERVO_FRAME_US*1e6/(1e6 + atof(argv[++i]));
+			}
+			else if(!strcmp(argv[i], "-G") && i+1 < argc){
+				sim->spill = atof(argv[++i])/100;
+			}
+			else if(!strcmp(argv[i], "-X") && i+1 < argc){
+				sim->hxCorruptEvery = atoi(argv[++i]);
+			}
+			else if(!strcmp(argv[i], "-S") && i+1 < argc){
+				sim->benchTrials = atoi(argv[++i]);
+			}
+			else if(!strcmp(argv[i], "-M") && i+1 < argc && atoi(argv[i+1]) > 0){
+				sim->soakDays = atoi(argv[++i]) < SIM_SOAK_DAYS ? atoi(argv[i]) : SIM_SOAK_DAYS - 1;
+			}
+		#if TRACE
+			else if(!strcmp(argv[i], "-O") && i+1 < argc){
+				opt_out = argv[++i];
+			}
+			else if(!strcmp(argv[i], "-R") && i+1 < argc){
+				opt_replay = argv[++i];
+			}
+			else if(!strcmp(argv[i], "-Y") && i+1 < argc){
+				opt_summary[opt_summary[0] != NULL] = argv[++i];
+			}
+		#endif
+		#if LINK
+			else if(!strcmp(argv[i], "-Q") && i+1 < argc){
+				opt_link = argv[++i];
+			}
+		#endif
+		#if NET
+			else if(!strcmp(argv[i], "-W") && i+1 < argc && atoi(argv[i+1]) >= 1 && atoi(argv[i+1]) <= SIM_NET_NODES){
+				opt_nodes = atoi(argv[++i]);
+			}
+		#endif
+			else if(!strcmp(argv[i], "-E") && i+1 < argc){
+				sim->eeCutAt = atoi(argv[++i]);
+			}
+			else if(!strcmp(argv[i], "-L")){
+				sim->listMeals = 1;
+			}
+			else if(!strcmp(argv[i], "-j")){
+				sim->jammed = ALL_CHANNELS;
+			}
+			else if(!strcmp(argv[i], "-J") && i+1 < argc){
+				sim->jammed |= 1 << (atoi(argv[++i]) - 1);
+			}
+			else if(!strcmp(argv[i], "-H") && i+1 < argc){
+				sim->hangFrom = (uint64_t)(atof(argv[++i])*1e6);
+				sim->hangUntil = sim->hangFrom + 3000000;
+			}
+			else if((!strcmp(argv[i], "-P") || !strcmp(argv[i], "-B")) && i+1 < argc
+					&& sim->resetCount < SIM_MAX_RESETS && sscanf(argv[i+1], "%lf", &opt_s) == 1){
+				sim->resetAt[sim->resetCount] = (uint64_t)(opt_s*1e6);
+				sim->resetCause[sim->resetCount++] = argv[i][1] == 'P' ? PORF : BORF;
+				i++;
+			}
+			else{
+				printf("uso: %s [-t segundos] [-d AAAA-MM-DD] [-T HH:MM] [-a HH:MM[:tolva]]... [-k ms:boton[:duracion]]...\n"
+					   "          [-w [tolva:]gramos]... [-j (todas atascadas)] [-J tolva]... [-H s (bus I2C colgado 3 s)]\n"
+					   "          [-P s (corte de luz)]... [-B s (brown-out)]... [-S comidas (precision del corte)]\n"
+					   "          [-X n (una de cada n muestras del Hx711 corrupta)] [-M dias (prueba de resistencia)]\n"
+					   "          [-C grados (onda diaria de temperatura)] [-E n (corte de luz en la escritura n de la EEPROM)]\n"
+					   "          [-L (listar el registro de comidas de la EEPROM externa)] [-F ppm (el Timer1 adelanta al DS3231)]\n"
+					   "          [-G porcentaje (comida que no llega al plato)]\n", argv[0]);
+			#if TRACE
+				printf("       trace: [-O archivo (grabar)] [-R archivo (reproducir, con las mismas -a)] [-Y archivo [-Y otro]]\n");
+			#endif
+			#if LINK
+				printf("       enlace: [-Q ruta (pty para el cliente, en tiempo real)]\n");
+			#endif
+			#if NET
+				printf("       red: [-W equipos (1 a %u equipos en un bus con un coordinador, en tiempo real)]\n", SIM_NET_NODES);
+			#endif
+				printf("       %s -U puerto leer|escribir|comidas|muestras ... (cliente del enlace, sin simular)\n", argv[0]);
+				return 1;
+			}
 		}
-		if(validacion == 1){
-			LCD_wr_char(decimals[i] + 48);
+		sim->rtcBase = timegm(&start);
+		
+		// Trace: resumir (y comparar) sin simular, o grabar y reproducir.
+		if(opt_summary[0]){
+			if(opt_summary[1]){
+				simTraceDiff(opt_summary[0], opt_summary[1]);
+			}
+			else{
+				simTraceFeed feeds[SIM_TRACE_FEEDS];
+				simTraceSummary(opt_summary[0], feeds);
+			}
+			return 0;
+		}
+		if(opt_replay){
+			uint64_t last = simReplayLoad(opt_replay);
+			if(!opt_end){
+				sim->endMicros = last + 2000000;
+			}
+		}
+		if(opt_out && !(simTraceOut = fopen(opt_out, "wb"))){
+			printf("No se pudo crear %s\n", opt_out);
+			return 1;
+		}
+		if(opt_link){
+			if((simLinkFd = simLinkOpen(opt_link)) < 0){
+				printf("No se pudo crear la pty %s\n", opt_link);
+				return 1;
+			}
+			sim->realTime = 1;
+			clock_gettime(CLOCK_MONOTONIC, &sim->paceStart);
+		}
+	#if NET
+		// Red: este proceso queda de coordinador y cada equipo sigue con su propio arranque.
+		if(opt_nodes){
+			struct simState *nodes[SIM_NET_NODES];
+			pid_t pids[SIM_NET_NODES];
+			if(!opt_end){
+				sim->endMicros = SIM_NET_END_S*1000000ULL;
+			}
+			if(!simNetSpawn(opt_nodes, nodes, pids)){
+				return simNetCoordinate(opt_nodes, nodes, pids);
+			}
+		}
+	#endif
+		
+		// Prueba de resistencia: alarmas por defecto en la hora que salta el cambio de horario,
+		// en la maana y antes de medianoche (su ventana de gracia cruza el da).
+		struct timespec wallStart;
+		uint32_t soakStart = simRtcEpoch();
+		clock_gettime(CLOCK_MONOTONIC, &wallStart);
+		if(sim->soakDays){
+			static const uint8_t soakAlarms[3][2] = {{2, 30}, {7, 30}, {23, 55}};
+			if(sim->eeprom[0] == 255){
+				for(uint8_t j=0;j<3;j++){
+					sim->eeprom[2*j] = soakAlarms[j][0];
+					sim->eeprom[2*j+1] = soakAlarms[j][1];
+					sim->eeprom[EE_ALARM_CHANNELS + j] = 255;
+				}
+			}
+			if(!opt_end){
+				sim->endMicros = sim->soakDays*SECONDS_PER_DAY*1000000ULL;
+			}
+			sim->soakFirstDay = soakStart/SECONDS_PER_DAY;
+			sim->soakSeed = 1;
+			sim->soakNextCut = simSoakRandom(SIM_SOAK_CUT_MIN_S, SIM_SOAK_CUT_MAX_S)*1000000ULL;
+			simSoakShift();
+		}
+		
+		// Cada vuelta es un arranque del micro con la causa de reinicio en MCUCSR.
+		uint8_t resetFlags = 1<<PORF;
+		while(1){
+			fflush(stdout);
+			pid_t pid = fork();
+			if(pid == 0){
+				uint8_t stackTop;
+				sim->stackTop = (uintptr_t)&stackTop;
+				MCUCSR = resetFlags;
+				if(sim->benchTrials){
+					simStopBenchmark();
+				}
+				firmwareMain();
+				exit(0);
+			}
+			
+			int status;
+			waitpid(pid, &status, 0);
+			if(!WIFEXITED(status)){
+				return 1;
+			}
+			if(WEXITSTATUS(status) < SIM_EXIT_RESET){
+				if(opt_replay && opt_out){
+					fclose(simTraceOut);
+					simTraceDiff(opt_replay, opt_out);
+				}
+				if(sim->soakDays){
+					struct timespec wallEnd;
+					clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+					return simSoakReport(soakStart, wallEnd.tv_sec - wallStart.tv_sec + (wallEnd.tv_nsec - wallStart.tv_nsec)/1e9) != 0;
+				}
+				return WEXITSTATUS(status);
+			}
+			resetFlags = 1 << (WEXITSTATUS(status) - SIM_EXIT_RESET);
+			sim->resets++;
+			if(sim->soakOffUs){
+				sim->micros += sim->soakOffUs;			// Apagado: el DS3231 sigue con su pila.
+				sim->nextFrame = sim->micros - sim->micros % SERVO_FRAME_US + sim->frameUs;
+				sim->soakOffUs = 0;
+			}
+			if(resetFlags & ((1<<PORF)|(1<<BORF))){
+				for(uint8_t ch=0;ch<CHANNELS;ch++){
+					sim->hxNextReady[ch] = sim->micros + 400000;	// Los Hx711 tambin se apagaron: asentamiento de 400 ms.
+				}
+			}
 		}
 	}
-	
-	_delay_ms(300);
-}
+#endif
 
 
 
 // ----------------------- Cdigo principal -----------------------
 
+#if BOARD == BOARD_HOST
+int firmwareMain(void)
+#else
 int main(void)
+#endif
 {		
-	// Inicializacion del LCD
-	   LCD_init();
-	   LCD_wr_instruction(0b10000000);
+	// Causa del reinicio.
+		uint8_t resetFlags = MCUCSR;
+		MCUCSR = 0;
+	#if CHANNELS > 2
+	// Los Hx711 de las tolvas 3 y 4 usan PC2-PC5: apagar JTAG (dos escrituras seguidas).
+		MCUCSR = (1<<JTD);
+		MCUCSR = (1<<JTD);
+	#endif
+	#if WATCHDOG
+		wdt_enable(WDTO_2S);
+	#endif
 
-    // Configuracion del puerto B
-		DDRB = 0b00001000;
-		PORTB = 0b00000111;
+    // Configuracion de los botones (entradas con pull-up).
+		DDRBTN &= ~((1<<BTN_LEFT)|(1<<BTN_MIDDLE)|(1<<BTN_RIGHT));
+		PORTBTN |= (1<<BTN_LEFT)|(1<<BTN_MIDDLE)|(1<<BTN_RIGHT);
 	   
-	// Configuracion del puerto D
-		DDRD = 0b00110010;
-		PORTD = 0b00000000;
+	// Configuracion de los Hx711 y los servos de cada tolva, con lo guardado por el enlace.
+		Channels_Init();
+		Config_Load();
+		
+	// Iniciar motores con las compuertas cerradas. El Timer1 tambin marca las fases del arranque.
+		Servo_Init();
+		sei();
+		BOOT_MARK(BOOT_TIMER);
+	#if USART_USED
+		Usart_Init();
+	#endif
+	#if PROFILE
+		Profile_Reset();
+	#endif
+		TRACE_EVENT(TR_BOOT, CHANNELS, &resetFlags, 1);
+		
+	// Arranque en caliente: si el watchdog o un brown-out cortaron una comida, terminarla ya.
+		uint8_t resumed = 0;
+		if((resetFlags & ((1<<WDRF)|(1<<BORF))) && Checkpoint_Pending()){
+			resumeDispense();
+			resumed = 1;
+		}
+		BOOT_MARK(BOOT_RESUME);
 	
-	// Inicializar I2C.
+	// Hora y alarmas primero: el bus I2C no depende del LCD y corre mientras el HD44780 enciende.
 		I2C_Init();
-		
-	// Obtener tiempo.
 		readTimeDate();
+		BOOT_MARK(BOOT_RTC);
+		uint8_t alarmAtBoot = alarmDue();
+		BOOT_MARK(BOOT_ALARM);
+	
+	// Inicializacion del LCD: solo se espera lo que falte de su encendido.
+		while(Timer1_Cycles() - bootStamps[BOOT_TIMER] < LCD_POWER_UP_MS*(F_CPU/1000UL)){
+			_delay_us(100);
+		}
+		LCD_init();
+		BOOT_MARK(BOOT_LCD);
+		
+	// Arranque en fro con una comida pendiente (se fue la luz por completo): terminarla.
+		if(!resumed && Checkpoint_Pending()){
+			LCD_draw_screen(layoutWait);
+			resumeDispense();
+		}
 		
-	// Iniciar motor.
-		TCNT0 = 0;
-		OCR0 = 10;
-		TCCR0 = 0b01101100;
+	// Primera pantalla vlida sobre el LCD recin borrado: la de espera si toca dar comida
+	// (la atiende la primera vuelta de la pantalla principal), si no la principal completa.
+		if(alarmAtBoot){
+			LCD_draw(layoutWait, FMT_ALL);
+		}
+		else{
+			Clock_Show();
+			LCD_draw(layoutMain, FMT_ALL);
+			mainScreenDrawn = 1;
+		}
+		BOOT_MARK(BOOT_DISPLAY);
+		
+	// Inicializacin no crtica: descartar la primera conversin del Hx711 (~400 ms de
+	// asentamiento tras encender). Si hay que dar comida, sus pesadas ya la absorben.
+		if(!alarmAtBoot){
+			for(uint8_t ch=0;ch<CHANNELS;ch++){
+				Hx711_ReadCount(ch);
+			}
+		}
+		History_Init();
+	#if NET
+		Net_Init();
+	#endif
+		BOOT_MARK(BOOT_DEFERRED);
 		
-	// Mostrar pantalla principal.
-		showMainScreen();
+	// Navegacin entre pantallas: cada pantalla regresa la siguiente.
+		uint8_t screen = SCREEN_MAIN;
+		while(1){
+			switch(screen){
+				case SCREEN_WEIGHT: screen = showWeightScreen(); break;
+				case SCREEN_AGEND:  screen = showAgendOptions(); break;
+				case SCREEN_DELETE: screen = showDeleteAlarms(); break;
+				case SCREEN_ADD:    screen = showAddAlarms(); break;
+				case SCREEN_GIVE:   screen = showGiveFoodScreen(); break;
+				case SCREEN_BOOT:   screen = showBootScreen(); break;
+				default:            screen = showMainScreen(); break;
+			}
+		}
 }